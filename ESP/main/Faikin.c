@@ -6,6 +6,8 @@ static const char TAG[] = "Faikin";
 #include "revk.h"
 #include "esp_sleep.h"
 #include "esp_task_wdt.h"
+#include "esp_random.h"
+#include "nvs.h"
 #include <driver/gpio.h>
 #include <driver/uart.h>
 #include "esp_http_server.h"
@@ -257,6 +259,7 @@ struct
    uint64_t status_known;       // Which fields we know, and hence can control
    uint8_t control_count;       // How many times we have tried to change control and not worked yet
    uint32_t statscount;         // Count for b() i(), etc.
+   uint32_t version;            // Bumped on any change to status, for ETag
 #define	b(name)		uint8_t	name;uint32_t total##name;
 #define	t(name)		float name;float min##name;float total##name;float max##name;uint32_t count##name;
 #define	r(name)		float min##name;float max##name;
@@ -288,6 +291,65 @@ struct
    uint8_t action:3;            // hvac_action
 } daikin = { 0 };
 
+// Published copy of status for readers (web, MQTT, HA), made by the main task after each poll cycle
+// Seqlock over two buffers, readers copy the last complete one without taking daikin.mutex, so never hold up the UART
+typedef struct
+{
+   uint64_t status_known;
+   uint32_t version;
+#define	b(name)		uint8_t name;
+#define	t(name)		float name;
+#define	r(name)		float min##name;float max##name;
+#define	i(name)		int name;
+#define	e(name,values)	uint8_t name;
+#define	s(name,len)	char name[len];
+#include "acextras.m"
+   uint8_t remote:1;
+   uint8_t action:3;
+} daikin_snap_t;
+
+struct
+{
+   uint32_t seq;                // Twice number published, odd while writing the next
+   daikin_snap_t buf[2];        // Published n is in buf[n&1]
+} snap = { 0 };
+
+static void
+snap_publish (void)
+{                               // Publish current state, daikin.mutex makes it consistent and serialises publishers
+   xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+   uint32_t seq = snap.seq;
+   __atomic_store_n (&snap.seq, seq + 1, __ATOMIC_RELAXED);
+   __atomic_thread_fence (__ATOMIC_RELEASE);
+   daikin_snap_t *p = &snap.buf[((seq >> 1) + 1) & 1];  // Not the one readers are using
+   p->status_known = daikin.status_known;
+   p->version = daikin.version;
+#define	b(name)		p->name=daikin.name;
+#define	t(name)		b(name)
+#define	r(name)		p->min##name=daikin.min##name;p->max##name=daikin.max##name;
+#define	i(name)		b(name)
+#define	e(name,values)	b(name)
+#define	s(name,len)	memcpy(p->name,daikin.name,len);
+#include "acextras.m"
+   p->remote = daikin.remote;
+   p->action = daikin.action;
+   __atomic_store_n (&snap.seq, seq + 2, __ATOMIC_RELEASE);
+   xSemaphoreGive (daikin.mutex);
+}
+
+static void
+snap_read (daikin_snap_t * p)
+{                               // Consistent copy of last published state, never waits for the publisher
+   while (1)
+   {
+      uint32_t seq = __atomic_load_n (&snap.seq, __ATOMIC_ACQUIRE) & ~1;
+      memcpy (p, &snap.buf[(seq >> 1) & 1], sizeof (*p));
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+      if (__atomic_load_n (&snap.seq, __ATOMIC_RELAXED) - seq < 3)
+         return;                // Publisher has not started overwriting this buffer
+   }
+}
+
 enum
 {
    HVAC_OFF,
@@ -311,6 +373,7 @@ daikin_set_value (const char *name, uint8_t * ptr, uint64_t flag, uint8_t value)
    *ptr = value;
    daikin.control_changed |= flag;
    daikin.mode_changed = 1;
+   daikin.version++;
    xSemaphoreGive (daikin.mutex);
    return NULL;
 }
@@ -325,6 +388,7 @@ daikin_set_int (const char *name, int *ptr, uint64_t flag, int value)
    xSemaphoreTake (daikin.mutex, portMAX_DELAY);
    daikin.control_changed |= flag;
    daikin.mode_changed = 1;
+   daikin.version++;
    *ptr = value;
    xSemaphoreGive (daikin.mutex);
    return NULL;
@@ -357,6 +421,7 @@ daikin_set_temp (const char *name, float *ptr, uint64_t flag, float value)
    *ptr = value;
    daikin.control_changed |= flag;
    daikin.mode_changed = 1;
+   daikin.version++;
    xSemaphoreGive (daikin.mutex);
    return NULL;
 }
@@ -369,6 +434,7 @@ set_uint8 (const char *name, uint8_t * ptr, uint64_t flag, uint8_t val)
    {
       daikin.status_known |= flag;
       daikin.status_changed = 1;
+      daikin.version++;
    }
    if (*ptr == val)
    {                            // No change
@@ -376,11 +442,13 @@ set_uint8 (const char *name, uint8_t * ptr, uint64_t flag, uint8_t val)
       {
          daikin.control_changed &= ~flag;
          daikin.status_changed = 1;
+         daikin.version++;
       }
    } else if (!(daikin.control_changed & flag))
    {                            // Changed (and not something we are trying to set)
       *ptr = val;
       daikin.status_changed = 1;
+      daikin.version++;
       daikin.mode_changed = 1;
    }
    xSemaphoreGive (daikin.mutex);
@@ -394,6 +462,7 @@ set_int (const char *name, int *ptr, uint64_t flag, int val)
    {
       daikin.status_known |= flag;
       daikin.status_changed = 1;
+      daikin.version++;
    }
    if (*ptr == val)
    {                            // No change
@@ -401,12 +470,14 @@ set_int (const char *name, int *ptr, uint64_t flag, int val)
       {
          daikin.control_changed &= ~flag;
          daikin.status_changed = 1;
+         daikin.version++;
       }
    } else if (!(daikin.control_changed & flag))
    {                            // Changed (and not something we are trying to set)
       if (*ptr / 10 != val / 10)
          daikin.status_changed = 1;
       *ptr = val;
+      daikin.version++;
    }
    xSemaphoreGive (daikin.mutex);
 }
@@ -419,6 +490,7 @@ set_float (const char *name, float *ptr, uint64_t flag, float val)
    {
       daikin.status_known |= flag;
       daikin.status_changed = 1;
+      daikin.version++;
    }
    if (lroundf (*ptr * 10) == lroundf (val * 10))
    {                            // No change (allow within 0.1C)
@@ -426,11 +498,13 @@ set_float (const char *name, float *ptr, uint64_t flag, float val)
       {
          daikin.control_changed &= ~flag;
          daikin.status_changed = 1;
+         daikin.version++;
       }
    } else if (!(daikin.control_changed & flag))
    {                            // Changed (and not something we are trying to set)
       *ptr = val;
       daikin.status_changed = 1;
+      daikin.version++;
       if (flag == CONTROL_temp)
          daikin.mode_changed = 1;
    }
@@ -464,6 +538,609 @@ enum
    RES_TIMEOUT
 };
 
+// Comms error categories, counted and reported in summary
+enum
+{
+   COMMS_TIMEOUT,
+   COMMS_BADSUM,
+   COMMS_NOACK,
+   COMMS_NAK,
+   COMMS_MISMATCH,
+   COMMS_LOOPBACK,
+   COMMS_BADLENGTH,
+   COMMS_FAULT,
+   COMMS_MAX
+};
+const char *const comms_name[] = { "timeout", "badsum", "noack", "nak", "mismatch", "loopback", "badlength", "fault" };
+
+struct
+{                               // Comms error counts
+   uint32_t period[COMMS_MAX];  // This reporting period
+   uint32_t total[COMMS_MAX];   // Since boot
+   uint32_t last;               // uptime of last summary
+} comms = { 0 };
+
+static void
+comms_error (uint8_t type, jo_t * jp)
+{                               // Count a comms error, only the first of each type in a period is reported as is, the rest are summarised
+   comms.period[type]++;
+   comms.total[type]++;
+   xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+   daikin.version++;
+   xSemaphoreGive (daikin.mutex);
+   if (jp && *jp && (!commsreport || comms.period[type] == 1))
+      revk_error ("comms", jp);
+   else if (jp)
+      jo_free (jp);
+}
+
+static void
+comms_summary (void)
+{                               // Report comms errors for the period, if any were not reported
+   uint32_t now = uptime ();
+   if (!commsreport || now - comms.last < commsreport)
+      return;
+   int suppressed = 0;
+   for (int i = 0; i < COMMS_MAX; i++)
+      if (comms.period[i] > 1)
+         suppressed = 1;
+   if (suppressed)
+   {
+      jo_t j = jo_comms_alloc ();
+      jo_int (j, "period", now - comms.last);
+      for (int i = 0; i < COMMS_MAX; i++)
+         if (comms.period[i])
+            jo_int (j, comms_name[i], comms.period[i]);
+      revk_error ("comms", &j);
+   }
+   memset (comms.period, 0, sizeof (comms.period));
+   comms.last = now;
+}
+
+static void
+comms_status (jo_t j)
+{                               // Add comms error totals to status
+   int i;
+   for (i = 0; i < COMMS_MAX && !comms.total[i]; i++);
+   if (i == COMMS_MAX)
+      return;
+   jo_object (j, "comms");
+   for (i = 0; i < COMMS_MAX; i++)
+      if (comms.total[i])
+         jo_int (j, comms_name[i], comms.total[i]);
+   jo_close (j);
+}
+
+// A JSON field held to apply later, merged by tag
+typedef struct
+{
+   char tag[16];
+   char val[24];
+   jo_type_t type;              // JO_NUMBER, JO_STRING, or JO_TRUE (val is 1 or 0)
+} pending_t;
+
+static void
+pending_set (pending_t * p, jo_t j, jo_type_t t)
+{                               // Set value from j, at the value (type t)
+   if (t == JO_TRUE || t == JO_FALSE)
+      strcpy (p->val, t == JO_TRUE ? "1" : "0");
+   else
+      jo_strncpy (j, p->val, sizeof (p->val));
+   p->type = (t == JO_FALSE ? JO_TRUE : t);
+}
+
+static void
+pending_add (jo_t j, const pending_t * p)
+{                               // Add to object
+   if (p->type == JO_STRING)
+      jo_string (j, p->tag, p->val);
+   else if (p->type == JO_TRUE)
+      jo_bool (j, p->tag, *p->val == '1');
+   else
+      jo_lit (j, p->tag, p->val);
+}
+
+// Deferred settings store, changes from controls apply at once, and are merged and written to flash after a quiet period
+#define	SETTINGS_PENDING	8
+struct
+{
+   SemaphoreHandle_t mutex;
+   pending_t pending[SETTINGS_PENDING];
+   uint8_t count;               // Pending entries
+   uint32_t due;                // uptime to write
+   uint32_t first;              // uptime of oldest pending change
+   uint32_t stores;             // Setting changes requested
+   uint32_t merged;             // Changes that replaced a pending change
+   uint32_t writes;             // Flash writes done
+} settings = { 0 };
+
+static jo_t
+settings_take (void)
+{                               // Pending settings as an object to store, and clear them, NULL if none (call with mutex)
+   jo_t j = NULL;
+   if (settings.count)
+   {
+      j = jo_object_alloc ();
+      for (int i = 0; i < settings.count; i++)
+         pending_add (j, &settings.pending[i]);
+      settings.count = 0;
+      settings.writes++;
+   }
+   return j;
+}
+
+static void
+settings_flush (void)
+{                               // Write pending settings
+   if (!settings.mutex)
+      return;
+   xSemaphoreTake (settings.mutex, portMAX_DELAY);
+   jo_t j = settings_take ();
+   xSemaphoreGive (settings.mutex);
+   if (j)
+   {
+      revk_settings_store (j, NULL, 1);
+      jo_free (&j);
+   }
+}
+
+static uint8_t
+settings_apply (const char *tag, const char *val)
+{                               // Apply a numeric or bool setting now, ahead of the flash write, returns 0 if not one we can
+   float v = strtof (val, NULL);
+   if (!strcmp (tag, "autot"))
+      autot = lroundf (v * autot_scale);
+   else if (!strcmp (tag, "autor"))
+      autor = lroundf (v * autor_scale);
+   else if (!strcmp (tag, "auto0"))
+      auto0 = v;
+   else if (!strcmp (tag, "auto1"))
+      auto1 = v;
+   else if (!strcmp (tag, "autop"))
+      autop = (v != 0);
+   else if (!strcmp (tag, "protocol"))
+      protocol = v;
+   else
+      return 0;
+   return 1;
+}
+
+static void
+settings_store (jo_t s)
+{                               // Store settings (object), applied now, written after quiet for flashdefer seconds (or flashmax)
+   if (!settings.mutex)
+      return;
+   uint8_t now = 0;             // Something we cannot apply before writing (e.g. a string)
+   xSemaphoreTake (settings.mutex, portMAX_DELAY);
+   if (!settings.count)
+      settings.first = uptime ();
+   jo_rewind (s);
+   jo_type_t t = jo_next (s);   // Start object
+   while (t == JO_TAG)
+   {
+      char tag[sizeof (settings.pending[0].tag)] = "";
+      jo_strncpy (s, tag, sizeof (tag));
+      t = jo_next (s);
+      int i;
+      for (i = 0; i < settings.count && strcmp (settings.pending[i].tag, tag); i++);
+      if (i == SETTINGS_PENDING)
+      {                         // Full, write those pending to make space
+         jo_t f = settings_take ();
+         revk_settings_store (f, NULL, 1);
+         jo_free (&f);
+         settings.first = uptime ();
+         i = 0;
+      }
+      if (i < settings.count)
+         settings.merged++;
+      else
+         strcpy (settings.pending[settings.count++].tag, tag);
+      pending_set (&settings.pending[i], s, t);
+      if (t == JO_STRING || !settings_apply (tag, settings.pending[i].val))
+         now = 1;
+      settings.stores++;
+      t = jo_skip (s);
+   }
+   uint8_t full = (settings.count == SETTINGS_PENDING);
+   settings.due = uptime () + flashdefer;
+   xSemaphoreGive (settings.mutex);
+   xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+   daikin.version++;            // Status shows new values
+   xSemaphoreGive (daikin.mutex);
+   if (full || now || !flashdefer)
+      settings_flush ();
+}
+
+static void
+settings_check (void)
+{                               // Write pending settings if quiet long enough, pending too long, or shutting down
+   uint32_t now = uptime ();
+   if (settings.count
+       && ((int) (now - settings.due) >= 0 || (flashmax && now - settings.first >= flashmax) || revk_shutting_down (NULL)))
+      settings_flush ();
+}
+
+static void
+settings_status (jo_t j)
+{                               // Add flash write counts to status
+   if (!settings.stores)
+      return;
+   jo_object (j, "flash");
+   jo_int (j, "stores", settings.stores);
+   jo_int (j, "merged", settings.merged);
+   jo_int (j, "writes", settings.writes);
+   if (settings.count)
+      jo_int (j, "pending", settings.count);
+   jo_close (j);
+}
+
+// Metrics for /metrics (Prometheus), only updated by the comms task
+#define	METRICS_CMDS	40      // Commands with round trip times tracked
+#define	METRICS_BUCKETS	9       // Max buckets (last is +Inf)
+const uint16_t metrics_rtt_le[] = { 25, 50, 100, 150, 200, 300, 500, 1000 };    // ms
+const uint16_t metrics_cycle_le[] = { 100, 250, 500, 750, 1000, 1500, 2000, 5000 };      // ms
+
+typedef struct
+{                               // Histogram
+   uint32_t count;
+   uint32_t sum;                // ms
+   uint32_t bucket[METRICS_BUCKETS];    // Not cumulative
+} metrics_hist_t;
+
+struct
+{
+   struct
+   {
+      char cmd[3];
+      metrics_hist_t rtt;
+   } cmd[METRICS_CMDS];
+   uint8_t cmds;                // Commands tracked
+   metrics_hist_t cycle;        // Poll cycle
+   uint32_t giveup;             // Control changes given up
+   uint32_t stack;              // Main task stack high water mark
+} metrics = { 0 };
+
+static void
+metrics_add (metrics_hist_t * h, const uint16_t * le, int n, uint32_t ms)
+{
+   int b;
+   for (b = 0; b < n && ms > le[b]; b++);
+   h->bucket[b]++;
+   h->count++;
+   h->sum += ms;
+}
+
+static void
+metrics_rtt (const char *cmd, int64_t start)
+{                               // Record round trip time of command sent at start
+   int i;
+   for (i = 0; i < metrics.cmds && strcmp (metrics.cmd[i].cmd, cmd); i++);
+   if (i == METRICS_CMDS)
+      return;
+   if (i == metrics.cmds)
+   {
+      strncpy (metrics.cmd[i].cmd, cmd, sizeof (metrics.cmd[i].cmd) - 1);
+      metrics.cmds++;
+   }
+   metrics_add (&metrics.cmd[i].rtt, metrics_rtt_le, sizeof (metrics_rtt_le) / sizeof (*metrics_rtt_le),
+                (esp_timer_get_time () - start) / 1000);
+}
+
+// Energy history, from the cumulative Wh, split heat/cool, saved to NVS (which wear levels) hourly and on shutdown
+typedef struct
+{
+   uint32_t key;                // Hour (UTC hours since epoch), day (YYYYMMDD local), month (YYYYMM local)
+   uint32_t heat;               // Wh
+   uint32_t cool;               // Wh
+} energy_t;
+
+#define	ENERGY_VERSION	1
+struct
+{
+   SemaphoreHandle_t mutex;     // For store, moved along by the main task, read by web
+   struct
+   {                            // Saved, newest first
+      uint8_t version;
+      energy_t hour[48];
+      energy_t day[32];
+      energy_t month[24];
+   } store;
+   int lastwh;                  // Last cumulative Wh
+   uint32_t saved;              // Hour key last saved
+   uint8_t dirty:1;             // Changed since saved
+   uint8_t loaded:1;            // Loaded from NVS
+} energy = { 0 };
+
+static void
+energy_load (void)
+{
+   nvs_handle_t h;
+   if (nvs_open (appname, NVS_READONLY, &h))
+      return;
+   size_t len = sizeof (energy.store);
+   if (nvs_get_blob (h, "energy", &energy.store, &len) || len != sizeof (energy.store)
+       || energy.store.version != ENERGY_VERSION)
+      memset (&energy.store, 0, sizeof (energy.store));
+   nvs_close (h);
+}
+
+static void
+energy_save (void)
+{
+   if (!energy.dirty)
+      return;
+   nvs_handle_t h;
+   if (nvs_open (appname, NVS_READWRITE, &h))
+      return;
+   energy.store.version = ENERGY_VERSION;
+   if (!nvs_set_blob (h, "energy", &energy.store, sizeof (energy.store)) && !nvs_commit (h))
+      energy.dirty = 0;
+   nvs_close (h);
+}
+
+static void
+energy_copy (void *dst, const void *src, size_t len)
+{                               // Copy some of store (web)
+   xSemaphoreTake (energy.mutex, portMAX_DELAY);
+   memcpy (dst, src, len);
+   xSemaphoreGive (energy.mutex);
+}
+
+static void
+energy_add (energy_t * e, int n, uint32_t key, int heat, int wh)
+{                               // Add to newest slot, moving on if new key
+   if (e[0].key != key)
+   {
+      memmove (e + 1, e, sizeof (*e) * (n - 1));
+      e[0].key = key;
+      e[0].heat = e[0].cool = 0;
+   }
+   if (heat)
+      e[0].heat += wh;
+   else
+      e[0].cool += wh;
+}
+
+static const energy_t *
+energy_find (const energy_t * e, int n, uint32_t key)
+{
+   for (int i = 0; i < n; i++)
+      if (e[i].key == key)
+         return &e[i];
+   return NULL;
+}
+
+static uint32_t
+energy_day (time_t t)
+{                               // Day key (local)
+   struct tm tm;
+   localtime_r (&t, &tm);
+   return (tm.tm_year + 1900) * 10000 + (tm.tm_mon + 1) * 100 + tm.tm_mday;
+}
+
+static void
+energy_update (void)
+{                               // Called each second, account for any change in Wh
+   if (!energy.loaded)
+   {
+      xSemaphoreTake (energy.mutex, portMAX_DELAY);
+      energy_load ();
+      xSemaphoreGive (energy.mutex);
+      energy.loaded = 1;
+   }
+   time_t now = time (0);
+   struct tm tm;
+   localtime_r (&now, &tm);
+   if (tm.tm_year < 120)
+      return;                   // Clock not set
+   uint32_t hour = now / 3600;
+   if (daikin.status_known & CONTROL_Wh)
+   {
+      int wh = daikin.Wh;
+      if (energy.lastwh && wh > energy.lastwh)
+      {
+         int delta = wh - energy.lastwh;
+         xSemaphoreTake (energy.mutex, portMAX_DELAY);
+         energy_add (energy.store.hour, sizeof (energy.store.hour) / sizeof (energy_t), hour, daikin.heat, delta);
+         energy_add (energy.store.day, sizeof (energy.store.day) / sizeof (energy_t), energy_day (now), daikin.heat, delta);
+         energy_add (energy.store.month, sizeof (energy.store.month) / sizeof (energy_t), (tm.tm_year + 1900) * 100 + tm.tm_mon + 1,
+                     daikin.heat, delta);
+         xSemaphoreGive (energy.mutex);
+         energy.dirty = 1;
+      }
+      energy.lastwh = wh;       // Also resyncs if counter reset
+   }
+   if (energy.dirty && (energy.saved != hour || revk_shutting_down (NULL)))
+   {
+      energy_save ();
+      energy.saved = hour;
+   }
+}
+
+// History of values, tiers of 1s, 1m, 15m, each lower resolution tier made as samples arrive
+#define	HISTORY_TIERS	3
+typedef struct __attribute__((packed))
+{                               // One sample, unknown values are HISTORY_UNKNOWN / INT16_MIN / INT32_MIN
+   uint32_t t;                  // Start of period
+#define	b(name)		uint8_t name;   // Percentage true
+#define	t(name)		int16_t name;   // 0.01C
+#define	i(name)		int32_t name;
+#define	e(name,values)	uint8_t name;
+#include "acextras.m"
+} history_row_t;
+#define	HISTORY_UNKNOWN	255
+
+typedef struct
+{                               // Accumulating next lower resolution sample
+   uint32_t t;                  // Start of period, 0 if none yet
+#define	b(name)		float name;uint16_t n##name;
+#define	t(name)		b(name)
+#define	i(name)		b(name)
+#define	e(name,values)	uint8_t name;uint16_t n##name;
+#include "acextras.m"
+} history_acc_t;
+
+struct
+{
+   struct
+   {
+      history_row_t *row;       // Ring
+      uint32_t size;            // Rows allocated
+      uint32_t count;           // Rows used
+      uint32_t next;            // Next row to write
+      uint32_t period;          // Seconds per row
+      history_acc_t acc;
+   } tier[HISTORY_TIERS];
+   uint32_t down;               // When MQTT went down
+   uint32_t backfill;           // Backfill MQTT from this time
+   uint32_t backfillto;         // Backfill MQTT up to this time
+   uint32_t backfilln;          // Minute tier row to carry on backfill from, moves down as oldest rows are dropped
+   uint8_t init:1;
+} history = { 0 };
+
+const char *const history_tier_name[HISTORY_TIERS] = { "fast", "minute", "slow" };
+
+static void
+history_put (int k, const history_row_t * r)
+{
+   if (!history.tier[k].row)
+      return;
+   history.tier[k].row[history.tier[k].next] = *r;
+   if (++history.tier[k].next == history.tier[k].size)
+      history.tier[k].next = 0;
+   if (history.tier[k].count < history.tier[k].size)
+      history.tier[k].count++;
+}
+
+static const history_row_t *
+history_get (int k, uint32_t n)
+{                               // Row n, 0 is oldest
+   if (n >= history.tier[k].count)
+      return NULL;
+   return &history.tier[k].row[(history.tier[k].next + history.tier[k].size - history.tier[k].count + n) % history.tier[k].size];
+}
+
+static void
+history_feed (int k, const history_row_t * r)
+{                               // Add sample to tier k, making row when period done
+   if (k >= HISTORY_TIERS)
+      return;
+   history_acc_t *a = &history.tier[k].acc;
+   uint32_t period = history.tier[k].period;
+   if (a->t && r->t / period != a->t / period)
+   {                            // Period done
+      history_row_t o = {.t = a->t };
+#define	b(name)		o.name=a->n##name?lroundf(a->name/a->n##name):HISTORY_UNKNOWN;
+#define	t(name)		o.name=a->n##name?lroundf(a->name/a->n##name):INT16_MIN;
+#define	i(name)		o.name=a->n##name?lroundf(a->name/a->n##name):INT32_MIN;
+#define	e(name,values)	o.name=a->n##name?a->name:HISTORY_UNKNOWN;
+#include "acextras.m"
+      history_put (k, &o);
+      history_feed (k + 1, &o);
+      memset (a, 0, sizeof (*a));
+   }
+   if (!a->t)
+      a->t = r->t - r->t % period;
+#define	b(name)		if(r->name!=HISTORY_UNKNOWN){a->name+=r->name;a->n##name++;}
+#define	t(name)		if(r->name!=INT16_MIN){a->name+=r->name;a->n##name++;}
+#define	i(name)		if(r->name!=INT32_MIN){a->name+=r->name;a->n##name++;}
+#define	e(name,values)	if(r->name!=HISTORY_UNKNOWN){a->name=r->name;a->n##name++;}
+#include "acextras.m"
+}
+
+static void
+history_init (void)
+{
+   const uint16_t size[HISTORY_TIERS] = { historyfast, historyminute, historyslow };
+   const uint16_t period[HISTORY_TIERS] = { 1, 60, 900 };
+   for (int k = 0; k < HISTORY_TIERS; k++)
+   {
+      history.tier[k].period = period[k];
+      if (size[k] && (history.tier[k].row = mallocspi (size[k] * sizeof (history_row_t))))
+         history.tier[k].size = size[k];
+      else if (size[k])
+      {
+         jo_t j = jo_object_alloc ();
+         jo_string (j, "tier", history_tier_name[k]);
+         jo_int (j, "size", size[k]);
+         jo_string (j, "error", "No memory for history");
+         revk_error ("history", &j);
+      }
+   }
+}
+
+static void
+history_sample (void)
+{                               // Called every second
+   if (!historyenable)
+      return;
+   if (!history.init)
+   {
+      history_init ();
+      history.init = 1;
+   }
+   time_t now = time (0);
+   struct tm tm;
+   localtime_r (&now, &tm);
+   if (tm.tm_year < 120)
+      return;                   // Clock not set
+   history_row_t r = {.t = now };
+   daikin_snap_t d;
+   snap_read (&d);
+#define	known(name)	(d.status_known&CONTROL_##name)
+#define	b(name)		r.name=known(name)?(d.name?100:0):HISTORY_UNKNOWN;
+#define	t(name)		r.name=known(name)&&!isnan(d.name)&&fabsf(d.name)<300?lroundf(d.name*100):INT16_MIN;
+#define	i(name)		r.name=known(name)?d.name:INT32_MIN;
+#define	e(name,values)	r.name=known(name)?d.name:HISTORY_UNKNOWN;
+#include "acextras.m"
+#undef known
+   history_put (0, &r);
+   history_feed (1, &r);
+   // Backfill MQTT (as reporting messages) from the minute tier after an outage
+   if (revk_link_down ())
+   {
+      if (!history.down)
+         history.down = now;
+      return;
+   }
+   if (history.down)
+   {
+      if (!history.backfill || history.down < history.backfill)
+         history.backfill = history.down;
+      history.backfillto = now - now % 60;
+      history.down = 0;
+   }
+   if (!history.backfill || !reporting)
+      return;
+   int sent = 0;
+   uint32_t n = history.backfilln;
+   const history_row_t *h;
+   while (n && (h = history_get (1, n - 1)) && h->t >= history.backfill)
+      n--;                      // Rows moved down, or backfill now from earlier
+   while ((h = history_get (1, n)) && h->t < history.backfill)
+      n++;
+   for (; sent < 5 && (h = history_get (1, n)) && h->t < history.backfillto; n++)
+   {                            // A few each second
+      jo_t j = jo_comms_alloc ();
+      time_t clock = h->t;
+      gmtime_r (&clock, &tm);
+      jo_stringf (j, "ts", "%04d-%02d-%02dT%02d:%02d:%02dZ", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min,
+                  tm.tm_sec);
+      jo_bool (j, "backfill", 1);
+#define	b(name)		if(h->name!=HISTORY_UNKNOWN)jo_litf(j,#name,"%.2f",h->name/100.0);
+#define	t(name)		if(h->name!=INT16_MIN)jo_litf(j,#name,"%.2f",h->name/100.0);
+#define	i(name)		if(h->name!=INT32_MIN)jo_int(j,#name,h->name);
+#define	e(name,values)	if(h->name<sizeof(CONTROL_##name##_VALUES)-1)jo_stringf(j,#name,"%c",CONTROL_##name##_VALUES[h->name]);
+#include "acextras.m"
+      revk_mqtt_send_clients (appname, 0, NULL, &j, 1);
+      history.backfill = h->t + 1;
+      sent++;
+   }
+   history.backfilln = n;
+   if (!sent)
+      history.backfill = 0;     // Done
+}
+
 static int
 check_length (uint8_t cmd, uint8_t cmd2, int len, int required, const uint8_t * payload)
 {
@@ -475,7 +1152,7 @@ check_length (uint8_t cmd, uint8_t cmd2, int len, int required, const uint8_t *
    jo_stringf (j, "expected", "%d", required);
    jo_stringf (j, "command", "%c%c", cmd, cmd2);
    jo_base16 (j, "data", payload, len);
-   revk_error ("comms", &j);
+   comms_error (COMMS_BADLENGTH, &j);
 
    return 0;
 }
@@ -489,7 +1166,7 @@ comm_timeout (uint8_t * buf, int rxlen)
    jo_bool (j, "timeout", 1);
    if (rxlen)
       jo_base16 (j, "data", buf, rxlen);
-   revk_error ("comms", &j);
+   comms_error (COMMS_TIMEOUT, &j);
 }
 
 static void
@@ -498,7 +1175,7 @@ comm_badcrc (uint8_t c, const uint8_t * buf, int rxlen)
    jo_t j = jo_comms_alloc ();
    jo_stringf (j, "badsum", "%02X", c);
    jo_base16 (j, "data", buf, rxlen);
-   revk_error ("comms", &j);
+   comms_error (COMMS_BADSUM, &j);
 }
 
 // Decode S21 response payload
@@ -673,7 +1350,7 @@ protocol_found (void)
    {
       jo_t j = jo_object_alloc ();
       jo_int (j, "protocol", proto);
-      revk_settings_store (j, NULL, 1);
+      settings_store (j);
       jo_free (&j);
    }
 }
@@ -964,6 +1641,7 @@ daikin_as_command (int len, uint8_t * buf)
       jo_base16 (j, "dump", buf, len);
       revk_info ("tx", &j);
    }
+   int64_t start = esp_timer_get_time ();
    uart_write_bytes (uart, buf, len);
    uint8_t res[18];
    len = uart_read_bytes (uart, res, sizeof (res), READ_TIMEOUT);
@@ -972,6 +1650,7 @@ daikin_as_command (int len, uint8_t * buf)
       daikin.talking = 0;
       return RES_NOACK;
    }
+   metrics_rtt ((char[]) { buf[1], 0 }, start);
    cs = 0;
    for (int i = 0; i < len - 1; i++)
       cs += res[i];
@@ -991,9 +1670,12 @@ daikin_as_command (int len, uint8_t * buf)
          jo_stringf (j, "bad-cs", "%02X", cs);
       if (*res != 0x15 && *res != buf[1])
          jo_stringf (j, "bad-cmd", "%c", buf[1]);
-      revk_error ("comms", &j);
       if (*res == 0x15 && cs == res[len - 1])
+      {
+         comms_error (COMMS_NAK, &j);
          return RES_NAK;
+      }
+      comms_error (cs != res[len - 1] ? COMMS_BADSUM : len != sizeof (res) ? COMMS_BADLENGTH : COMMS_MISMATCH, &j);
       return RES_BAD;
    }
    if (*res == buf[1] && !protocol_set)
@@ -1043,6 +1725,7 @@ daikin_s21_command (uint8_t cmd, uint8_t cmd2, int payload_len, char *payload)
    uint8_t buf[256],
      temp;
    int txlen = S21_MIN_PKT_LEN + payload_len;
+   int64_t start = esp_timer_get_time ();
    if (!snoop)
    {                            // Send
       buf[S21_STX_OFFSET] = STX;
@@ -1079,18 +1762,17 @@ daikin_s21_command (uint8_t cmd, uint8_t cmd2, int payload_len, char *payload)
       {
          // Got an explicit NAK
          if (debug)
-         {
             jo_bool (j, "nak", 1);
-            revk_error ("comms", &j);
-         } else
-            jo_free (&j);
+         else
+            jo_free (&j);       // Count only
+         comms_error (COMMS_NAK, &j);
          return RES_NAK;
       }
       // Unexpected reply, protocol broken
       daikin.talking = 0;
       jo_bool (j, "noack", 1);
       jo_stringf (j, "value", "%02X", temp);
-      revk_error ("comms", &j);
+      comms_error (COMMS_NOACK, &j);
       return RES_NOACK;
    }
    if (temp == STX)
@@ -1123,6 +1805,8 @@ daikin_s21_command (uint8_t cmd, uint8_t cmd2, int payload_len, char *payload)
       if (buf[rxlen - 1] == ETX)
          break;
    }
+   if (!snoop)
+      metrics_rtt ((char[]) { cmd, cmd2, 0 }, start);
    ESP_LOG_BUFFER_HEX (TAG, buf, rxlen);        // TODO 
    // Send ACK regardless of packet quality. If we don't ack due to checksum error,
    // for example, the response will be sent again.
@@ -1137,10 +1821,10 @@ daikin_s21_command (uint8_t cmd, uint8_t cmd2, int payload_len, char *payload)
       jo_stringn (j, c, (char *) buf + 3, rxlen - 5);
       revk_info ("rx", &j);
    }
-   int s21_bad (jo_t j)
+   int s21_bad (uint8_t type, jo_t j)
    {                            // Report error and return RES_BAD - also pause/flush
       jo_base16 (j, "data", buf, rxlen);
-      revk_error ("comms", &j);
+      comms_error (type, &j);
       if (!protocol_set)
       {
          sleep (1);
@@ -1154,7 +1838,7 @@ daikin_s21_command (uint8_t cmd, uint8_t cmd2, int payload_len, char *payload)
    {                            // Sees checksum of 03 actually sends as 05
       jo_t j = jo_comms_alloc ();
       jo_stringf (j, "badsum", "%02X", c);
-      return s21_bad (j);
+      return s21_bad (COMMS_BADSUM, j);
    }
    // For reliability, verify that we've got back the exact transmitted data
    // We're using the same buf for both tx and rx, so our sent packet is gone
@@ -1171,7 +1855,7 @@ daikin_s21_command (uint8_t cmd, uint8_t cmd2, int payload_len, char *payload)
       }
       jo_t j = jo_comms_alloc ();
       jo_bool (j, "loopback", 1);
-      revk_error ("comms", &j);
+      comms_error (COMMS_LOOPBACK, &j);
       return RES_OK;
    }
    b.loopback = 0;
@@ -1188,7 +1872,7 @@ daikin_s21_command (uint8_t cmd, uint8_t cmd2, int payload_len, char *payload)
          jo_bool (j, "badhead", 1);
       if (buf[1] != cmd + 1 || buf[2] != cmd2)
          jo_bool (j, "mismatch", 1);
-      return s21_bad (j);
+      return s21_bad (COMMS_MISMATCH, j);
    }
    return daikin_s21_response (buf[S21_CMD0_OFFSET], buf[S21_CMD1_OFFSET], rxlen - S21_MIN_PKT_LEN, buf + S21_PAYLOAD_OFFSET);
 }
@@ -1223,6 +1907,7 @@ daikin_x50a_command (uint8_t cmd, int txlen, uint8_t * payload)
       jo_base16 (j, "dump", buf, txlen + 6);
       revk_info ("tx", &j);
    }
+   int64_t start = esp_timer_get_time ();
    uart_write_bytes (uart, buf, 6 + txlen);
    // Wait for reply
    int rxlen = uart_read_bytes (uart, buf, sizeof (buf), READ_TIMEOUT);
@@ -1231,6 +1916,11 @@ daikin_x50a_command (uint8_t cmd, int txlen, uint8_t * payload)
       comm_timeout (NULL, 0);
       return;
    }
+   {
+      char c[3];
+      sprintf (c, "%02X", cmd);
+      metrics_rtt (c, start);
+   }
    if (b.dumping)
    {
       jo_t j = jo_comms_alloc ();
@@ -1247,7 +1937,7 @@ daikin_x50a_command (uint8_t cmd, int txlen, uint8_t * payload)
       jo_t j = jo_comms_alloc ();
       jo_stringf (j, "badsum", "%02X", c);
       jo_base16 (j, "data", buf, rxlen);
-      revk_error ("comms", &j);
+      comms_error (COMMS_BADSUM, &j);
       return;
    }
    // Process response
@@ -1264,7 +1954,7 @@ daikin_x50a_command (uint8_t cmd, int txlen, uint8_t * payload)
       if (buf[3] != 1)
          jo_bool (j, "badform", 1);
       jo_base16 (j, "data", buf, rxlen);
-      revk_error ("comms", &j);
+      comms_error (buf[0] == 0x06 && buf[1] == cmd && buf[3] == 1 ? COMMS_BADLENGTH : COMMS_MISMATCH, &j);
       return;
    }
    if (!buf[4])
@@ -1278,7 +1968,7 @@ daikin_x50a_command (uint8_t cmd, int txlen, uint8_t * payload)
       }
       jo_t j = jo_comms_alloc ();
       jo_bool (j, "loopback", 1);
-      revk_error ("comms", &j);
+      comms_error (COMMS_LOOPBACK, &j);
       return;
    }
    b.loopback = 0;
@@ -1289,16 +1979,18 @@ daikin_x50a_command (uint8_t cmd, int txlen, uint8_t * payload)
       jo_t j = jo_comms_alloc ();
       jo_bool (j, "fault", 1);
       jo_base16 (j, "data", buf, rxlen);
-      revk_error ("comms", &j);
+      comms_error (COMMS_FAULT, &j);
       return;
    }
    daikin_x50a_response (cmd, rxlen - 6, buf + 5);
 }
 
+static void group_drop (const char *tag);
+
 // Parse control JSON, arrived by MQTT, and apply values
-const char *
-daikin_control (jo_t j)
-{                               // Control settings as JSON
+static const char *
+control_apply (jo_t j, uint8_t group)
+{                               // Control settings as JSON, group if a (delayed) group control
    jo_type_t t = jo_next (j);   // Start object
    jo_t s = NULL;
    while (t == JO_TAG)
@@ -1309,6 +2001,8 @@ daikin_control (jo_t j)
       jo_strncpy (j, tag, sizeof (tag));
       t = jo_next (j);
       jo_strncpy (j, val, sizeof (val));
+      if (!group)
+         group_drop (tag);      // Direct control overrides a group control still waiting
 #define	b(name)		if(!strcmp(tag,#name)&&(t==JO_TRUE||t==JO_FALSE))err=daikin_set_v(name,t==JO_TRUE?1:0);
 #define	t(name)		if(!strcmp(tag,#name)&&t==JO_NUMBER)err=daikin_set_t(name,strtof(val,NULL));
 #define	i(name)		if(!strcmp(tag,#name)&&t==JO_NUMBER)err=daikin_set_i(name,atoi(val));
@@ -1354,23 +2048,149 @@ daikin_control (jo_t j)
    }
    if (s)
    {
-      revk_settings_store (s, NULL, 1);
+      settings_store (s);
       jo_free (&s);
    }
    return "";
 }
 
+const char *
+daikin_control (jo_t j)
+{                               // Control settings as JSON
+   return control_apply (j, 0);
+}
+
 // --------------------------------------------------------------------------------
+// Group commands, i.e. command/group/... applying to all units in the group, optionally staggered
+#define	GROUP_PENDING	8
+struct
+{
+   pending_t pending[GROUP_PENDING];    // Controls waiting to be applied, merged per field
+   uint8_t count;
+   uint32_t due;                // uptime to apply pending controls
+} groupcmd = { 0 };
+
+static int
+group_match (const char *target)
+{                               // If target is one of our groups
+   for (int i = 0; i < sizeof (groupname) / sizeof (*groupname); i++)
+      if (*groupname[i] && !strcmp (target, groupname[i]))
+         return 1;
+   return 0;
+}
+
+static void
+group_subscribe (void)
+{                               // Subscribe to group command topics
+   for (int i = 0; i < sizeof (groupname) / sizeof (*groupname); i++)
+      if (*groupname[i])
+      {
+         char *topic = NULL;
+         if (asprintf (&topic, "%s/%s/#", topiccommand, groupname[i]) >= 0)
+         {
+            lwmqtt_subscribe (revk_mqtt (0), topic);
+            free (topic);
+         }
+      }
+}
+
+static uint32_t
+group_delay (void)
+{                               // Stagger for group commands, so units do not all start compressors together
+   if (!groupstagger)
+      return 0;
+   if (grouprandom)
+      return esp_random () % (groupstagger + 1);
+   uint32_t h = 0;              // Fixed per unit
+   for (const char *p = revk_id; *p; p++)
+      h = h * 31 + *p;
+   return h % (groupstagger + 1);
+}
+
+static const char *
+group_control (jo_t j)
+{                               // Apply a control from a group command, now or after the stagger delay
+   uint32_t delay = group_delay ();
+   if (!delay)
+      return control_apply (j, 1);
+   const char *err = "";
+   xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+   if (!groupcmd.count)
+      groupcmd.due = uptime () + delay;
+   jo_type_t t = jo_next (j);   // Start object
+   while (t == JO_TAG)
+   {                            // Merge, a later value for a field replaces an earlier one
+      char tag[sizeof (groupcmd.pending[0].tag)] = "";
+      jo_strncpy (j, tag, sizeof (tag));
+      t = jo_next (j);
+      int i;
+      for (i = 0; i < groupcmd.count && strcmp (groupcmd.pending[i].tag, tag); i++);
+      if (i == groupcmd.count && i < GROUP_PENDING)
+         strcpy (groupcmd.pending[groupcmd.count++].tag, tag);
+      if (i < groupcmd.count)
+         pending_set (&groupcmd.pending[i], j, t);
+      else
+         err = "Too many group controls waiting";
+      t = jo_skip (j);
+   }
+   xSemaphoreGive (daikin.mutex);
+   return err;
+}
+
+static void
+group_drop (const char *tag)
+{                               // Drop a waiting group control for a field
+   if (!groupcmd.count)
+      return;
+   xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+   for (int i = 0; i < groupcmd.count; i++)
+      if (!strcmp (groupcmd.pending[i].tag, tag))
+      {
+         groupcmd.pending[i] = groupcmd.pending[--groupcmd.count];
+         break;
+      }
+   xSemaphoreGive (daikin.mutex);
+}
+
+static void
+group_apply (void)
+{                               // Apply pending group controls when due
+   if (!groupcmd.count || uptime () < groupcmd.due)
+      return;
+   jo_t j = jo_object_alloc ();
+   xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+   for (int i = 0; i < groupcmd.count; i++)
+      pending_add (j, &groupcmd.pending[i]);
+   groupcmd.count = 0;
+   xSemaphoreGive (daikin.mutex);
+   jo_close (j);
+   jo_rewind (j);
+   control_apply (j, 1);
+   jo_free (&j);
+}
+
 char debugsend[10] = "";
 // Called by an MQTT client inside the revk library
 const char *
 mqtt_client_callback (int client, const char *prefix, const char *target, const char *suffix, jo_t j)
 {                               // MQTT app callback
    const char *ret = NULL;
-   if (client || !prefix || target || strcmp (prefix, topiccommand))
+   if (client || !prefix || strcmp (prefix, topiccommand))
       return NULL;              // Not for us or not a command from main MQTT
+   uint8_t group = 0;
+   if (target)
+   {
+      if (!group_match (target))
+         return NULL;           // Not for us
+      group = 1;
+   }
    if (!suffix)
-      return daikin_control (j);        // General setting
+      return group ? group_control (j) : daikin_control (j);    // General setting
+   if (group && (!strcmp (suffix, "reconnect") || !strcmp (suffix, "connect") || !strcmp (suffix, "status")
+                 || !strcmp (suffix, "send") || !strcmp (suffix, "control")))
+      return NULL;              // Group commands are only for controls
+   if (!strcmp (suffix, "connect"))
+      group_subscribe ();
    if (!strcmp (suffix, "reconnect"))
    {
       daikin.talking = 0;       // Disconnect and reconnect
@@ -1487,7 +2307,7 @@ mqtt_client_callback (int client, const char *prefix, const char *target, const
          {                      // Setting the control
             jo_t s = jo_object_alloc ();
             jo_litf (s, "autot", "%.1f", atof (value));
-            revk_settings_store (s, NULL, 1);
+            settings_store (s);
             jo_free (&s);
          } else
             jo_lit (s, "temp", value);  // Direct controls
@@ -1548,22 +2368,21 @@ mqtt_client_callback (int client, const char *prefix, const char *target, const
    if (jo_next (s) == JO_TAG)
    {
       jo_rewind (s);
-      ret = daikin_control (s);
+      ret = group ? group_control (s) : daikin_control (s);
    }
    jo_free (&s);
    return ret;
 }
 
-jo_t
-daikin_status (void)
-{
-   xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+static jo_t
+daikin_status_snap (const daikin_snap_t * d)
+{                               // Status from a snapshot
    jo_t j = jo_comms_alloc ();
-#define b(name)         if(daikin.status_known&CONTROL_##name)jo_bool(j,#name,daikin.name);
-#define t(name)         if(daikin.status_known&CONTROL_##name){if(isnan(daikin.name)||daikin.name>=100)jo_null(j,#name);else jo_litf(j,#name,"%.1f",daikin.name);}
-#define i(name)         if(daikin.status_known&CONTROL_##name)jo_int(j,#name,daikin.name);
-#define e(name,values)  if((daikin.status_known&CONTROL_##name)&&daikin.name<sizeof(CONTROL_##name##_VALUES)-1)jo_stringf(j,#name,"%c",CONTROL_##name##_VALUES[daikin.name]);
-#define s(name,len)     if((daikin.status_known&CONTROL_##name)&&*daikin.name)jo_string(j,#name,daikin.name);
+#define b(name)         if(d->status_known&CONTROL_##name)jo_bool(j,#name,d->name);
+#define t(name)         if(d->status_known&CONTROL_##name){if(isnan(d->name)||d->name>=100)jo_null(j,#name);else jo_litf(j,#name,"%.1f",d->name);}
+#define i(name)         if(d->status_known&CONTROL_##name)jo_int(j,#name,d->name);
+#define e(name,values)  if((d->status_known&CONTROL_##name)&&d->name<sizeof(CONTROL_##name##_VALUES)-1)jo_stringf(j,#name,"%c",CONTROL_##name##_VALUES[d->name]);
+#define s(name,len)     if((d->status_known&CONTROL_##name)&&*d->name)jo_string(j,#name,d->name);
 #include "acextras.m"
 #ifdef	ELA
    if (bletemp && !bletemp->missing)
@@ -1582,7 +2401,9 @@ daikin_status (void)
    if (ble && *autob)
       jo_string (j, "autob", autob);
 #endif
-   if (daikin.remote)
+   comms_status (j);
+   settings_status (j);
+   if (d->remote)
       jo_bool (j, "remote", 1);
    else
    {
@@ -1592,26 +2413,19 @@ daikin_status (void)
       jo_stringf (j, "auto1", "%02d:%02d", auto1 / 100, auto1 % 100);
       jo_bool (j, "autop", autop);
    }
-   xSemaphoreGive (daikin.mutex);
    return j;
 }
 
-// --------------------------------------------------------------------------------
-// Web
-static void
-web_head (httpd_req_t * req, const char *title)
+jo_t
+daikin_status (void)
 {
-   revk_web_head (req, title);
-   revk_web_send (req, "<style>"        //
-                  "body{font-family:sans-serif;background:#8cf;}"       //
-                  ".on{opacity:1;transition:1s;}"       // 
-                  ".off{opacity:0;transition:1s;}"      // 
-                  "select{min-height:34px;border-radius:34px;background-color:#ccc;border:1px solid gray;color:black;box-shadow:3px 3px 3px #0008;}"    //
-                  "input.temp{min-width:300px;}"        //
-                  "input.time{min-height:34px;min-width:64px;border-radius:34px;background-color:#ccc;border:1px solid gray;color:black;box-shadow:3px 3px 3px #0008;}" //
-                  "</style><body><h1>%s</h1>", title ? : "");
+   daikin_snap_t d;
+   snap_read (&d);
+   return daikin_status_snap (&d);
 }
 
+// --------------------------------------------------------------------------------
+// Web
 static esp_err_t
 web_icon (httpd_req_t * req)
 {                               // serve image -  maybe make more generic file serve
@@ -1622,290 +2436,541 @@ web_icon (httpd_req_t * req)
    return ESP_OK;
 }
 
+static uint32_t
+fnv1a (uint32_t h, const void *data, size_t len)
+{                               // FNV-1a, start with h = 2166136261
+   for (const uint8_t * p = data; len--; p++)
+      h = (h ^ *p) * 16777619;
+   return h;
+}
+
+static int
+web_not_modified (httpd_req_t * req, const char *etag)
+{                               // Set ETag, and if the client has it already send 304 and return true
+   char match[24];
+   httpd_resp_set_hdr (req, "ETag", etag);
+   if (httpd_req_get_hdr_value_len (req, "If-None-Match") != strlen (etag)
+       || httpd_req_get_hdr_value_str (req, "If-None-Match", match, sizeof (match)) || strcmp (match, etag))
+      return 0;
+   httpd_resp_set_status (req, "304 Not Modified");
+   httpd_resp_send (req, NULL, 0);
+   return 1;
+}
+
 static esp_err_t
 web_root (httpd_req_t * req)
-{
+{                               // Static page, gzipped at build time, controls driven by /capabilities
    if ((!webcontrol || revk_link_down ()) && websettings)
       return revk_web_settings (req);   // Direct to web set up
-   web_head (req, hostname == revk_id ? appname : hostname);
-   revk_web_send (req, "<div id=top class=off><form name=F><table id=live>");
-   void addh (const char *tag)
-   {                            // Head (well, start of row)
-      revk_web_send (req, "<tr><td align=right>%s</td>", tag);
-   }
-   void addf (const char *tag)
-   {                            // Foot (well, end of row)
-      revk_web_send (req, "<td colspan=2 id='%s'></td></tr>", tag);
-   }
-   void add (const char *tag, const char *field, ...)
-   {
-      addh (tag);
-      va_list ap;
-      va_start (ap, field);
-      int n = 0;
-      while (1)
+   extern const char html_start[] asm ("_binary_faikin_html_gz_start");
+   extern const char html_end[] asm ("_binary_faikin_html_gz_end");
+   static char etag[11] = "";
+   if (!*etag)                  // FNV-1a of the page
+      sprintf (etag, "\"%08lX\"", (unsigned long) fnv1a (2166136261, html_start, html_end - html_start));
+   httpd_resp_set_hdr (req, "Cache-Control", "no-cache");      // Check ETag each time
+   if (web_not_modified (req, etag))
+      return ESP_OK;
+   httpd_resp_set_type (req, "text/html; charset=utf-8");
+   httpd_resp_set_hdr (req, "Content-Encoding", "gzip");       // All browsers we care about accept gzip
+   httpd_resp_send (req, html_start, html_end - html_start);
+   return ESP_OK;
+}
+
+// Capability manifest, what the web page and HA discovery offer, remade only when something it depends on changes
+struct
+{
+   SemaphoreHandle_t mutex;     // For json
+   char *json;                  // /capabilities, apart from the BLE list which changes all the time
+   uint32_t fingerprint;        // Of what it was made from
+   uint32_t version;            // Bumped each time remade
+   uint32_t hafingerprint;      // Of what HA discovery is made from
+   uint32_t hasent;             // hafingerprint last sent to HA
+   uint64_t known;              // Fields we have, and hence can show or control
+   const char *step;            // Temp step
+   uint8_t fan5:1;              // 5 fan speeds
+   uint8_t cnwired:1;           // CN_WIRED fan modes
+} caps = { 0 };
+
+static uint32_t
+caps_hafingerprint (const daikin_snap_t * d)
+{                               // What HA discovery depends on
+   struct
+   {
+      uint64_t known;
+      uint8_t proto;
+      uint8_t fan5:1;
+      uint8_t tmin;
+      uint8_t tmax;
+   } f;
+   memset (&f, 0, sizeof (f));  // Padding
+   f.known = d->status_known;
+   f.proto = proto;
+   f.fan5 = have_5_fan_speeds ();
+   f.tmin = tmin;
+   f.tmax = tmax;
+   uint32_t h = fnv1a (2166136261, &f, sizeof (f));
+   h = fnv1a (h, hostname, strlen (hostname));
+   return fnv1a (h, d->model, strlen (d->model));
+}
+
+static uint32_t
+caps_fingerprint (const daikin_snap_t * d, uint32_t ha)
+{                               // Everything the manifest depends on, which is what HA discovery does and web only things
+   struct
+   {
+      uint8_t protocol_set:1;
+      uint8_t fahrenheit:1;
+      uint8_t noicons:1;
+      uint8_t websettings:1;
+      uint8_t autoshow:1;
+      uint8_t blesensor:1;
+      uint8_t ble:1;
+   } f;
+   memset (&f, 0, sizeof (f));  // Padding
+   f.protocol_set = protocol_set;
+   f.fahrenheit = fahrenheit;
+   f.noicons = noicons;
+   f.websettings = websettings;
+   f.autoshow = autor || ble_sensor_connected () || (!nofaikinauto && !d->remote);
+   f.blesensor = ble_sensor_connected ();
+#ifdef	ELA
+   f.ble = ble;
+#endif
+   return fnv1a (ha, &f, sizeof (f));
+}
+
+static char *
+caps_make (const daikin_snap_t * d)
+{                               // Make the manifest JSON
+   jo_t j = jo_object_alloc ();
+   jo_string (j, "title", hostname == revk_id ? appname : hostname);
+   jo_string (j, "app", appname);
+   jo_string (j, "version", revk_version);
+   if (protocol_set)
+      jo_string (j, "protocol", proto_name ());
+   jo_bool (j, "settings", websettings);
+   jo_bool (j, "fahrenheit", fahrenheit);
+   jo_bool (j, "noicons", noicons);
+   jo_int (j, "tmin", tmin);
+   jo_int (j, "tmax", tmax);
+   jo_lit (j, "step", get_temp_step ());
+   jo_array (j, "fan");
+   void fan (const char *tag, const char *value)
+   {
+      jo_array (j, NULL);
+      jo_string (j, NULL, tag);
+      jo_string (j, NULL, value);
+      jo_close (j);
+   }
+   if (have_5_fan_speeds ())
+   {
+      fan ("1", "1");
+      fan ("2", "2");
+      fan ("3", "3");
+      fan ("4", "4");
+      fan ("5", "5");
+      fan ("Night", "Q");
+      fan ("Auto", "A");
+   } else
+   {
+      fan ("Low", "1");
+      fan ("Mid", "3");
+      fan ("High", "5");
+      if (proto_type () == PROTO_TYPE_CN_WIRED)
       {
-         const char *tag = va_arg (ap, char *);
-         if (!tag)
-            break;
-         if (n == 5)
-         {
-            revk_web_send (req, "</tr><tr><td></td>");
-            n = 0;
-         }
-         n++;
-         const char *value = va_arg (ap, char *);
-         revk_web_send (req,
-                        "<td><label class=box><input type=radio name='%s' value='%s' id='%s%s' onchange=\"if(this.checked)w('%s','%s');\"><span class=button>%s</span></label></td>",
-                        field, value, field, value, field, value, tag);
+         fan ("Auto", "A");
+         fan ("Quiet", "Q");
       }
-      va_end (ap);
-      addf (tag);
    }
-   void addb (const char *tag, const char *field, const char *help)
-   {
-      if (noicons)
-         revk_web_send (req, "<td align=right style='white-space:pre;vertical-align:middle;'>%s</td>", help);
-      else
-         revk_web_send (req, "<td title=\"%s\" align=right>%s</td>", help, tag);
-      revk_web_send (req,
-                     "<td title=\"%s\"><label class=switch><input type=checkbox id=\"%s\" onchange=\"w('%s',this.checked);\"><span class=slider></span></label></td>",
-                     help, field, field);
-   }
-   void addslider (const char *tag, const char *field, int min, int max, const char *step)
-   {
-      addh (tag);
-      revk_web_send (req,
-                     "<td colspan=6><input type=range class=temp min=%d max=%d step=%s id=%s onchange=\"w('%s',+this.value);\"><span id=T%s></span></td>",
-                     min, max, step, field, field, field);
-      addf (tag);
-   }
-   revk_web_send (req, "<tr>");
-   addb ("⏼", "power", "Main\npower");
-   revk_web_send (req, "</tr>");
-   add ("Mode", "mode", "Auto", "A", "Heat", "H", "Cool", "C", "Dry", "D", "Fan", "F", NULL);
-   if (have_5_fan_speeds ())
-      add ("Fan", "fan", "1", "1", "2", "2", "3", "3", "4", "4", "5", "5", "Night", "Q", "Auto", "A", NULL);
-   else if (proto_type () == PROTO_TYPE_CN_WIRED)
-      add ("Fan", "fan", "Low", "1", "Mid", "3", "High", "5", "Auto", "A", "Quiet", "Q", NULL);
-   else
-      add ("Fan", "fan", "Low", "1", "Mid", "3", "High", "5", NULL);
-   addslider ("Set", "temp", tmin, tmax, get_temp_step ());
-   void addt (const char *tag, const char *help)
-   {
-      revk_web_send (req, "<td title=\"%s\" align=right>%s<br><span id=\"%s\"></span></td>", help, tag, tag);
-   }
-   revk_web_send (req, "<tr><td>Temps</td>");
-   if (daikin.status_known & CONTROL_inlet)
-      addt ("Inlet", "Inlet temperature");
-   if (daikin.status_known & CONTROL_home)
-      addt ("Home", "Inlet temperature");
-   if (daikin.status_known & CONTROL_liquid)
-      addt ("Liquid", "Liquid coolant temperature");
-   if (daikin.status_known & CONTROL_outside)
-      addt ("Outside", "Outside temperature");
-   if ((daikin.status_known & CONTROL_env) && !ble_sensor_connected ())
-      addt ("Env", "External reference temperature");
+   jo_close (j);
+   jo_array (j, "known");
+#define	b(name)		if(d->status_known&CONTROL_##name)jo_string(j,NULL,#name);
+#define	t(name)		b(name)
+#define	r(name)		b(name)
+#define	i(name)		b(name)
+#define	e(name,values)	b(name)
+#define	s(name,len)	b(name)
+#include "acextras.m"
+   jo_close (j);
+   jo_bool (j, "blesensor", ble_sensor_connected ());
+   jo_bool (j, "auto", autor || ble_sensor_connected () || (!nofaikinauto && !d->remote));
 #ifdef ELA
    if (ble)
-   {
-      addt ("BLE", "External BLE temperature");
-      addt ("Hum", "External BLE humidity");
-   }
+      jo_bool (j, "ble", 1);
 #endif
-   revk_web_send (req, "</tr>");
-   if (daikin.status_known & CONTROL_demand)
-      addslider ("Demand", "demand", 30, 100, "5");
-   if (daikin.status_known & (CONTROL_econo | CONTROL_powerful | CONTROL_led))
-   {
-      revk_web_send (req, "<tr>");
-      if (daikin.status_known & CONTROL_econo)
-         addb ("♻", "econo", "Econo\nmode");
-      if (daikin.status_known & CONTROL_powerful)
-         addb ("💪", "powerful", "Powerful\nmode");
-      if (daikin.status_known & CONTROL_led)
-         addb ("💡", "led", "LED\nhigh");
-      revk_web_send (req, "</tr>");
-   }
-   if (daikin.status_known & (CONTROL_swingv | CONTROL_swingh | CONTROL_comfort))
-   {
-      revk_web_send (req, "<tr>");
-      if (daikin.status_known & CONTROL_swingv)
-         addb ("↕", "swingv", "Vertical\nSwing");
-      if (daikin.status_known & CONTROL_swingh)
-         addb ("↔", "swingh", "Horizontal\nSwing");
-      if (daikin.status_known & CONTROL_comfort)
-         addb ("🧸", "comfort", "Comfort\nmode");
-      revk_web_send (req, "</tr>");
-   }
-   if (daikin.status_known & (CONTROL_streamer | CONTROL_sensor | CONTROL_quiet))
-   {
-      revk_web_send (req, "<tr>");
-      if (daikin.status_known & CONTROL_streamer)
-         addb ("🦠", "streamer", "Stream/\nfilter");
-      if (daikin.status_known & CONTROL_sensor)
-         addb ("🙆", "sensor", "Sensor\nmode");
-      if (daikin.status_known & CONTROL_quiet)
-         addb ("🤫", "quiet", "Quiet\noutdoor");
-      revk_web_send (req, "</tr>");
-   }
-   revk_web_send (req, "</table>"       //
-                  "<p id=offline style='display:none'><b>System is offline.</b></p>"    //
-                  "<p id=loopback style='display:none'><b>System is in loopback test.</b></p>"  //
-                  "<p id=shutdown style='display:none;color:red;'></p>" //
-                  "<p id=slave style='display:none'>❋ Another unit is controlling the mode, so this unit is not operating at present.</p>"    //
-                  "<p id=control style='display:none'>✷ Automatic control means some functions are limited.</p>"      //
-                  "<p id=antifreeze style='display:none'>❄ System is in anti-freeze now, so cooling is suspended.</p>");
-
-   if (autor || ble_sensor_connected () || (!nofaikinauto && !daikin.remote))
-   {
-      void addnote (const char *note)
-      {
-         revk_web_send (req, "<tr><td colspan=6>%s</td></tr>", note);
-      }
-
-      void addtime (const char *tag, const char *field)
-      {
-         revk_web_send (req,
-                        "<td align=right>%s</td><td><input class=time type=time title=\"Set 00:00 to disable\" id='%s' onchange=\"w('%s',this.value);\"></td>",
-                        tag, field, field);
-      }
-      revk_web_send (req,
-                     "<div id=remote><hr><p>Faikin-auto mode (sets hot/cold and temp high/low to aim for the following target), and timed and auto power on/off.</p><table>");
-      add ("Enable", "autor", "Off", "0", fahrenheit ? "±0.9℉" : "±½℃", "0.5", fahrenheit ? "±1.8℉" : "±1℃", "1",
-           fahrenheit ? "±3.6℉" : "±2℃", "2", NULL);
-      addslider ("Target", "autot", tmin, tmax, get_temp_step ());
-      addnote ("Timed on and off (set other than 00:00)<br>Automated on/off if temp is way off target.");
-      revk_web_send (req, "<tr>");
-      addtime ("On", "auto1");
-      addtime ("Off", "auto0");
-      addb ("Auto ⏼", "autop", "Auto\non/off");
-      revk_web_send (req, "</tr>");
+   return jo_finisha (&j);
+}
+
+static void
+caps_update (void)
+{                               // Remake manifest if anything it depends on has changed (main task)
+   daikin_snap_t d;
+   snap_read (&d);
+   uint32_t hafingerprint = caps_hafingerprint (&d);
+   uint32_t fingerprint = caps_fingerprint (&d, hafingerprint);
+   if (caps.json && fingerprint == caps.fingerprint)
+      return;
+   char *js = caps_make (&d);
+   if (!js)
+      return;
+   if (!xSemaphoreTake (caps.mutex, 0))
+   {                            // Web is sending it, try next time
+      free (js);
+      return;
+   }
+   free (caps.json);
+   caps.json = js;
+   caps.fingerprint = fingerprint;
+   caps.hafingerprint = hafingerprint;
+   caps.version++;
+   caps.known = d.status_known;
+   caps.step = get_temp_step ();
+   caps.fan5 = have_5_fan_speeds ();
+   caps.cnwired = (proto_type () == PROTO_TYPE_CN_WIRED);
+   xSemaphoreGive (caps.mutex);
+}
+
+static esp_err_t
+web_capabilities (httpd_req_t * req)
+{                               // What the control page should show, from the manifest
+   httpd_resp_set_type (req, "application/json");
+   httpd_resp_set_hdr (req, "Cache-Control", "no-cache");
+   xSemaphoreTake (caps.mutex, portMAX_DELAY);
+   if (!caps.json)
+   {                            // Not made yet (main task not polling)
+      xSemaphoreGive (caps.mutex);
+      daikin_snap_t d;
+      snap_read (&d);
+      char *js = caps_make (&d);
+      httpd_resp_sendstr (req, js ? : "{}");
+      free (js);
+      return ESP_OK;
+   }
 #ifdef ELA
-      if (ble)
-      {
-         addnote ("External temperature reference for Faikin-auto mode");
-         revk_web_send (req, "<tr><td>BLE</td><td colspan=6>"   //
-                        "<select name=autob onchange=\"w('autob',this.options[this.selectedIndex].value);\">");
-         if (!*autob)
-            revk_web_send (req, "<option value=\"\">-- None --");
-         char found = 0;
-         for (bleenv_t * e = bleenv; e; e = e->next)
-         {
-            revk_web_send (req, "<option value=\"%s\"", e->name);
-            if (*autob && !strcmp (autob, e->name))
-            {
-               revk_web_send (req, " selected");
-               found = 1;
-            }
-            revk_web_send (req, ">%s", e->name);
-            if (!e->missing && e->rssi)
-               revk_web_send (req, " %ddB", e->rssi);
-         }
-         if (!found && *autob)
-         {
-            revk_web_send (req, "<option selected value=\"%s\">%s", autob, autob);
-         }
-         revk_web_send (req, "</select>");
-         if (ble && (uptime () < 60 || !found))
-            revk_web_send (req, " (reload to refresh list)");
-         revk_web_send (req, "</td></tr>");
+   if (ble)
+   {                            // BLE list changes, so send manifest then add to it
+      httpd_resp_send_chunk (req, caps.json, strlen (caps.json) - 1);
+      xSemaphoreGive (caps.mutex);
+      jo_t j = jo_object_alloc ();
+      jo_string (j, "autob", autob);
+      jo_bool (j, "blerefresh", uptime () < 60);
+      jo_array (j, "bles");
+      for (bleenv_t * e = bleenv; e; e = e->next)
+      {
+         jo_object (j, NULL);
+         jo_string (j, "name", e->name);
+         if (!e->missing && e->rssi)
+            jo_int (j, "rssi", e->rssi);
+         jo_close (j);
+      }
+      char *js = jo_finisha (&j);
+      if (js)
+      {
+         *js = ',';
+         httpd_resp_sendstr_chunk (req, js);
+      } else
+         httpd_resp_sendstr_chunk (req, "}");
+      free (js);
+      httpd_resp_sendstr_chunk (req, NULL);
+      return ESP_OK;
+   }
+#endif
+   static uint32_t boot = 0;    // So ETag differs after restart
+   if (!boot)
+      boot = esp_random ();
+   char etag[24];
+   sprintf (etag, "\"%08lX-%lu\"", (unsigned long) boot, (unsigned long) caps.version);
+   if (!web_not_modified (req, etag))
+      httpd_resp_sendstr (req, caps.json);
+   xSemaphoreGive (caps.mutex);
+   return ESP_OK;
+}
+
+// Macros with error collection for HTTP
+#define	daikin_set_v_e(err,name,value) {      \
+   const char * e = daikin_set_v(name, value); \
+   if (e) err = e;                             \
+}
+#define	daikin_set_i_e(err,name,value) {      \
+	const char * e = daikin_set_i(name, value); \
+   if (e) err = e;                             \
+}
+#define	daikin_set_e_e(err,name,value) {      \
+   const char *e = daikin_set_e(name, value);  \
+   if (e) err = e;                             \
+}
+#define	daikin_set_t_e(err,name,value) {      \
+   const char * e = daikin_set_t(name, value); \
+   if (e) err = e;                             \
+}
+
+// Our own JSON-based control interface starts here
+
+// Web socket clients, status is pushed to all on change, sent without blocking. Only touched from the httpd task, apart from queued
+#define	WS_CLIENTS	8       // Max clients we push to
+struct
+{
+   int fd[WS_CLIENTS];
+   uint8_t count;
+   volatile uint8_t queued;     // Push queued on httpd task
+} wsclients = { 0 };
+
+static void
+ws_remove (int fd)
+{
+   for (int i = 0; i < wsclients.count; i++)
+      if (wsclients.fd[i] == fd)
+      {
+         wsclients.fd[i] = wsclients.fd[--wsclients.count];
+         break;
+      }
+}
+
+static void
+ws_add (int fd)
+{
+   for (int i = 0; i < wsclients.count; i++)
+      if (wsclients.fd[i] == fd)
+         return;
+   if (wsclients.count == WS_CLIENTS)
+      return;                   // Client will still get status when it sends something
+   wsclients.fd[wsclients.count++] = fd;
+}
+
+static void sse_remove (int fd);
+
+static void
+web_close (httpd_handle_t hd, int fd)
+{                               // Socket closed
+   ws_remove (fd);
+   sse_remove (fd);
+   close (fd);
+}
+
+static char *
+ws_status (void)
+{                               // Status as sent to web socket
+   jo_t j = daikin_status ();
+   const char *reason;
+   if (revk_shutting_down (&reason))
+      jo_string (j, "shutdown", reason);
+   return jo_finisha (&j);
+}
+
+static void
+ws_push (void *arg)
+{                               // Push status to all clients (on httpd task), frame made once for all
+   wsclients.queued = 0;
+   if (!wsclients.count)
+      return;
+   char *js = ws_status ();
+   if (!js)
+      return;
+   size_t len = strlen (js);
+   char *frame = malloc (len + 10);
+   if (!frame)
+   {
+      free (js);
+      return;
+   }
+   int h = 0;                   // Text frame header, unmasked as from server
+   frame[h++] = 0x81;           // FIN, text
+   if (len < 126)
+      frame[h++] = len;
+   else if (len < 65536)
+   {
+      frame[h++] = 126;
+      frame[h++] = len >> 8;
+      frame[h++] = len;
+   } else
+   {
+      frame[h++] = 127;
+      for (int b = 7; b >= 0; b--)
+         frame[h++] = (uint64_t) len >> (b * 8);
+   }
+   memcpy (frame + h, js, len);
+   free (js);
+   len += h;
+   for (int i = 0; i < wsclients.count; i++)
+   {
+      int fd = wsclients.fd[i];
+      if (httpd_ws_get_fd_info (webserver, fd) != HTTPD_WS_CLIENT_WEBSOCKET)
+      {                         // Gone
+         ws_remove (fd);
+         i--;
+         continue;
+      }
+      if (httpd_socket_send (webserver, fd, frame, len, MSG_DONTWAIT) != len)
+      {                         // Not keeping up, or gone, don't let it hold up anyone else (a partial frame cannot be continued)
+         httpd_sess_trigger_close (webserver, fd);
+         ws_remove (fd);
+         i--;
+      }
+   }
+   free (frame);
+}
+
+static void
+ws_push_queue (void)
+{                               // Queue a push of status to web socket clients, one at a time
+   if (!webserver || !wsclients.count || wsclients.queued)
+      return;
+   wsclients.queued = 1;
+   if (httpd_queue_work (webserver, ws_push, NULL))
+      wsclients.queued = 0;
+}
+
+// Server-Sent Events on /events, status deltas to a few listeners, made once per update, sent without blocking
+#define	SSE_LISTENERS	4       // Max listeners
+#define	SSE_HEARTBEAT	15      // Seconds between heartbeat comments if nothing sent
+struct
+{
+   int fd[SSE_LISTENERS];
+   uint32_t joined[SSE_LISTENERS];      // daikin.version of full status sent on joining, if not the one deltas are from, else 0
+   uint8_t count;
+   volatile uint8_t queued;     // Push queued on httpd task
+   uint32_t last;               // uptime last sent
+   uint32_t version;            // daikin.version last sent
+   uint64_t known;              // status_known when last sent
+#define	b(name)		uint8_t name;
+#define	t(name)		float name;
+#define	i(name)		int name;
+#define	e(name,values)	uint8_t name;
+#define	s(name,len)	char name[len];
+#include "acextras.m"
+} sse = { 0 };
+
+static void
+sse_remove (int fd)
+{
+   for (int i = 0; i < sse.count; i++)
+      if (sse.fd[i] == fd)
+      {
+         sse.count--;
+         sse.fd[i] = sse.fd[sse.count];
+         sse.joined[i] = sse.joined[sse.count];
+         break;
+      }
+}
+
+static void
+sse_push (void *arg)
+{                               // Send changes since last push to all listeners (on httpd task)
+   sse.queued = 0;
+   if (!sse.count)
+      return;
+   jo_t j = jo_object_alloc ();
+   int changed = 0;
+   daikin_snap_t d;
+   snap_read (&d);
+   uint32_t version = d.version;
+   char *full = NULL;           // Full status for listeners that joined since deltas were from, as they may hold a different state
+   for (int i = 0; i < sse.count; i++)
+      if (sse.joined[i] && sse.joined[i] != version && !full)
+      {
+         jo_t f = daikin_status_snap (&d);
+         char *js = jo_finisha (&f);
+         if (!js || asprintf (&full, "event: status\nid: %lu\ndata: %s\n\n", (unsigned long) version, js) < 0)
+            full = NULL;
+         free (js);
       }
-#endif
-      revk_web_send (req, "</table></div>");
-   }
-   revk_web_send (req, "</form>"        //
-                  "</div>"      //
-                  "<script>"    //
-                  "var ws=0;"   //
-                  "var reboot=0;"       //
-                  "function cf(v){return %s;}"  //
-                  "function g(n){return document.getElementById(n);};"  //
-                  "function b(n,v){var d=g(n);if(d)d.checked=v;}"       //
-                  "function h(n,v){var d=g(n);if(d)d.style.display=v?'block':'none';}"  //
-                  "function s(n,v){var d=g(n);if(d)d.textContent=v;}"   //
-                  "function n(n,v){var d=g(n);if(d)d.value=v;}" //
-                  "function e(n,v){var d=g(n+v);if(d)d.checked=true;}"  //
-                  "function w(n,v){var m=new Object();m[n]=v;ws.send(JSON.stringify(m));}"      //
-                  "function t(n,v){s(n,v!=undefined?cf(v):'---');}"     //
-                  "function c(){"       //
-                  "ws=new WebSocket('ws://'+window.location.host+'/status');"   //
-                  "ws.onopen=function(v){g('top').className='on';};"    //
-                  "ws.onclose=function(v){ws=undefined;g('top').className='off';if(reboot)location.reload();};" //
-                  "ws.onerror=function(v){ws.close();};"        //
-                  "ws.onmessage=function(v){"   //
-                  "o=JSON.parse(v.data);"       //
-                  "b('power',o.power);" //
-                  "h('offline',!o.online);"     //
-                  "h('loopback',o.loopback);"   //
-                  "h('control',o.control);"     //
-                  "h('slave',o.slave);" //
-                  "h('remote',!o.remote);"      //
-                  "b('swingh',o.swingh);"       //
-                  "b('swingv',o.swingv);"       //
-                  "b('econo',o.econo);" //
-                  "b('powerful',o.powerful);"   //
-                  "b('comfort',o.comfort);"     //
-                  "b('sensor',o.sensor);"       //
-                  "b('led',o.led);"     //
-                  "b('quiet',o.quiet);" //
-                  "b('streamer',o.streamer);"   //
-                  "e('mode',o.mode);"   //
-                  "t('Inlet',o.inlet);" //
-                  "t('Home',o.home);"   //
-                  "t('Env',o.env);"     //
-                  "t('Outside',o.outside);"     //
-                  "t('Liquid',o.liquid);"       //
-                  "if(o.ble)t('BLE',o.ble.temp);"       //
-                  "if(o.ble)s('Hum',o.ble.hum?o.ble.hum+'%%':'');"      //
-                  "n('demand',o.demand);"       //
-                  "s('Tdemand',(o.demand!=undefined?o.demand+'%%':'---'));"     //
-                  "n('temp',o.temp);"   //
-                  "s('Ttemp',(o.temp?cf(o.temp):'---')+(o.control?'✷':''));"  //
-                  "b('autop',o.autop);" //
-                  "e('autor',o.autor);" //
-                  "n('autob',o.autob);" //
-                  "n('auto0',o.auto0);" //
-                  "n('auto1',o.auto1);" //
-                  "n('autot',o.autot);" //
-                  "s('Tautot',(o.autot?cf(o.autot):''));"       //
-                  "s('0/1',(o.slave?'❋':'')+(o.antifreeze?'❄':''));"        //
-                  "s('Fan',(o.fanrpm?o.fanrpm+'RPM':'')+(o.antifreeze?'❄':'')+(o.control?'✷':''));" //
-                  "e('fan',o.fan);"     //
-                  "if(o.shutdown){reboot=true;s('shutdown','Restarting: '+o.shutdown);h('shutdown',true);};"    //
-                  "};};c();"    //
-                  "setInterval(function() {if(!ws)c();else ws.send('');},1000);"        //
-                  "</script>", fahrenheit ? "Math.round(10*((v*9/5)+32))/10+'℉'" : "v+'℃'");
-   return revk_web_foot (req, 0, websettings, protocol_set ? proto_name () : NULL);
+   sse.version = version;
+#define	new(name)	((d.status_known&CONTROL_##name)&&!(sse.known&CONTROL_##name))
+#define	b(name)		if(new(name)||sse.name!=d.name){jo_bool(j,#name,d.name);changed++;}sse.name=d.name;
+#define	t(name)		if(new(name)||(sse.name!=d.name&&!(isnan(sse.name)&&isnan(d.name)))){if(isnan(d.name)||d.name>=100)jo_null(j,#name);else jo_litf(j,#name,"%.1f",d.name);changed++;}sse.name=d.name;
+#define	i(name)		if(new(name)||sse.name!=d.name){jo_int(j,#name,d.name);changed++;}sse.name=d.name;
+#define	e(name,values)	if((new(name)||sse.name!=d.name)&&d.name<sizeof(CONTROL_##name##_VALUES)-1){jo_stringf(j,#name,"%c",CONTROL_##name##_VALUES[d.name]);changed++;}sse.name=d.name;
+#define	s(name,len)	if(new(name)||strcmp(sse.name,d.name)){jo_string(j,#name,d.name);changed++;}strcpy(sse.name,d.name);
+#include "acextras.m"
+#undef new
+   sse.known = d.status_known;
+   char *js = jo_finisha (&j);
+   char *msg = NULL;
+   if (changed && js)
+   {
+      if (asprintf (&msg, "event: delta\nid: %lu\ndata: %s\n\n", (unsigned long) version, js) < 0)
+         msg = NULL;
+   } else if (uptime () - sse.last >= SSE_HEARTBEAT)
+      msg = strdup (": heartbeat\n\n");
+   free (js);
+   for (int i = 0; i < sse.count; i++)
+   {
+      const char *m = msg;
+      if (sse.joined[i])
+      {                         // Now in step with deltas
+         if (sse.joined[i] != version)
+            m = full;
+         sse.joined[i] = 0;
+      }
+      if (!m)
+         continue;
+      int len = strlen (m);
+      if (httpd_socket_send (webserver, sse.fd[i], m, len, MSG_DONTWAIT) != len)
+      {                         // Not keeping up, or gone, don't let it hold up anyone else
+         httpd_sess_trigger_close (webserver, sse.fd[i]);
+         sse_remove (sse.fd[i--]);
+      }
+   }
+   free (full);
+   if (!msg)
+      return;
+   free (msg);
+   sse.last = uptime ();
 }
 
-// Macros with error collection for HTTP
-#define	daikin_set_v_e(err,name,value) {      \
-   const char * e = daikin_set_v(name, value); \
-   if (e) err = e;                             \
-}
-#define	daikin_set_i_e(err,name,value) {      \
-	const char * e = daikin_set_i(name, value); \
-   if (e) err = e;                             \
-}
-#define	daikin_set_e_e(err,name,value) {      \
-   const char *e = daikin_set_e(name, value);  \
-   if (e) err = e;                             \
-}
-#define	daikin_set_t_e(err,name,value) {      \
-   const char * e = daikin_set_t(name, value); \
-   if (e) err = e;                             \
+static void
+sse_push_queue (void)
+{                               // Queue a push to listeners, if changed or heartbeat due
+   if (!webserver || !sse.count || sse.queued)
+      return;
+   sse.queued = 1;
+   if (httpd_queue_work (webserver, sse_push, NULL))
+      sse.queued = 0;
 }
 
-// Our own JSON-based control interface starts here
+static esp_err_t
+web_events (httpd_req_t * req)
+{                               // Server-Sent Events, full status to start (or resume), then deltas pushed
+   if (sse.count == SSE_LISTENERS)
+   {
+      httpd_resp_set_status (req, "503 Service Unavailable");
+      httpd_resp_sendstr (req, "Too many listeners");
+      return ESP_OK;
+   }
+   // Headers sent directly as this response has no end
+   const char head[] =
+      "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nAccess-Control-Allow-Origin: *\r\n\r\nretry: 5000\n\n";
+   if (httpd_send (req, head, sizeof (head) - 1) != sizeof (head) - 1)
+      return ESP_FAIL;
+   char last[12] = "";
+   if (httpd_req_get_hdr_value_len (req, "Last-Event-ID") < sizeof (last))
+      httpd_req_get_hdr_value_str (req, "Last-Event-ID", last, sizeof (last));
+   daikin_snap_t d;
+   snap_read (&d);
+   uint32_t version = d.version;
+   if (!*last || strtoul (last, NULL, 10) != version)
+   {                            // Full status, as new or missed something
+      jo_t j = daikin_status_snap (&d);
+      char *js = jo_finisha (&j);
+      char *msg = NULL;
+      if (js && asprintf (&msg, "event: status\nid: %lu\ndata: %s\n\n", (unsigned long) version, js) >= 0)
+      {
+         httpd_send (req, msg, strlen (msg));
+         free (msg);
+      }
+      free (js);
+   }
+   sse.joined[sse.count] = (version == sse.version ? 0 : version);     // Deltas are from sse.version, so may need full status again
+   sse.fd[sse.count++] = httpd_req_to_sockfd (req);
+   return ESP_OK;
+}
 
 static esp_err_t
 web_status (httpd_req_t * req)
 {                               // Web socket status report
    int fd = httpd_req_to_sockfd (req);
-   void wsend (jo_t * jp)
+   void wsend (char *js)
    {
-      char *js = jo_finisha (jp);
       if (js)
       {
          httpd_ws_frame_t ws_pkt;
@@ -1919,16 +2984,14 @@ web_status (httpd_req_t * req)
    }
    esp_err_t status (void)
    {
-      jo_t j = daikin_status ();
-      const char *reason;
-      int t = revk_shutting_down (&reason);
-      if (t)
-         jo_string (j, "shutdown", reason);
-      wsend (&j);
+      wsend (ws_status ());
       return ESP_OK;
    }
    if (req->method == HTTP_GET)
-      return status ();         // Send status on initial connect
+   {                            // Send status on initial connect, and then on changes
+      ws_add (fd);
+      return status ();
+   }
    // received packet
    httpd_ws_frame_t ws_pkt;
    uint8_t *buf = NULL;
@@ -1957,85 +3020,275 @@ web_status (httpd_req_t * req)
    return status ();
 }
 
-// Legacy API
-// The following handlers provide web-based control protocol, compatible
-// with original Daikin BRP series online controllers.
-// These functions make use of the JSON library, even though the requests are query form formatted, and replies are comma formatted
-
-static jo_t
-legacy_ok (void)
+// REST API, GET /api/status has an ETag from the status version so pollers mostly get 304
+static esp_err_t
+web_api_status (httpd_req_t * req)
 {
+   static uint32_t boot = 0;    // So ETag differs after restart
+   if (!boot)
+      boot = esp_random ();
+   daikin_snap_t d;
+   snap_read (&d);              // ETag and status from the same snapshot
+   char etag[24];
+   sprintf (etag, "\"%08lX-%lu\"", (unsigned long) boot, (unsigned long) d.version);
+   httpd_resp_set_hdr (req, "Cache-Control", "no-cache");
+   if (web_not_modified (req, etag))
+      return ESP_OK;
+   jo_t j = daikin_status_snap (&d);
+   char *js = jo_finisha (&j);
+   httpd_resp_set_type (req, "application/json");
+   httpd_resp_sendstr (req, js ? : "{}");
+   free (js);
+   return ESP_OK;
+}
+
+static esp_err_t
+web_api_control (httpd_req_t * req)
+{                               // POST JSON as per MQTT control
+   const char *err = NULL;
+   char *buf = NULL;
+   if (!req->content_len || req->content_len > 1000)
+      err = "Bad length";
+   else if (!(buf = malloc (req->content_len)))
+      err = "No memory";
+   else
+   {
+      int len = 0;
+      while (len < req->content_len)
+      {
+         int r = httpd_req_recv (req, buf + len, req->content_len - len);
+         if (r <= 0)
+            break;
+         len += r;
+      }
+      jo_t j = NULL;
+      if (len < req->content_len)
+         err = "Short read";
+      else if (!(j = jo_parse_mem (buf, len)))
+         err = "Bad JSON";
+      else
+      {
+         err = daikin_control (j);
+         jo_free (&j);
+      }
+   }
+   free (buf);
    jo_t j = jo_object_alloc ();
-   jo_string (j, "ret", "OK");
-   return j;
+   if (err && *err)
+   {
+      jo_string (j, "error", err);
+      httpd_resp_set_status (req, "400 Bad Request");
+   } else
+      jo_bool (j, "ok", 1);
+   char *js = jo_finisha (&j);
+   httpd_resp_set_type (req, "application/json");
+   httpd_resp_sendstr (req, js ? : "{}");
+   free (js);
+   return ESP_OK;
 }
 
 static esp_err_t
-legacy_send (httpd_req_t * req, jo_t * jp)
-{
-   httpd_resp_set_type (req, "text/plain");
-   if (jp && *jp)
+web_history (httpd_req_t * req)
+{                               // History export, ?tier=fast/minute/slow&format=csv/bin&since=unix time
+   if (!historyenable)
+   {
+      httpd_resp_send_err (req, HTTPD_404_NOT_FOUND, "History not enabled (historyenable)");
+      return ESP_OK;
+   }
+   int k = 1,
+      bin = 0;
+   uint32_t since = 0;
+   jo_t q = revk_web_query (req);
+   if (q)
    {
-      jo_t j = *jp;
-      int len = jo_len (j);
-      char *buf = mallocspi (len + 40),
-         *p = buf;;
-      if (buf)
+      char val[20];
+      if (jo_find (q, "tier") == JO_STRING)
+      {
+         jo_strncpy (q, val, sizeof (val));
+         for (int t = 0; t < HISTORY_TIERS; t++)
+            if (!strcmp (val, history_tier_name[t]))
+               k = t;
+      }
+      if (jo_find (q, "format") == JO_STRING)
+      {
+         jo_strncpy (q, val, sizeof (val));
+         bin = !strcmp (val, "bin");
+      }
+      if (jo_find (q, "since") == JO_STRING)
+      {
+         jo_strncpy (q, val, sizeof (val));
+         since = strtoul (val, NULL, 10);
+      }
+      jo_free (&q);
+   }
+   uint32_t count = history.tier[k].count,
+      n = 0;
+   while (n < count && history_get (k, n)->t < since)
+      n++;
+   if (bin)
+   {                            // Text header line with field names and types, then packed little endian rows
+      httpd_resp_set_type (req, "application/octet-stream");
+      revk_web_send (req, "FaikinHistory,1,%u,%lu,t:u32", (unsigned) sizeof (history_row_t), (unsigned long) history.tier[k].period);
+#define	b(name)		revk_web_send(req,","#name":u8%%");
+#define	t(name)		revk_web_send(req,","#name":i16C");
+#define	i(name)		revk_web_send(req,","#name":i32");
+#define	e(name,values)	revk_web_send(req,","#name":u8="#values);
+#include "acextras.m"
+      revk_web_send (req, "\n");
+      history_row_t buf[16];
+      int b = 0;
+      for (; n < count; n++)
       {
-         jo_rewind (j);
-         while (jo_next (j) == JO_TAG && p + 3 - buf < len)
+         buf[b++] = *history_get (k, n);
+         if (b == sizeof (buf) / sizeof (*buf))
          {
-            if (p > buf)
-               *p++ = ',';
-            int l = jo_strlen (j);
-            if (p - buf + l + 2 > len)
-               break;
-            jo_strncpy (j, p, l + 1);
-            p += l;
-            *p++ = '=';
-            if (jo_next (j) < JO_STRING)
-               break;
-            l = jo_strlen (j);
-            *p = 0;
-            if (p - buf + l + 2 > len)
-               break;
-            jo_strncpy (j, p, l + 1);
-            p += l;
+            httpd_resp_send_chunk (req, (const char *) buf, sizeof (buf));
+            b = 0;
          }
-         *p = 0;
-         httpd_resp_sendstr (req, buf);
-         free (buf);
       }
-      jo_free (jp);
+      if (b)
+         httpd_resp_send_chunk (req, (const char *) buf, b * sizeof (*buf));
+   } else
+   {                            // CSV
+      httpd_resp_set_type (req, "text/csv");
+      revk_web_send (req, "ts");
+#define	b(name)		revk_web_send(req,","#name);
+#define	t(name)		b(name)
+#define	i(name)		b(name)
+#define	e(name,values)	b(name)
+#include "acextras.m"
+      revk_web_send (req, "\n");
+      for (; n < count; n++)
+      {
+         const history_row_t *h = history_get (k, n);
+         revk_web_send (req, "%lu", (unsigned long) h->t);
+#define	b(name)		if(h->name==HISTORY_UNKNOWN)revk_web_send(req,",");else revk_web_send(req,",%.2f",h->name/100.0);
+#define	t(name)		if(h->name==INT16_MIN)revk_web_send(req,",");else revk_web_send(req,",%.2f",h->name/100.0);
+#define	i(name)		if(h->name==INT32_MIN)revk_web_send(req,",");else revk_web_send(req,",%ld",(long)h->name);
+#define	e(name,values)	if(h->name>=sizeof(CONTROL_##name##_VALUES)-1)revk_web_send(req,",");else revk_web_send(req,",%c",CONTROL_##name##_VALUES[h->name]);
+#include "acextras.m"
+         revk_web_send (req, "\n");
+      }
    }
+   httpd_resp_send_chunk (req, NULL, 0);
+   return ESP_OK;
+}
+
+// Legacy API
+// The following handlers provide web-based control protocol, compatible
+// with original Daikin BRP series online controllers.
+// Requests are query form formatted, parsed using the JSON library, and replies are comma formatted, sent as made
+
+typedef struct
+{                               // Legacy reply, sent in chunks as made, no JSON tree or heap
+   httpd_req_t *req;
+   char buf[128];
+   uint8_t len;
+   uint8_t first:1;             // First on line (no comma)
+   daikin_snap_t d;             // Status, one snapshot for the whole reply
+} legacy_t;
+
+static void
+legacy_flush (legacy_t * l)
+{
+   if (l->len)
+      httpd_resp_send_chunk (l->req, l->buf, l->len);
+   l->len = 0;
+}
+
+static void
+legacy_str (legacy_t * l, const char *tag, const char *value)
+{                               // Add tag=value
+   int need = strlen (tag) + strlen (value) + 3; // Comma, equals, and null
+   if (l->len + need > sizeof (l->buf))
+      legacy_flush (l);
+   if (need > sizeof (l->buf))
+   {                            // Silly long, send as is
+      if (!l->first)
+         httpd_resp_send_chunk (l->req, ",", 1);
+      httpd_resp_send_chunk (l->req, tag, strlen (tag));
+      httpd_resp_send_chunk (l->req, "=", 1);
+      httpd_resp_send_chunk (l->req, value, strlen (value));
+   } else
+      l->len += sprintf (l->buf + l->len, "%s%s=%s", l->first ? "" : ",", tag, value);
+   l->first = 0;
+}
+
+static void
+legacy_f (legacy_t * l, const char *tag, const char *fmt, ...)
+{                               // Add tag=formatted value
+   char value[64];
+   va_list ap;
+   va_start (ap, fmt);
+   vsnprintf (value, sizeof (value), fmt, ap);
+   va_end (ap);
+   legacy_str (l, tag, value);
+}
+
+static void
+legacy_int (legacy_t * l, const char *tag, int value)
+{
+   legacy_f (l, tag, "%d", value);
+}
+
+static void
+legacy_ok (legacy_t * l)
+{                               // Start of payload
+   legacy_str (l, "ret", "OK");
+}
+
+static void
+legacy_line (legacy_t * l)
+{                               // Next payload, for combined response
+   if (l->len + 1 > sizeof (l->buf))
+      legacy_flush (l);
+   l->buf[l->len++] = '\n';
+   l->first = 1;
+}
+
+static void
+legacy_start (legacy_t * l, httpd_req_t * req)
+{
+   memset (l, 0, sizeof (*l));
+   l->req = req;
+   l->first = 1;
+   snap_read (&l->d);
+   httpd_resp_set_type (req, "text/plain");
+}
+
+static esp_err_t
+legacy_end (legacy_t * l)
+{
+   legacy_flush (l);
+   httpd_resp_send_chunk (l->req, NULL, 0);
    return ESP_OK;
 }
 
 static void
-legacy_adv (jo_t j)
+legacy_adv (legacy_t * l)
 {
-   jo_int (j, "adv",            //
-           daikin.powerful ? 2 :        //
-           daikin.econo ? 12 :  //
-           daikin.streamer ? 13 :       //
-           0);
+   legacy_int (l, "adv",        //
+               l->d.powerful ? 2 :    //
+               l->d.econo ? 12 :      //
+               l->d.streamer ? 13 :   //
+               0);
 }
 
 static esp_err_t
 legacy_simple_response (httpd_req_t * req, const char *err)
 {
-   jo_t j = jo_object_alloc ();
+   legacy_t l;
+   legacy_start (&l, req);
    if (err && *err)
    {
-      jo_string (j, "ret", "PARAM NG");
-      jo_string (j, "adv", err);
+      legacy_str (&l, "ret", "PARAM NG");
+      legacy_str (&l, "adv", err);
    } else
    {
-
-      jo_string (j, "ret", "OK");
-      legacy_adv (j);
+      legacy_ok (&l);
+      legacy_adv (&l);
    }
-   return legacy_send (req, &j);
+   return legacy_end (&l);
 }
 
 static esp_err_t
@@ -2083,102 +3336,126 @@ legacy_web_set_demand_control (httpd_req_t * req)
    return legacy_simple_response (req, err);
 }
 
-static esp_err_t
-legacy_web_get_basic_info (httpd_req_t * req)
+static void
+legacy_basic_info (legacy_t * l)
 {
    time_t now = time (0);
    struct tm tm;
    localtime_r (&now, &tm);
-   jo_t j = legacy_ok ();
-   jo_string (j, "type", "aircon");
-   jo_string (j, "reg", region);
-   jo_int (j, "dst", tm.tm_isdst);      // Guess
-   jo_string (j, "ver", revk_version);
-   jo_string (j, "rev", revk_version);
-   jo_int (j, "pow", daikin.power);
-   jo_int (j, "err", 1 - daikin.online);
-   jo_int (j, "location", 0);
-   jo_string (j, "name", hostname);
-   jo_int (j, "icon", 1);
-   jo_string (j, "method", "none");     // ??
-   jo_int (j, "port", 0);       // ??
-   jo_string (j, "id", revk_id);
-   jo_string (j, "pw", "");
-   jo_int (j, "lpw_flag", 0);
-   jo_int (j, "adp_kind", 0);   // ??
-   jo_int (j, "pv", 0);         // ?? versions?
-   jo_int (j, "cpv", 0);        //
-   jo_int (j, "cpv_minor", 0);  //
-   jo_int (j, "led", daikin.led);
-   jo_int (j, "en_setzone", 0); // ??
-   jo_string (j, "mac", revk_id);
-   jo_string (j, "ssid", revk_wifi ());
-   jo_string (j, "grp_name", "");
-   jo_int (j, "en_grp", 0);     //??
-   return legacy_send (req, &j);
+   legacy_ok (l);
+   legacy_str (l, "type", "aircon");
+   legacy_str (l, "reg", region);
+   legacy_int (l, "dst", tm.tm_isdst);  // Guess
+   legacy_str (l, "ver", revk_version);
+   legacy_str (l, "rev", revk_version);
+   legacy_int (l, "pow", l->d.power);
+   legacy_int (l, "err", 1 - l->d.online);
+   legacy_int (l, "location", 0);
+   legacy_str (l, "name", hostname);
+   legacy_int (l, "icon", 1);
+   legacy_str (l, "method", "none");    // ??
+   legacy_int (l, "port", 0);   // ??
+   legacy_str (l, "id", revk_id);
+   legacy_str (l, "pw", "");
+   legacy_int (l, "lpw_flag", 0);
+   legacy_int (l, "adp_kind", 0);       // ??
+   legacy_int (l, "pv", 0);     // ?? versions?
+   legacy_int (l, "cpv", 0);    //
+   legacy_int (l, "cpv_minor", 0);      //
+   legacy_int (l, "led", l->d.led);
+   legacy_int (l, "en_setzone", 0);     // ??
+   legacy_str (l, "mac", revk_id);
+   legacy_str (l, "ssid", revk_wifi ());
+   legacy_str (l, "grp_name", "");
+   legacy_int (l, "en_grp", 0); //??
 }
 
 static esp_err_t
-legacy_web_get_model_info (httpd_req_t * req)
+legacy_web_get_basic_info (httpd_req_t * req)
+{
+   legacy_t l;
+   legacy_start (&l, req);
+   legacy_basic_info (&l);
+   return legacy_end (&l);
+}
+
+static void
+legacy_model_info (legacy_t * l)
 {
-   jo_t j = legacy_ok ();
-   jo_string (j, "model", daikin.model);
-   return legacy_send (req, &j);
+   legacy_ok (l);
+   legacy_str (l, "model", l->d.model);
 }
 
 static esp_err_t
-legacy_web_get_control_info (httpd_req_t * req)
+legacy_web_get_model_info (httpd_req_t * req)
+{
+   legacy_t l;
+   legacy_start (&l, req);
+   legacy_model_info (&l);
+   return legacy_end (&l);
+}
+
+static void
+legacy_control_info (legacy_t * l)
 {
    static float dt[8] = { 20, 20, 20, 20, 20, 20, 20, 20 };     // Used for some of the status
    static char dfr[8] = { 'A', 'A', 'A', 'A', 'A', 'A', 'A', 'A' };
    char mode = '0';
-   if (daikin.mode <= 7)
-      mode = "64370002"[daikin.mode];
-   dfr[mode - '0'] = "A34567B"[daikin.fan];
-   dt[mode - '0'] = daikin.temp;
-   jo_t j = legacy_ok ();
-   jo_int (j, "pow", daikin.power);
-   jo_stringf (j, "mode", "%c", mode);
-   legacy_adv (j);
-   jo_litf (j, "stemp", "%.1f", daikin.temp);
-   jo_int (j, "shum", 0);
+   if (l->d.mode <= 7)
+      mode = "64370002"[l->d.mode];
+   dfr[mode - '0'] = "A34567B"[l->d.fan];
+   dt[mode - '0'] = l->d.temp;
+   legacy_ok (l);
+   legacy_int (l, "pow", l->d.power);
+   legacy_f (l, "mode", "%c", mode);
+   legacy_adv (l);
+   legacy_f (l, "stemp", "%.1f", l->d.temp);
+   legacy_int (l, "shum", 0);
    for (int i = 1; i <= 7; i++)
    {                            // Temp setting in mode
       char tag[4] = { 'd', 't', '0' + i };
-      jo_litf (j, tag, "%.1f", dt[i]);
+      legacy_f (l, tag, "%.1f", dt[i]);
    }
    for (int i = 1; i <= 7; i++)
    {                            // Probably humidity, unknown
       char tag[4] = { 'd', 'h', '0' + i };
-      jo_int (j, tag, 0);
-   }
-   jo_int (j, "dhh", 0);
-   if (daikin.mode <= 7)
-      jo_stringf (j, "b_mode", "%c", "64370002"[daikin.mode]);
-   jo_litf (j, "b_stemp", "%.1f", daikin.temp);
-   jo_int (j, "b_shum", 0);
-   jo_int (j, "alert", 255);
-   if (daikin.fan <= 6)
-      jo_stringf (j, "f_rate", "%c", "A34567B"[daikin.fan]);
-   jo_int (j, "f_dir", daikin.swingh * 2 + daikin.swingv);
-   if (daikin.fan <= 6)
-      jo_stringf (j, "b_f_rate", "%c", "A34567B"[daikin.fan]);
-   jo_int (j, "b_f_dir", daikin.swingh * 2 + daikin.swingv);
+      legacy_int (l, tag, 0);
+   }
+   legacy_int (l, "dhh", 0);
+   if (l->d.mode <= 7)
+      legacy_f (l, "b_mode", "%c", "64370002"[l->d.mode]);
+   legacy_f (l, "b_stemp", "%.1f", l->d.temp);
+   legacy_int (l, "b_shum", 0);
+   legacy_int (l, "alert", 255);
+   if (l->d.fan <= 6)
+      legacy_f (l, "f_rate", "%c", "A34567B"[l->d.fan]);
+   legacy_int (l, "f_dir", l->d.swingh * 2 + l->d.swingv);
+   if (l->d.fan <= 6)
+      legacy_f (l, "b_f_rate", "%c", "A34567B"[l->d.fan]);
+   legacy_int (l, "b_f_dir", l->d.swingh * 2 + l->d.swingv);
    for (int i = 1; i <= 7; i++)
    {                            // Fan rate
       char tag[5] = { 'd', 'f', 'r', '0' + i };
-      jo_stringf (j, tag, "%c", dfr[i]);
+      legacy_f (l, tag, "%c", dfr[i]);
    }
-   jo_int (j, "dfrh", 0);
+   legacy_int (l, "dfrh", 0);
    for (int i = 1; i <= 7; i++)
    {                            // Unknown
       char tag[5] = { 'd', 'f', 'd', '0' + i };
-      jo_int (j, tag, 0);
+      legacy_int (l, tag, 0);
    }
-   jo_int (j, "dfdh", 0);
-   jo_int (j, "dmnd_run", 0);
-   jo_int (j, "en_demand", (daikin.status_known & CONTROL_demand) && daikin.demand < 100 ? 1 : 0);
-   return legacy_send (req, &j);
+   legacy_int (l, "dfdh", 0);
+   legacy_int (l, "dmnd_run", 0);
+   legacy_int (l, "en_demand", (l->d.status_known & CONTROL_demand) && l->d.demand < 100 ? 1 : 0);
+}
+
+static esp_err_t
+legacy_web_get_control_info (httpd_req_t * req)
+{
+   legacy_t l;
+   legacy_start (&l, req);
+   legacy_control_info (&l);
+   return legacy_end (&l);
 }
 
 static esp_err_t
@@ -2258,22 +3535,45 @@ legacy_web_set_control_info (httpd_req_t * req)
    return legacy_simple_response (req, err);
 }
 
-static esp_err_t
-legacy_web_get_sensor_info (httpd_req_t * req)
+static void
+legacy_sensor_info (legacy_t * l)
 {
-   jo_t j = legacy_ok ();
-   if (daikin.status_known & CONTROL_home)
-      jo_litf (j, "htemp", "%.2f", daikin.home);
+   legacy_ok (l);
+   if (l->d.status_known & CONTROL_home)
+      legacy_f (l, "htemp", "%.2f", l->d.home);
    else
-      jo_string (j, "htemp", "-");
-   jo_string (j, "hhum", "-");
-   if (daikin.status_known & CONTROL_outside)
-      jo_litf (j, "otemp", "%.2f", daikin.outside);
+      legacy_str (l, "htemp", "-");
+   legacy_str (l, "hhum", "-");
+   if (l->d.status_known & CONTROL_outside)
+      legacy_f (l, "otemp", "%.2f", l->d.outside);
    else
-      jo_string (j, "otemp", "-");
-   jo_int (j, "err", 0);
-   jo_string (j, "cmpfreq", "-");
-   return legacy_send (req, &j);
+      legacy_str (l, "otemp", "-");
+   legacy_int (l, "err", 0);
+   legacy_str (l, "cmpfreq", "-");
+}
+
+static esp_err_t
+legacy_web_get_sensor_info (httpd_req_t * req)
+{
+   legacy_t l;
+   legacy_start (&l, req);
+   legacy_sensor_info (&l);
+   return legacy_end (&l);
+}
+
+static esp_err_t
+legacy_web_get_all_info (httpd_req_t * req)
+{                               // Not a BRP endpoint, basic, model, control, and sensor info, one per line, in one request
+   legacy_t l;
+   legacy_start (&l, req);
+   legacy_basic_info (&l);
+   legacy_line (&l);
+   legacy_model_info (&l);
+   legacy_line (&l);
+   legacy_control_info (&l);
+   legacy_line (&l);
+   legacy_sensor_info (&l);
+   return legacy_end (&l);
 }
 
 static esp_err_t
@@ -2283,30 +3583,114 @@ legacy_web_register_terminal (httpd_req_t * req)
    // responds with 403. It's supposed that we remember our client and enable access.
    // We don't support authentication currently, so let's just return OK
    // However, it could be a nice idea to have in future
-   jo_t j = legacy_ok ();
-   return legacy_send (req, &j);
+   legacy_t l;
+   legacy_start (&l, req);
+   legacy_ok (&l);
+   return legacy_end (&l);
+}
+
+static void
+legacy_energy (legacy_t * l, const char *tag, const energy_t * e, int n, uint32_t * keys, int count, int heat)
+{                               // List of values in 0.1kWh, for keys, "/" separated
+   char value[100],
+    *p = value;
+   for (int i = 0; i < count && p < value + sizeof (value) - 12; i++)
+   {
+      const energy_t *f = energy_find (e, n, keys[i]);
+      p += sprintf (p, "%s%lu", i ? "/" : "", f ? (unsigned long) (heat ? f->heat : f->cool) / 100 : 0UL);
+   }
+   *p = 0;
+   legacy_str (l, tag, value);
 }
 
 static esp_err_t
 legacy_web_get_year_power (httpd_req_t * req)
-{
-   jo_t j = legacy_ok ();
-   jo_string (j, "curr_year_heat", "0/0/0/0/0/0/0/0/0/0/0/0");
-   jo_string (j, "prev_year_heat", "0/0/0/0/0/0/0/0/0/0/0/0");
-   jo_string (j, "curr_year_cool", "0/0/0/0/0/0/0/0/0/0/0/0");
-   jo_string (j, "prevr_year_cool", "0/0/0/0/0/0/0/0/0/0/0/0");
-   return legacy_send (req, &j);
+{                               // Months, January first, in 0.1kWh
+   time_t now = time (0);
+   struct tm tm;
+   localtime_r (&now, &tm);
+   uint32_t curr[12],
+     prev[12];
+   for (int m = 0; m < 12; m++)
+   {
+      curr[m] = (tm.tm_year + 1900) * 100 + m + 1;
+      prev[m] = (tm.tm_year + 1899) * 100 + m + 1;
+   }
+   energy_t e[sizeof (energy.store.month) / sizeof (energy_t)];
+   energy_copy (e, energy.store.month, sizeof (e));
+   int n = sizeof (e) / sizeof (*e);
+   legacy_t l;
+   legacy_start (&l, req);
+   legacy_ok (&l);
+   legacy_energy (&l, "curr_year_heat", e, n, curr, 12, 1);
+   legacy_energy (&l, "prev_year_heat", e, n, prev, 12, 1);
+   legacy_energy (&l, "curr_year_cool", e, n, curr, 12, 0);
+   legacy_energy (&l, "prev_year_cool", e, n, prev, 12, 0);
+   return legacy_end (&l);
 }
 
 static esp_err_t
 legacy_web_get_week_power (httpd_req_t * req)
-{
-   // ret=OK,s_dayw=2,week_heat=0/0/0/0/0/0/0/0/0/0/0/0/0/0,week_cool=0/0/0/0/0/0/0/0/0/0/0/0/0/0
-   // Have no idea how to implement it, perhaps the original module keeps some internal statistics.
-   // For now let's just prevent errors in OpenHAB and return an empty OK response
-   // Note all zeroes from my BRP
-   jo_t j = legacy_ok ();
-   return legacy_send (req, &j);
+{                               // ret=OK,s_dayw=2,week_heat=0/0/0/0/0/0/0/0/0/0/0/0/0/0,week_cool=0/0/0/0/0/0/0/0/0/0/0/0/0/0
+   // Last 14 days, today first, in 0.1kWh, s_dayw is today's day of week (0 is Sunday)
+   time_t now = time (0);
+   struct tm tm;
+   localtime_r (&now, &tm);
+   uint32_t days[14];
+   for (int d = 0; d < 14; d++)
+      days[d] = energy_day (now - d * 86400);
+   energy_t e[sizeof (energy.store.day) / sizeof (energy_t)];
+   energy_copy (e, energy.store.day, sizeof (e));
+   int n = sizeof (e) / sizeof (*e);
+   legacy_t l;
+   legacy_start (&l, req);
+   legacy_ok (&l);
+   legacy_int (&l, "s_dayw", tm.tm_wday);
+   legacy_energy (&l, "week_heat", e, n, days, 14, 1);
+   legacy_energy (&l, "week_cool", e, n, days, 14, 0);
+   return legacy_end (&l);
+}
+
+static esp_err_t
+web_api_energy (httpd_req_t * req)
+{                               // Energy history as JSON, newest first, Wh
+   typeof (energy.store) * s = malloc (sizeof (*s));
+   if (!s)
+      return httpd_resp_send_err (req, HTTPD_500_INTERNAL_SERVER_ERROR, "No memory");
+   energy_copy (s, &energy.store, sizeof (*s));
+   jo_t j = jo_object_alloc ();
+   void list (const char *tag, const energy_t * e, int n, int type)
+   {
+      jo_array (j, tag);
+      for (int i = 0; i < n && e[i].key; i++)
+      {
+         jo_object (j, NULL);
+         if (type == 'h')
+         {
+            time_t t = (time_t) e[i].key * 3600;
+            struct tm tm;
+            gmtime_r (&t, &tm);
+            jo_stringf (j, "start", "%04d-%02d-%02dT%02d:00:00Z", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour);
+         } else if (type == 'd')
+            jo_stringf (j, "date", "%04lu-%02lu-%02lu", (unsigned long) e[i].key / 10000, (unsigned long) e[i].key / 100 % 100,
+                        (unsigned long) e[i].key % 100);
+         else
+            jo_stringf (j, "month", "%04lu-%02lu", (unsigned long) e[i].key / 100, (unsigned long) e[i].key % 100);
+         jo_int (j, "heat", e[i].heat);
+         jo_int (j, "cool", e[i].cool);
+         jo_close (j);
+      }
+      jo_close (j);
+   }
+   list ("hour", s->hour, sizeof (s->hour) / sizeof (energy_t), 'h');
+   list ("day", s->day, sizeof (s->day) / sizeof (energy_t), 'd');
+   list ("month", s->month, sizeof (s->month) / sizeof (energy_t), 'm');
+   free (s);
+   char *js = jo_finisha (&j);
+   httpd_resp_set_type (req, "application/json");
+   httpd_resp_sendstr (req, js ? : "{}");
+   free (js);
+   return ESP_OK;
 }
 
 static esp_err_t
@@ -2381,6 +3765,7 @@ static void
 send_ha_config (void)
 {
    daikin.ha_send = 0;
+   caps.hasent = caps.hafingerprint;
    char *hastatus = revk_topic (topicstate, NULL, NULL);
    char *cmd = revk_topic (topiccommand, NULL, NULL);
    char *topic;
@@ -2476,16 +3861,16 @@ send_ha_config (void)
       jo_int (j, "min_temp", tmin);
       jo_int (j, "max_temp", tmax);
       jo_string (j, "temp_unit", "C");
-      jo_lit (j, "temp_step", ha1c ? "1" : get_temp_step ());
+      jo_lit (j, "temp_step", ha1c ? "1" : caps.step);
       jo_string (j, "temp_cmd_t", "~/temp");
       jo_string (j, "temp_stat_t", hastatus);
       jo_string (j, "temp_stat_tpl", "{{value_json.target}}");
-      if (daikin.status_known & (CONTROL_inlet | CONTROL_home))
+      if (caps.known & (CONTROL_inlet | CONTROL_home))
       {
          jo_string (j, "curr_temp_t", hastatus);
          jo_string (j, "curr_temp_tpl", "{{value_json.temp}}");
       }
-      if (daikin.status_known & CONTROL_mode)
+      if (caps.known & CONTROL_mode)
       {
          jo_string (j, "mode_cmd_t", "~/mode");
          jo_string (j, "mode_stat_t", hastatus);
@@ -2507,46 +3892,46 @@ send_ha_config (void)
          jo_string (j, NULL, "fan_only");
          jo_close (j);
       }
-      if (daikin.status_known & CONTROL_fan)
+      if (caps.known & CONTROL_fan)
       {
          jo_string (j, "fan_mode_cmd_t", "~/fan");
          jo_string (j, "fan_mode_stat_t", hastatus);
          jo_string (j, "fan_mode_stat_tpl", "{{value_json.fan}}");
-         if (have_5_fan_speeds ())
+         if (caps.fan5)
          {
             addmodes (j, fans);
-         } else if (proto_type () == PROTO_TYPE_CN_WIRED)
+         } else if (caps.cnwired)
          {
             addmodes (j, cn_wired_fans);
          }
          // [“auto”, “low”, “medium”, “high”] is the default, no need to report
       }
-      if (daikin.status_known & (CONTROL_swingh | CONTROL_swingv | CONTROL_comfort))
+      if (caps.known & (CONTROL_swingh | CONTROL_swingv | CONTROL_comfort))
       {
          jo_string (j, "swing_mode_cmd_t", "~/swing");
          jo_string (j, "swing_mode_stat_t", hastatus);
          jo_string (j, "swing_mode_stat_tpl", "{{value_json.swing}}");
          jo_array (j, "swing_modes");
          jo_string (j, NULL, "off");
-         if (daikin.status_known & CONTROL_swingh)
+         if (caps.known & CONTROL_swingh)
             jo_string (j, NULL, "H");
-         if (daikin.status_known & CONTROL_swingv)
+         if (caps.known & CONTROL_swingv)
             jo_string (j, NULL, "V");
-         if ((daikin.status_known & (CONTROL_swingh | CONTROL_swingv)) == (CONTROL_swingh | CONTROL_swingv))
+         if ((caps.known & (CONTROL_swingh | CONTROL_swingv)) == (CONTROL_swingh | CONTROL_swingv))
             jo_string (j, NULL, "H+V");
-         if (daikin.status_known & CONTROL_comfort)
+         if (caps.known & CONTROL_comfort)
             jo_string (j, NULL, "C");
          jo_close (j);
       }
-      if (daikin.status_known & (CONTROL_econo | CONTROL_powerful))
+      if (caps.known & (CONTROL_econo | CONTROL_powerful))
       {
          jo_string (j, "pr_mode_cmd_t", "~/preset");
          jo_string (j, "pr_mode_stat_t", hastatus);
          jo_string (j, "pr_mode_val_tpl", "{{value_json.preset}}");
          jo_array (j, "pr_modes");
-         if (daikin.status_known & CONTROL_econo)
+         if (caps.known & CONTROL_econo)
             jo_string (j, NULL, "eco");
-         if (daikin.status_known & CONTROL_powerful)
+         if (caps.known & CONTROL_powerful)
             jo_string (j, NULL, "boost");
          if (!nohomepreset)
             jo_string (j, NULL, "home");
@@ -2555,18 +3940,18 @@ send_ha_config (void)
       revk_mqtt_send (NULL, 1, topic, &j);
       free (topic);
    }
-   addtemp ((daikin.status_known & CONTROL_home) && (daikin.status_known & CONTROL_inlet), "inlet", "Inlet", "mdi:thermometer");        // Both defined so we used home as temp, so lets add inlet here
-   addtemp (daikin.status_known & CONTROL_outside, "outside", "Outside", "mdi:thermometer");
-   addtemp (daikin.status_known & CONTROL_liquid, "liquid", "Liquid", "mdi:coolant-temperature");
-   addfreq (daikin.status_known & CONTROL_comp, "comp", "Compressor", hacomprpm ? "rpm" : "Hz", "mdi:sine-wave");
-   addfreq (daikin.status_known & CONTROL_fanrpm, "fanfreq", "Fan", hafanrpm ? "rpm" : "Hz", "mdi:fan");
-   addswitch (haswitches && (daikin.status_known & CONTROL_power), "power", "Power", "mdi:power");
-   addswitch (haswitches && (daikin.status_known & CONTROL_streamer), "streamer", "Streamer", "mdi:air-filter");
-   addswitch (haswitches && (daikin.status_known & CONTROL_sensor), "sensor", "Sensor mode", "mdi:motion-sensor");
-   addswitch (haswitches && (daikin.status_known & CONTROL_powerful), "powerful", "Powerful", "mdi:arm-flex");
-   addswitch (haswitches && (daikin.status_known & CONTROL_comfort), "comfort", "Comfort mode", "mdi:teddy-bear");
-   addswitch (haswitches && (daikin.status_known & CONTROL_quiet), "quiet", "Quiet outdoor", "mdi:volume-minus");
-   addswitch (haswitches && (daikin.status_known & CONTROL_econo), "econo", "Econo mode", "mdi:trending-down");
+   addtemp ((caps.known & CONTROL_home) && (caps.known & CONTROL_inlet), "inlet", "Inlet", "mdi:thermometer");        // Both defined so we used home as temp, so lets add inlet here
+   addtemp (caps.known & CONTROL_outside, "outside", "Outside", "mdi:thermometer");
+   addtemp (caps.known & CONTROL_liquid, "liquid", "Liquid", "mdi:coolant-temperature");
+   addfreq (caps.known & CONTROL_comp, "comp", "Compressor", hacomprpm ? "rpm" : "Hz", "mdi:sine-wave");
+   addfreq (caps.known & CONTROL_fanrpm, "fanfreq", "Fan", hafanrpm ? "rpm" : "Hz", "mdi:fan");
+   addswitch (haswitches && (caps.known & CONTROL_power), "power", "Power", "mdi:power");
+   addswitch (haswitches && (caps.known & CONTROL_streamer), "streamer", "Streamer", "mdi:air-filter");
+   addswitch (haswitches && (caps.known & CONTROL_sensor), "sensor", "Sensor mode", "mdi:motion-sensor");
+   addswitch (haswitches && (caps.known & CONTROL_powerful), "powerful", "Powerful", "mdi:arm-flex");
+   addswitch (haswitches && (caps.known & CONTROL_comfort), "comfort", "Comfort mode", "mdi:teddy-bear");
+   addswitch (haswitches && (caps.known & CONTROL_quiet), "quiet", "Quiet outdoor", "mdi:volume-minus");
+   addswitch (haswitches && (caps.known & CONTROL_econo), "econo", "Econo mode", "mdi:trending-down");
 #ifdef ELA
    void addhum (uint64_t ok, const char *tag, const char *name, const char *icon)
    {
@@ -2615,7 +4000,7 @@ send_ha_config (void)
 #if 1
    if (asprintf (&topic, "homeassistant/select/%sdemand/config", revk_id) >= 0)
    {
-      if (!(daikin.status_known & CONTROL_demand))
+      if (!(caps.known & CONTROL_demand))
          revk_mqtt_send_str (topic);
       else
       {
@@ -2635,7 +4020,7 @@ send_ha_config (void)
 #endif
    if (asprintf (&topic, "homeassistant/sensor/%senergy/config", revk_id) >= 0)
    {
-      if (!(daikin.status_known & CONTROL_Wh))
+      if (!(caps.known & CONTROL_Wh))
          revk_mqtt_send_str (topic);
       else
       {
@@ -2662,44 +4047,116 @@ ha_status (void)
    revk_command ("status", NULL);
 }
 
+// Coalesced status publishing, small changes wait up to livemax, significant changes wait at least livemin from last
+struct
+{
+   uint32_t sent;               // uptime last published
+   uint8_t due:1;               // Significant change to publish
+   uint8_t stale:1;             // Small change to publish
+   uint8_t state:1;             // State message wanted even if not livestatus
+   uint8_t now:1;               // Publish now
+#define	t(name)	float name;
+#define	i(name)	int name;
+#include "acextras.m"
+} livestate = { 0 };
+
+static int
+live_float (float was, float is)
+{                               // Temperature has changed significantly
+   if (isnan (was) || isnan (is))
+      return isnan (was) != isnan (is);
+   return was != is && fabsf (is - was) >= (float) livetemp / livetemp_scale;
+}
+
+static int
+live_int (int was, int is, int threshold)
+{                               // Integer has changed significantly
+   return was != is && abs (is - was) >= threshold;
+}
+
+static int
+live_step (uint64_t control)
+{                               // Integer change that is significant, 0 for never (Wh is a counter, so always rising)
+   if (control == CONTROL_fanrpm)
+      return liverpm ? : 1;
+   if (control == CONTROL_comp)
+      return livecomp ? : 1;
+   if (control == CONTROL_anglev)
+      return liveangle ? : 1;
+   if (control == CONTROL_Wh)
+      return 0;
+   return 1;                    // e.g. demand, a control
+}
+
+static int
+live_significant (void)
+{                               // Status has changed significantly from what we last published
+#define	t(name)	if(live_float(livestate.name,daikin.name))return 1;
+#define	i(name)	if(live_step(CONTROL_##name)&&live_int(livestate.name,daikin.name,live_step(CONTROL_##name)))return 1;
+#include "acextras.m"
+   return 0;
+}
+
+static void
+live_publish (void)
+{                               // Publish status if due
+   uint32_t now = uptime ();
+   if (!livestate.now && !(livestate.due && now - livestate.sent >= livemin)
+       && !(livestate.stale && now - livestate.sent >= livemax))
+      return;
+   if (debug || livestatus || livestate.state)
+   {
+      jo_t j = daikin_status ();
+      revk_state ("status", &j);
+   }
+   ha_status ();
+#define	t(name)	livestate.name=daikin.name;
+#define	i(name)	livestate.name=daikin.name;
+#include "acextras.m"
+   livestate.sent = now;
+   livestate.due = livestate.stale = livestate.state = livestate.now = 0;
+}
+
 void
 revk_state_extra (jo_t j)
 {
    if (!haenable)
       return;
+   daikin_snap_t d;
+   snap_read (&d);
    if (b.loopback)
       jo_bool (j, "loopback", 1);
-   else if (daikin.status_known & CONTROL_online)
-      jo_bool (j, "online", daikin.online);
-   if (daikin.status_known & CONTROL_power)
-      jo_bool (j, "power", daikin.power);
-   //if (daikin.status_known & CONTROL_temp) // HA always expects this
-   jo_litf (j, "target", "%.2f", autor ? (float) autot / autot_scale : daikin.temp);    // Target - either internal or what we are using as reference
-   if (daikin.status_known & CONTROL_env)
-      jo_litf (j, "temp", "%.2f", daikin.env);  // The external temperature
-   else if (daikin.status_known & CONTROL_home)
-      jo_litf (j, "temp", "%.2f", daikin.home); // We use home if present, else inlet
-   else if (daikin.status_known & CONTROL_inlet)
-      jo_litf (j, "temp", "%.2f", daikin.inlet);
-   if ((daikin.status_known & CONTROL_home) && (daikin.status_known & CONTROL_inlet))
-      jo_litf (j, "inlet", "%.2f", daikin.inlet);       // Both so report inlet as well
-   if (daikin.status_known & CONTROL_outside)
-      jo_litf (j, "outside", "%.2f", daikin.outside);
-   if (daikin.status_known & CONTROL_liquid)
-      jo_litf (j, "liquid", "%.2f", daikin.liquid);
-   if (daikin.status_known & CONTROL_demand)
-      jo_int (j, "demand", daikin.demand);
-   if ((daikin.status_known & CONTROL_Wh) && daikin.Wh)
-      jo_int (j, "Wh", daikin.Wh);
-   if (daikin.status_known & CONTROL_fanrpm)
+   else if (d.status_known & CONTROL_online)
+      jo_bool (j, "online", d.online);
+   if (d.status_known & CONTROL_power)
+      jo_bool (j, "power", d.power);
+   //if (d.status_known & CONTROL_temp) // HA always expects this
+   jo_litf (j, "target", "%.2f", autor ? (float) autot / autot_scale : d.temp);       // Target - either internal or what we are using as reference
+   if (d.status_known & CONTROL_env)
+      jo_litf (j, "temp", "%.2f", d.env);  // The external temperature
+   else if (d.status_known & CONTROL_home)
+      jo_litf (j, "temp", "%.2f", d.home); // We use home if present, else inlet
+   else if (d.status_known & CONTROL_inlet)
+      jo_litf (j, "temp", "%.2f", d.inlet);
+   if ((d.status_known & CONTROL_home) && (d.status_known & CONTROL_inlet))
+      jo_litf (j, "inlet", "%.2f", d.inlet);       // Both so report inlet as well
+   if (d.status_known & CONTROL_outside)
+      jo_litf (j, "outside", "%.2f", d.outside);
+   if (d.status_known & CONTROL_liquid)
+      jo_litf (j, "liquid", "%.2f", d.liquid);
+   if (d.status_known & CONTROL_demand)
+      jo_int (j, "demand", d.demand);
+   if ((d.status_known & CONTROL_Wh) && d.Wh)
+      jo_int (j, "Wh", d.Wh);
+   if (d.status_known & CONTROL_fanrpm)
    {
       if (hafanrpm)
-         jo_int (j, "fanfreq", daikin.fanrpm);
+         jo_int (j, "fanfreq", d.fanrpm);
       else
-         jo_litf (j, "fanfreq", "%.1f", daikin.fanrpm / 60.0);
+         jo_litf (j, "fanfreq", "%.1f", d.fanrpm / 60.0);
    }
-   if (daikin.status_known & CONTROL_comp)
-      jo_int (j, "comp", (hacomprpm ? 60 : 1) * daikin.comp);
+   if (d.status_known & CONTROL_comp)
+      jo_int (j, "comp", (hacomprpm ? 60 : 1) * d.comp);
 #ifdef ELA
    if (ble && bletemp)
    {
@@ -2711,35 +4168,35 @@ revk_state_extra (jo_t j)
          jo_int (j, "blebat", bletemp->bat);
    }
 #endif
-   if (daikin.status_known & CONTROL_mode)
+   if (d.status_known & CONTROL_mode)
    {
       const char *modes[] = { "fan_only", "heat", "cool", "heat_cool", "4", "5", "6", "dry" };  // FHCA456D
-      jo_string (j, "mode", daikin.power ? autor && !lockmode ? "heat_cool" : modes[daikin.mode] : "off");      // If we are controlling, it is auto
+      jo_string (j, "mode", d.power ? autor && !lockmode ? "heat_cool" : modes[d.mode] : "off");      // If we are controlling, it is auto
    }
-   if (!nohvacaction && daikin.action != HVAC_IDLE)
-      jo_string (j, "action", hvac_action[daikin.action]);
-   if (daikin.status_known & CONTROL_fan)
+   if (!nohvacaction && d.action != HVAC_IDLE)
+      jo_string (j, "action", hvac_action[d.action]);
+   if (d.status_known & CONTROL_fan)
    {
       const struct FanMode *f = get_fan_modes ();
-      jo_string (j, "fan", f[daikin.fan].name);
-   }
-   if (daikin.status_known & CONTROL_streamer)
-      jo_bool (j, "streamer", daikin.streamer);
-   if (daikin.status_known & CONTROL_quiet)
-      jo_bool (j, "quiet", daikin.quiet);
-   if (daikin.status_known & CONTROL_econo)
-      jo_bool (j, "econo", daikin.econo);
-   if (daikin.status_known & CONTROL_comfort)
-      jo_bool (j, "comfort", daikin.comfort);
-   if (daikin.status_known & CONTROL_powerful)
-      jo_bool (j, "powerful", daikin.powerful);
-   if (daikin.status_known & CONTROL_sensor)
-      jo_bool (j, "sensor", daikin.sensor);
-   if (daikin.status_known & (CONTROL_swingh | CONTROL_swingv | CONTROL_comfort))
+      jo_string (j, "fan", f[d.fan].name);
+   }
+   if (d.status_known & CONTROL_streamer)
+      jo_bool (j, "streamer", d.streamer);
+   if (d.status_known & CONTROL_quiet)
+      jo_bool (j, "quiet", d.quiet);
+   if (d.status_known & CONTROL_econo)
+      jo_bool (j, "econo", d.econo);
+   if (d.status_known & CONTROL_comfort)
+      jo_bool (j, "comfort", d.comfort);
+   if (d.status_known & CONTROL_powerful)
+      jo_bool (j, "powerful", d.powerful);
+   if (d.status_known & CONTROL_sensor)
+      jo_bool (j, "sensor", d.sensor);
+   if (d.status_known & (CONTROL_swingh | CONTROL_swingv | CONTROL_comfort))
       jo_string (j, "swing",
-                 daikin.comfort ? "C" : daikin.swingh & daikin.swingv ? "H+V" : daikin.swingh ? "H" : daikin.swingv ? "V" : "off");
-   if (daikin.status_known & (CONTROL_econo | CONTROL_powerful))
-      jo_string (j, "preset", daikin.econo ? "eco" : daikin.powerful ? "boost" : nohomepreset ? "none" : "home");       // Limited modes
+                 d.comfort ? "C" : d.swingh & d.swingv ? "H+V" : d.swingh ? "H" : d.swingv ? "V" : "off");
+   if (d.status_known & (CONTROL_econo | CONTROL_powerful))
+      jo_string (j, "preset", d.econo ? "eco" : d.powerful ? "boost" : nohomepreset ? "none" : "home");       // Limited modes
 }
 
 void
@@ -2800,6 +4257,65 @@ uart_setup (void)
    }
 }
 
+static esp_err_t
+web_metrics (httpd_req_t * req)
+{                               // Prometheus text format, sent in chunks as we go
+   httpd_resp_set_type (req, "text/plain; version=0.0.4");
+   void head (const char *name, const char *type, const char *help)
+   {
+      revk_web_send (req, "# HELP faikin_%s %s\n# TYPE faikin_%s %s\n", name, help, name, type);
+   }
+   void hist (const char *name, const char *label, const metrics_hist_t * h, const uint16_t * le, int n)
+   {
+      uint32_t c = 0;
+      for (int b = 0; b < n; b++)
+         revk_web_send (req, "faikin_%s_bucket{%s%sle=\"%.3f\"} %lu\n", name, label, *label ? "," : "", le[b] / 1000.0,
+                        (unsigned long) (c += h->bucket[b]));
+      revk_web_send (req, "faikin_%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, label, *label ? "," : "", (unsigned long) h->count);
+      revk_web_send (req, "faikin_%s_sum%s%s%s %.3f\n", name, *label ? "{" : "", label, *label ? "}" : "", h->sum / 1000.0);
+      revk_web_send (req, "faikin_%s_count%s%s%s %lu\n", name, *label ? "{" : "", label, *label ? "}" : "", (unsigned long) h->count);
+   }
+   // Aircon values, from one consistent snapshot
+   daikin_snap_t d;
+   snap_read (&d);
+#define	b(name)		if(d.status_known&CONTROL_##name){head(#name,"gauge",#name);revk_web_send(req,"faikin_"#name" %d\n",d.name?1:0);}
+#define	t(name)		if((d.status_known&CONTROL_##name)&&!isnan(d.name)){head(#name,"gauge",#name" (C)");revk_web_send(req,"faikin_"#name" %.2f\n",d.name);}
+#define	r(name)		if(!isnan(d.min##name)&&!isnan(d.max##name)){head("min"#name,"gauge","min "#name" (C)");revk_web_send(req,"faikin_min"#name" %.2f\n",d.min##name); \
+			head("max"#name,"gauge","max "#name" (C)");revk_web_send(req,"faikin_max"#name" %.2f\n",d.max##name);}
+#define	i(name)		if(d.status_known&CONTROL_##name){head(#name,"gauge",#name);revk_web_send(req,"faikin_"#name" %d\n",d.name);}
+#define	e(name,values)	if((d.status_known&CONTROL_##name)&&d.name<sizeof(CONTROL_##name##_VALUES)-1){head(#name,"gauge",#name" (label is value)"); \
+			revk_web_send(req,"faikin_"#name"{"#name"=\"%c\"} 1\n",CONTROL_##name##_VALUES[d.name]);}
+#include "acextras.m"
+   // Comms
+   head ("comms_errors_total", "counter", "Comms errors by type");
+   for (int i = 0; i < COMMS_MAX; i++)
+      revk_web_send (req, "faikin_comms_errors_total{type=\"%s\"} %lu\n", comms_name[i], (unsigned long) comms.total[i]);
+   head ("control_giveup_total", "counter", "Control changes given up as not accepted by aircon");
+   revk_web_send (req, "faikin_control_giveup_total %lu\n", (unsigned long) metrics.giveup);
+   head ("command_rtt_seconds", "histogram", "Command round trip time");
+   for (int i = 0; i < metrics.cmds; i++)
+   {
+      char label[20];
+      sprintf (label, "cmd=\"%s\"", metrics.cmd[i].cmd);
+      hist ("command_rtt_seconds", label, &metrics.cmd[i].rtt, metrics_rtt_le, sizeof (metrics_rtt_le) / sizeof (*metrics_rtt_le));
+   }
+   head ("poll_cycle_seconds", "histogram", "Poll cycle duration");
+   hist ("poll_cycle_seconds", "", &metrics.cycle, metrics_cycle_le, sizeof (metrics_cycle_le) / sizeof (*metrics_cycle_le));
+   // System
+   head ("uptime_seconds", "counter", "Uptime");
+   revk_web_send (req, "faikin_uptime_seconds %lu\n", (unsigned long) uptime ());
+   head ("heap_free_bytes", "gauge", "Free heap");
+   revk_web_send (req, "faikin_heap_free_bytes %lu\n", (unsigned long) esp_get_free_heap_size ());
+   head ("heap_min_free_bytes", "gauge", "Minimum free heap since boot");
+   revk_web_send (req, "faikin_heap_min_free_bytes %lu\n", (unsigned long) esp_get_minimum_free_heap_size ());
+   head ("stack_free_bytes", "gauge", "Task stack high water mark");
+   if (metrics.stack)
+      revk_web_send (req, "faikin_stack_free_bytes{task=\"main\"} %lu\n", (unsigned long) metrics.stack);
+   revk_web_send (req, "faikin_stack_free_bytes{task=\"httpd\"} %u\n", uxTaskGetStackHighWaterMark (NULL));
+   httpd_resp_sendstr_chunk (req, NULL);
+   return ESP_OK;
+}
+
 static void
 register_uri (const httpd_uri_t * uri_struct)
 {
@@ -2821,6 +4337,17 @@ register_get_uri (const char *uri, esp_err_t (*handler) (httpd_req_t * r))
    register_uri (&uri_struct);
 }
 
+static void
+register_post_uri (const char *uri, esp_err_t (*handler) (httpd_req_t * r))
+{
+   httpd_uri_t uri_struct = {
+      .uri = uri,
+      .method = HTTP_POST,
+      .handler = handler,
+   };
+   register_uri (&uri_struct);
+}
+
 static void
 register_ws_uri (const char *uri, esp_err_t (*handler) (httpd_req_t * r))
 {
@@ -2866,6 +4393,9 @@ app_main ()
    }
 #endif
    daikin.mutex = xSemaphoreCreateMutex ();
+   settings.mutex = xSemaphoreCreateMutex ();
+   caps.mutex = xSemaphoreCreateMutex ();
+   energy.mutex = xSemaphoreCreateMutex ();
    daikin.status_known = CONTROL_online;
 #define	t(name)	daikin.name=NAN;
 #define	r(name)	daikin.min##name=NAN;daikin.max##name=NAN;
@@ -2882,7 +4412,8 @@ app_main ()
       config.stack_size += 2048;        // Being on the safe side
       // When updating the code below, make sure this is enough
       // Note that we're also adding revk's own web config handlers
-      config.max_uri_handlers = 14 + revk_num_web_handlers ();
+      config.max_uri_handlers = 22 + revk_num_web_handlers ();
+      config.close_fn = web_close;      // Track web socket clients
       if (!httpd_start (&webserver, &config))
       {
          if (websettings)
@@ -2891,12 +4422,19 @@ app_main ()
          if (webcontrol)
          {
             register_get_uri ("/apple-touch-icon.png", web_icon);
+            register_get_uri ("/capabilities", web_capabilities);
             register_ws_uri ("/status", web_status);
+            register_get_uri ("/events", web_events);
+            register_get_uri ("/api/status", web_api_status);
+            register_post_uri ("/api/control", web_api_control);
+            register_get_uri ("/api/energy", web_api_energy);
+            register_get_uri ("/history", web_history);
             register_get_uri ("/common/basic_info", legacy_web_get_basic_info);
             register_get_uri ("/aircon/get_model_info", legacy_web_get_model_info);
             register_get_uri ("/aircon/get_control_info", legacy_web_get_control_info);
             register_get_uri ("/aircon/set_control_info", legacy_web_set_control_info);
             register_get_uri ("/aircon/get_sensor_info", legacy_web_get_sensor_info);
+            register_get_uri ("/aircon/get_all_info", legacy_web_get_all_info);
             register_get_uri ("/common/register_terminal", legacy_web_register_terminal);
             register_get_uri ("/aircon/get_year_power_ex", legacy_web_get_year_power);
             register_get_uri ("/aircon/get_week_power_ex", legacy_web_get_week_power);
@@ -2904,6 +4442,8 @@ app_main ()
             register_get_uri ("/aircon/set_demand_control", legacy_web_set_demand_control);
             register_get_uri ("/aircon/set_holiday", legacy_web_set_holiday);
          }
+         if (webmetrics)
+            register_get_uri ("/metrics", web_metrics);
          // When adding, update config.max_uri_handlers
       }
    }
@@ -2999,6 +4539,8 @@ app_main ()
                come once per second, and that's our timing */
             usleep (1000000LL - (esp_timer_get_time () % 1000000LL));
          }
+         group_apply ();
+         int64_t cycle = esp_timer_get_time ();
 #ifdef ELA
          if (ble_sensor_connected ())
          {                      // Automatic external temperature logic - only really useful if autor/autot set
@@ -3175,8 +4717,8 @@ app_main ()
                   else
                      temp[2] = AC_MIN_TEMP_VALUE;       // No temp in other modes
                   temp[3] = ("A34567B"[daikin.fan]);
-                  daikin_s21_command ('D', '1', S21_PAYLOAD_LEN, temp);
                   xSemaphoreGive (daikin.mutex);
+                  daikin_s21_command ('D', '1', S21_PAYLOAD_LEN, temp);
                }
                if (daikin.control_changed & (CONTROL_swingh | CONTROL_swingv))
                {                // D5
@@ -3185,34 +4727,28 @@ app_main ()
                   temp[1] = (daikin.swingh || daikin.swingv ? '?' : '0');
                   temp[2] = '0';
                   temp[3] = '0';
-                  daikin_s21_command ('D', '5', S21_PAYLOAD_LEN, temp);
                   xSemaphoreGive (daikin.mutex);
+                  daikin_s21_command ('D', '5', S21_PAYLOAD_LEN, temp);
                }
                if (daikin.control_changed & (CONTROL_powerful | CONTROL_comfort | CONTROL_streamer |
                                              CONTROL_sensor | CONTROL_quiet | CONTROL_led))
                {                // D6
+                  char d3[S21_PAYLOAD_LEN] = { '0', '0', '0', '0' };
                   xSemaphoreTake (daikin.mutex, portMAX_DELAY);
-                  if (!s21.F3)
-                  {             // F3 or F6 depends on model
-                     temp[0] = '0';
-                     temp[1] = '0';
-                     temp[2] = '0';
-                     temp[3] = '0' + (daikin.powerful ? 2 : 0);
-                     daikin_s21_command ('D', '3', S21_PAYLOAD_LEN, temp);
-                  }
+                  d3[3] = '0' + (daikin.powerful ? 2 : 0);
+                  temp[0] = '0' + (daikin.powerful ? 2 : 0) + (daikin.comfort ? 0x40 : 0) + (daikin.quiet ? 0x80 : 0);
+                  temp[1] = '0' + (daikin.streamer ? 0x80 : 0);
+                  temp[2] = '0';
+                  // If sensor, the 8 is sensor, if not, then 4 and 8 are LED, with 4=high, 8=low, 12=off
+                  if (noled || !nosensor)
+                     temp[3] = '0' + (daikin.sensor ? 0x08 : 0) + (daikin.led ? 0x04 : 0);      // Messy but gives some controls
+                  else
+                     temp[3] = '0' + (daikin.led ? dark ? 8 : 4 : 12);
+                  xSemaphoreGive (daikin.mutex);
+                  if (!s21.F3)  // F3 or F6 depends on model
+                     daikin_s21_command ('D', '3', S21_PAYLOAD_LEN, d3);
                   if (!s21.F6)
-                  {
-                     temp[0] = '0' + (daikin.powerful ? 2 : 0) + (daikin.comfort ? 0x40 : 0) + (daikin.quiet ? 0x80 : 0);
-                     temp[1] = '0' + (daikin.streamer ? 0x80 : 0);
-                     temp[2] = '0';
-                     // If sensor, the 8 is sensor, if not, then 4 and 8 are LED, with 4=high, 8=low, 12=off
-                     if (noled || !nosensor)
-                        temp[3] = '0' + (daikin.sensor ? 0x08 : 0) + (daikin.led ? 0x04 : 0);   // Messy but gives some controls
-                     else
-                        temp[3] = '0' + (daikin.led ? dark ? 8 : 4 : 12);
                      daikin_s21_command ('D', '6', S21_PAYLOAD_LEN, temp);
-                  }
-                  xSemaphoreGive (daikin.mutex);
                }
                if (daikin.control_changed & (CONTROL_demand | CONTROL_econo))
                {                // D7
@@ -3221,8 +4757,8 @@ app_main ()
                   temp[1] = '0' + (daikin.econo ? 2 : 0);
                   temp[2] = '0';
                   temp[3] = '0';
-                  daikin_s21_command ('D', '7', S21_PAYLOAD_LEN, temp);
                   xSemaphoreGive (daikin.mutex);
+                  daikin_s21_command ('D', '7', S21_PAYLOAD_LEN, temp);
                }
             } else if (proto_type () == PROTO_TYPE_X50A)
             {                   // Newer protocol
@@ -3256,19 +4792,36 @@ app_main ()
          }
          // Report status changes if happen on AC side. Ignore if we've just sent
          // some new control values
+         uint8_t wspush = 0;
          if (!daikin.control_changed && (daikin.status_changed || daikin.status_report || daikin.mode_changed))
          {
-            uint8_t send = ((debug || livestatus || daikin.status_report || daikin.mode_changed) ? 1 : 0);
+            if (daikin.status_report || daikin.mode_changed)
+               livestate.state = 1;
+            if (daikin.status_report)
+               livestate.now = 1;       // Asked for
+            else if (daikin.mode_changed || live_significant ())
+               livestate.due = 1;
+            else
+               livestate.stale = 1;
             daikin.status_changed = 0;
             daikin.mode_changed = 0;
             daikin.status_report = 0;
-            if (send)
-            {
-               jo_t j = daikin_status ();
-               revk_state ("status", &j);
-            }
-            ha_status ();
+            xSemaphoreTake (daikin.mutex, portMAX_DELAY);
+            daikin.version++;   // Catch anything changed without set_*
+            xSemaphoreGive (daikin.mutex);
+            wspush = 1;
          }
+         snap_publish ();       // Before anything reports status
+         if (wspush)
+            ws_push_queue ();   // After snap_publish, as httpd may run it straight away
+         caps_update ();
+         if (haenable && caps.hasent != caps.hafingerprint)
+            daikin.ha_send = 1; // Capabilities HA uses changed
+         live_publish ();
+         if (revk_shutting_down (NULL))
+            ws_push_queue ();   // So web page shows restarting
+         if (sse.count && (sse.version != daikin.version || uptime () - sse.last >= SSE_HEARTBEAT))
+            sse_push_queue ();
          // Stats
 #define b(name)         if(daikin.name)daikin.total##name++;
 #define t(name)		if(!isnan(daikin.name)){if(!daikin.count##name||daikin.min##name>daikin.name)daikin.min##name=daikin.name;	\
@@ -3292,6 +4845,7 @@ app_main ()
 #include "accontrols.m"
             revk_error ("failed-set", &j);
             daikin.control_changed = 0; // Give up on changes
+            metrics.giveup++;
             daikin.control_count = 0;
          }
          revk_blink (0, 0, b.loopback ? "RGB" : !daikin.online ? "M" : dark ? "" : !daikin.power ? "y" : daikin.mode == 0 ? "O" : daikin.mode == 7 ? "C" : daikin.heat ? "R" : "B");    // FHCA456D
@@ -3647,6 +5201,10 @@ app_main ()
          }
          // End of local auto controls
 
+         comms_summary ();
+         settings_check ();
+         energy_update ();
+         history_sample ();
          if (reporting && !revk_link_down () && protocol_set)
          {                      // Environment logging
             time_t clock = time (0);
@@ -3686,6 +5244,9 @@ app_main ()
             send_ha_config ();
             ha_status ();       // Update status now sent
          }
+         metrics_add (&metrics.cycle, metrics_cycle_le, sizeof (metrics_cycle_le) / sizeof (*metrics_cycle_le),
+                      (esp_timer_get_time () - cycle) / 1000);
+         metrics.stack = uxTaskGetStackHighWaterMark (NULL);
       }
       while (daikin.talking);
       // We're here if protocol has been broken. We'll reconfigure the UART
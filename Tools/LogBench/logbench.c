@@ -0,0 +1,394 @@
+// Faikin log ingest benchmark, publishes Faikin reports to MQTT and watches faikinlog store them
+// Copyright (c) 2019-2024 Adrian Kennard, Andrews & Arnold Limited, see LICENSE file (GPL)
+// Payloads (payload.c) are built from acextras.m as Faikin.c sends them, with a unique ts per tag, marked as backfill
+// so faikinlog uses it, so every message is a new row. faikinlog's /metrics (--metrics-port) is polled for rows stored,
+// and as rows are stored in close to the order sent, the Nth row stored is taken as the Nth message sent, giving end to
+// end latency to within the poll interval. CPU per message is faikinlog's process_cpu_seconds_total, plus any --pid
+// (e.g. mariadbd, mosquitto) from /proc. Exit status 1 if a --max-*/--min-* limit is not met.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <popt.h>
+#include <err.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <mosquitto.h>
+#include "payload.h"
+
+const char *mqtthost = "localhost";
+int mqttport = 1883;
+const char *prefix = "Faikin";
+const char *tagprefix = "bench";
+const char *metricshost = "localhost";
+const char *metricsport = "9101";
+int tags = 100;
+int rate = 1000;                // Messages per second
+int seconds = 10;
+int drain = 30;                 // Seconds to wait for faikinlog to catch up
+int poll = 20;                  // ms between /metrics polls
+volatile int running = 1;
+
+uint64_t *sent = NULL;          // Time each message was sent (us), in order
+size_t sentmax = 0;
+size_t sentcount = 0;
+uint32_t *us = NULL;            // Latencies of messages seen stored
+size_t uscount = 0;
+
+static uint64_t
+now_us (void)
+{
+   struct timespec t;
+   clock_gettime (CLOCK_MONOTONIC, &t);
+   return (uint64_t) t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
+
+// faikinlog /metrics
+
+typedef struct
+{
+   int ok;
+   double received,
+     inserted,
+     dropped,
+     spooled,
+     cpu;
+} metrics_t;
+
+static char *
+http_get (const char *path)
+{                               // Body, malloc'd, NULL if failed (faikinlog closes after each response)
+   struct addrinfo hints = {.ai_socktype = SOCK_STREAM },
+      *res = NULL;
+   if (getaddrinfo (metricshost, metricsport, &hints, &res) || !res)
+      return NULL;
+   int fd = -1;
+   for (struct addrinfo * a = res; a && fd < 0; a = a->ai_next)
+   {
+      fd = socket (a->ai_family, a->ai_socktype, a->ai_protocol);
+      if (fd >= 0 && connect (fd, a->ai_addr, a->ai_addrlen))
+      {
+         close (fd);
+         fd = -1;
+      }
+   }
+   freeaddrinfo (res);
+   if (fd < 0)
+      return NULL;
+   struct timeval t = {.tv_sec = 5 };
+   setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof (t));
+   char *req = NULL;
+   int l = asprintf (&req, "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n", path, metricshost);
+   int ok = (l > 0 && send (fd, req, l, MSG_NOSIGNAL) == l);
+   free (req);
+   char *buf = NULL;
+   size_t len = 0,
+      size = 0;
+   ssize_t got;
+   while (ok)
+   {
+      if (len + 4096 > size)
+         buf = realloc (buf, size += 65536);
+      if ((got = recv (fd, buf + len, size - len - 1, 0)) <= 0)
+         break;
+      len += got;
+   }
+   close (fd);
+   if (!buf)
+      return NULL;
+   buf[len] = 0;
+   char *body = strstr (buf, "\r\n\r\n");
+   if (!ok || strncmp (buf, "HTTP/1.0 200", 12) || !body)
+   {
+      free (buf);
+      return NULL;
+   }
+   memmove (buf, body + 4, len - (body + 4 - buf) + 1);
+   return buf;
+}
+
+static metrics_t
+metrics (void)
+{
+   metrics_t m = { 0 };
+   char *body = http_get ("/metrics");
+   if (!body)
+      return m;
+   m.ok = 1;
+   for (char *l = strtok (body, "\n"); l; l = strtok (NULL, "\n"))
+   {
+      char *v = strrchr (l, ' ');
+      if (*l == '#' || !v)
+         continue;
+      double d = strtod (v + 1, NULL);
+      if (!strncmp (l, "faikinlog_received_total ", 25))
+         m.received = d;
+      else if (!strncmp (l, "faikinlog_inserted_total ", 25))
+         m.inserted = d;
+      else if (!strncmp (l, "faikinlog_dropped_total ", 24))
+         m.dropped = d;
+      else if (!strncmp (l, "faikinlog_spooled_total ", 24))
+         m.spooled = d;
+      else if (!strncmp (l, "process_cpu_seconds_total ", 26))
+         m.cpu = d;
+   }
+   free (body);
+   return m;
+}
+
+static double
+pidcpu (const char *pids)
+{                               // CPU seconds used by a comma separated list of pids
+   double total = 0;
+   char *list = strdupa (pids);
+   for (char *p = strtok (list, ","); p; p = strtok (NULL, ","))
+   {
+      char path[100];
+      snprintf (path, sizeof (path), "/proc/%d/stat", atoi (p));
+      FILE *f = fopen (path, "r");
+      if (!f)
+         continue;
+      char line[1024];
+      if (fgets (line, sizeof (line), f))
+      {                         // utime and stime are fields 14 and 15, after the (comm)
+         char *s = strrchr (line, ')');
+         unsigned long long ut = 0,
+            st = 0;
+         if (s && sscanf (s + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &ut, &st) == 2)
+            total += (double) (ut + st) / sysconf (_SC_CLK_TCK);
+      }
+      fclose (f);
+   }
+   return total;
+}
+
+// Watch faikinlog store the messages
+
+pthread_mutex_t watch_mutex = PTHREAD_MUTEX_INITIALIZER;
+metrics_t base,                 // Before sending
+  last;                         // Latest poll
+uint64_t lastinsert = 0;        // When inserted last went up
+
+static void *
+watch_task (void *arg)
+{
+   arg = arg;
+   size_t done = 0;
+   while (running)
+   {
+      metrics_t m = metrics ();
+      uint64_t now = now_us ();
+      if (m.ok)
+      {
+         size_t stored = m.inserted - base.inserted;
+         size_t have = __atomic_load_n (&sentcount, __ATOMIC_ACQUIRE);
+         if (stored > have)
+            stored = have;      // Other sources, or replays
+         pthread_mutex_lock (&watch_mutex);
+         if (stored > done)
+            lastinsert = now;
+         last = m;
+         pthread_mutex_unlock (&watch_mutex);
+         while (done < stored)
+            us[uscount++] = now - sent[done++];
+      }
+      usleep (poll * 1000);
+   }
+   return NULL;
+}
+
+static int
+cmp_u32 (const void *a, const void *b)
+{
+   uint32_t x = *(const uint32_t *) a,
+      y = *(const uint32_t *) b;
+   return x < y ? -1 : x > y;
+}
+
+static double
+pct (double p)
+{                               // Percentile in ms, us sorted
+   if (!uscount)
+      return 0;
+   size_t i = (size_t) (p * (uscount - 1) + 0.5);
+   return us[i] / 1000.0;
+}
+
+int
+main (int argc, const char *argv[])
+{
+   const char *pids = NULL;
+   int json = 0;
+   double maxp99 = 0,
+      minrate = 0;
+   int maxlost = -1;
+   poptContext optCon;
+   {
+      const struct poptOption optionsTable[] = {
+         {"mqtt-hostname", 'h', POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &mqtthost, 0, "MQTT hostname", "host"},
+         {"mqtt-port", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &mqttport, 0, "MQTT port", "port"},
+         {"mqtt-prefix", 'a', POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &prefix, 0, "MQTT prefix", "prefix"},
+         {"metrics-hostname", 0, POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &metricshost, 0, "faikinlog /metrics host", "host"},
+         {"metrics-port", 0, POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &metricsport, 0, "faikinlog --metrics-port", "port"},
+         {"tags", 'n', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &tags, 0, "Units", "N"},
+         {"tag-prefix", 0, POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &tagprefix, 0, "Unit tag prefix", "text"},
+         {"rate", 'r', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &rate, 0, "Messages per second, all units", "N"},
+         {"seconds", 's', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &seconds, 0, "Time sending", "seconds"},
+         {"drain", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &drain, 0, "Max wait for faikinlog to catch up", "seconds"},
+         {"poll", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &poll, 0, "Poll /metrics, latency resolution", "ms"},
+         {"pid", 0, POPT_ARG_STRING, &pids, 0, "Also count CPU of these processes", "pid,pid..."},
+         {"json", 'j', POPT_ARG_NONE, &json, 0, "JSON report"},
+         {"max-p99", 0, POPT_ARG_DOUBLE, &maxp99, 0, "Fail if p99 latency is over this", "ms"},
+         {"min-rate", 0, POPT_ARG_DOUBLE, &minrate, 0, "Fail if stored messages/s is under this", "N"},
+         {"max-lost", 0, POPT_ARG_INT, &maxlost, 0, "Fail if more messages than this are not stored", "N"},
+         POPT_AUTOHELP {}
+      };
+
+      optCon = poptGetContext (NULL, argc, argv, optionsTable, 0);
+
+      int c;
+      if ((c = poptGetNextOpt (optCon)) < -1)
+         errx (1, "%s: %s\n", poptBadOption (optCon, POPT_BADOPTION_NOALIAS), poptStrerror (c));
+
+      if (poptPeekArg (optCon) || seconds <= 0 || rate <= 0 || tags <= 0)
+      {
+         poptPrintUsage (optCon, stderr, 0);
+         return -1;
+      }
+      if (poll < 1)
+         poll = 1;
+   }
+   sentmax = (size_t) rate *seconds + 1;
+   sent = malloc (sentmax * sizeof (*sent));
+   us = malloc (sentmax * sizeof (*us));
+   if (!sent || !us)
+      errx (1, "Cannot allocate for %zu messages", sentmax);
+
+   base = metrics ();
+   if (!base.ok)
+      errx (1, "No faikinlog /metrics on %s:%s (run faikinlog with --metrics-port=%s)", metricshost, metricsport, metricsport);
+   double basepid = (pids ? pidcpu (pids) : 0);
+
+   mosquitto_lib_init ();
+   struct mosquitto *mqtt = mosquitto_new (NULL, 1, NULL);
+   if (!mqtt)
+      errx (1, "MQTT new failed");
+   int e = mosquitto_connect (mqtt, mqtthost, mqttport, 60);
+   if (e)
+      errx (1, "MQTT connect failed (%s) %s", mqtthost, mosquitto_strerror (e));
+   e = mosquitto_loop_start (mqtt);
+   if (e)
+      errx (1, "MQTT loop failed %s", mosquitto_strerror (e));
+
+   pthread_t watch;
+   pthread_create (&watch, NULL, watch_task, NULL);
+
+   // Send, paced by the ms
+   time_t ts0 = time (0);
+   uint64_t begin = now_us ();
+   char topic[200],
+     pl[4096];
+   size_t plbytes = 0;
+   while (sentcount < sentmax - 1)
+   {
+      uint64_t now = now_us ();
+      size_t due = (now - begin) * rate / 1000000ULL;
+      if (due > sentmax - 1)
+         due = sentmax - 1;
+      if (sentcount >= due)
+      {
+         usleep (1000);
+         continue;
+      }
+      while (sentcount < due)
+      {
+         int tag = sentcount % tags;
+         uint64_t n = sentcount;
+         snprintf (topic, sizeof (topic), "%s/%s%04d", prefix, tagprefix, tag);
+         int l = payload (pl, sizeof (pl), tag, tags, n, ts0 + n / tags);     // One report per tag per "second" of ts
+         plbytes += l;
+         sent[sentcount] = now_us ();
+         e = mosquitto_publish (mqtt, NULL, topic, l, pl, 0, 0);
+         if (e)
+            errx (1, "MQTT publish failed %s", mosquitto_strerror (e));
+         __atomic_store_n (&sentcount, sentcount + 1, __ATOMIC_RELEASE);
+      }
+   }
+   double sending = (now_us () - begin) / 1000000.0;
+
+   // Wait for faikinlog to catch up, or stop storing
+   uint64_t wait = now_us ();
+   while (now_us () - wait < drain * 1000000ULL)
+   {
+      usleep (poll * 1000);
+      pthread_mutex_lock (&watch_mutex);
+      int done = (last.inserted - base.inserted + last.dropped - base.dropped >= sentcount);
+      int idle = (lastinsert && now_us () - lastinsert > 5000000ULL && now_us () - wait > 5000000ULL);     // Nothing for 5s
+      pthread_mutex_unlock (&watch_mutex);
+      if (done || idle)
+         break;
+   }
+   running = 0;
+   pthread_join (watch, NULL);
+   metrics_t after = metrics ();
+   if (!after.ok)
+      after = last;
+   double pidcpuused = (pids ? pidcpu (pids) - basepid : 0);
+   mosquitto_disconnect (mqtt);
+   mosquitto_loop_stop (mqtt, false);
+   mosquitto_destroy (mqtt);
+   mosquitto_lib_cleanup ();
+
+   qsort (us, uscount, sizeof (*us), cmp_u32);
+   double elapsed = (lastinsert > begin ? lastinsert - begin : 1) / 1000000.0;  // First sent to last stored
+   double received = after.received - base.received,
+      stored = after.inserted - base.inserted,
+      dropped = after.dropped - base.dropped,
+      spooled = after.spooled - base.spooled,
+      cpu = after.cpu - base.cpu;
+   double lost = sentcount - stored;
+   if (lost < 0)
+      lost = 0;
+   double storerate = stored / elapsed;
+   int failed = 0;
+   if (maxp99 > 0 && pct (0.99) > maxp99)
+      failed = 1;
+   if (minrate > 0 && storerate < minrate)
+      failed = 1;
+   if (maxlost >= 0 && lost > maxlost)
+      failed = 1;
+
+   if (json)
+   {
+      printf ("{\"sent\":%zu,\"sendrate\":%.1f,\"bytes\":%.0f,\"received\":%.0f,\"stored\":%.0f,\"storerate\":%.1f,"
+              "\"dropped\":%.0f,\"spooled\":%.0f,\"lost\":%.0f,\"p50\":%.2f,\"p90\":%.2f,\"p99\":%.2f,\"max\":%.2f,"
+              "\"cpuus\":%.1f", sentcount, sentcount / sending, sentcount ? (double) plbytes / sentcount : 0, received,
+              stored, storerate, dropped, spooled, lost, pct (0.5), pct (0.9), pct (0.99), pct (1),
+              stored ? cpu * 1000000 / stored : 0);
+      if (pids)
+         printf (",\"pidcpuus\":%.1f", stored ? pidcpuused * 1000000 / stored : 0);
+      printf (",\"pass\":%s}\n", failed ? "false" : "true");
+   } else
+   {
+      printf ("Sent      %8zu in %.1fs, %.1f msgs/s, %.0f bytes/msg, %d tags\n", sentcount, sending, sentcount / sending,
+              sentcount ? (double) plbytes / sentcount : 0, tags);
+      printf ("Received  %8.0f\n", received);
+      printf ("Stored    %8.0f in %.1fs, %.1f msgs/s sustained\n", stored, elapsed, storerate);
+      printf ("Dropped   %8.0f, spooled %.0f, not stored %.0f\n", dropped, spooled, lost);
+      printf ("Latency   p50 %.2fms p90 %.2fms p99 %.2fms max %.2fms (%dms polls)\n", pct (0.5), pct (0.9), pct (0.99), pct (1),
+              poll);
+      printf ("CPU       %.1fus/msg faikinlog", stored ? cpu * 1000000 / stored : 0);
+      if (pids)
+         printf (", %.1fus/msg --pid", stored ? pidcpuused * 1000000 / stored : 0);
+      printf ("\n");
+      if (failed)
+         printf ("FAIL\n");
+   }
+   free (sent);
+   free (us);
+   poptFreeContext (optCon);
+   return failed;
+}
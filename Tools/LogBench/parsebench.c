@@ -0,0 +1,239 @@
+// Faikin report decode microbenchmark, faikinlog's old AJL tree decode against faikinjson.c
+// Copyright (c) 2019-2024 Adrian Kennard, Andrews & Arnold Limited, see LICENSE file (GPL)
+// Both turn the same payloads (payload.c) in to the INSERT columns and values faikinlog queues, and are first checked
+// to give the same SQL. Then each is run for --seconds over the payloads, giving ns and bytes/s per message. --decode
+// also decodes values for the store and metrics, as faikinlog does with --store or --metrics-port.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <popt.h>
+#include <err.h>
+#include <time.h>
+#include <math.h>
+#include <sqllib.h>
+#include <ajl.h>
+#include "payload.h"
+#include "faikinjson.h"
+
+int messages = 1000;            // Different payloads
+int tags = 100;
+double seconds = 2;
+int decode = 0;
+
+static uint64_t
+now_ns (void)
+{
+   struct timespec t;
+   clock_gettime (CLOCK_MONOTONIC, &t);
+   return (uint64_t) t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static void
+tree (const char *tag, const char *json, size_t len, char **colsp, char **valsp, double *val)
+{                               // As faikinlog did, AJL tree, j_find per field
+   j_t data = j_create ();
+   const char *e = j_read_mem (data, json, len);
+   if (e)
+      errx (1, "Bad JSON %s [%.*s]", e, (int) len, json);
+   time_t utc = time (0);
+   const char *ts = j_get (data, "ts");
+   if (ts && j_istrue (j_find (data, "backfill")))
+   {
+      struct tm tm = { 0 };
+      const char *end = strptime (ts, "%Y-%m-%dT%H:%M:%SZ", &tm);
+      if (end && !*end)
+         utc = timegm (&tm);
+   }
+   size_t colslen,
+     valslen;
+   FILE *cf = open_memstream (colsp, &colslen);
+   FILE *vf = open_memstream (valsp, &valslen);
+   char *v = sql_printf ("(%#s,%#U", tag, utc);
+   fprintf (cf, "`tag`,`utc`");
+   fprintf (vf, "%s", v);
+   free (v);
+   void setval (const char *prefix, const char *name, double value)
+   {
+      char field[100];
+      int c = fks_colindex (field, snprintf (field, sizeof (field), "%s%s", prefix, name));
+      if (c >= 0)
+         val[c] = value;
+   }
+   void add (const char *prefix, const char *name, const char *value)
+   {
+      if (decode)
+         setval (prefix, name, strcmp (value, "NULL") ? strtod (value, NULL) : NAN);
+      fprintf (cf, ",`%s%s`", prefix, name);
+      fprintf (vf, ",%s", value);
+   }
+   void addenum (const char *name, const char *value)
+   {
+      if (decode && *value)
+         setval ("", name, *value);
+      v = sql_printf ("%#s", value);
+      fprintf (cf, ",`%s`", name);
+      fprintf (vf, ",%s", v);
+      free (v);
+   }
+   void range (const char *name, j_t j, int n)
+   {
+      if (j_isarray (j) && j_len (j) == n && j_isnumber (j_index (j, 0)) && j_isnumber (j_index (j, 1))
+          && (n == 2 || j_isnumber (j_index (j, 2))))
+      {
+         add ("min", name, j_val (j_index (j, 0)));
+         if (n == 3)
+            add ("", name, j_val (j_index (j, 1)));
+         add ("max", name, j_val (j_index (j, n - 1)));
+      } else if (j_isnumber (j))
+      {
+         add ("min", name, j_val (j));
+         if (n == 3)
+            add ("", name, j_val (j));
+         add ("max", name, j_val (j));
+      }
+   }
+   j_t j;
+#define	b(name)	if((j=j_find(data,#name)))add("",#name,j_istrue(j)?"1":j_isbool(j)?"0":j_isnumber(j)?j_val(j):"NULL");
+#define	i(name)	if((j=j_find(data,#name)))range(#name,j,3);
+#define	t(name)	if((j=j_find(data,#name)))range(#name,j,3);
+#define	r(name)	if((j=j_find(data,#name)))range(#name,j,2);
+#define e(name,t) if((j=j_find(data,#name))&&j_isstring(j))addenum(#name,j_val(j));
+#include "acextras.m"
+   fprintf (vf, ")");
+   fclose (cf);
+   fclose (vf);
+   j_delete (&data);
+}
+
+static void
+stream (const char *tag, const char *json, size_t len, char **colsp, char **valsp, double *val)
+{                               // As faikinlog does now
+   static fkj_buf_t cols,
+     vals;
+   fkj_t j;
+   const char *e = fkj_parse (&j, json, len);
+   if (e)
+      errx (1, "Bad JSON %s [%.*s]", e, (int) len, json);
+   time_t utc = (j.backfill && j.ts ? j.ts : time (0));
+   if (decode)
+      for (int c = 0; c < COLS; c++)
+         val[c] = fkj_val (&j, c);
+   fkj_sql (&j, tag, utc, &cols, &vals);
+   *colsp = strndup (cols.buf, cols.len);
+   *valsp = strndup (vals.buf, vals.len);
+}
+
+int
+main (int argc, const char *argv[])
+{
+   poptContext optCon;
+   {
+      const struct poptOption optionsTable[] = {
+         {"messages", 'm', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &messages, 0, "Different payloads", "N"},
+         {"tags", 'n', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &tags, 0, "Units", "N"},
+         {"seconds", 's', POPT_ARG_DOUBLE | POPT_ARGFLAG_SHOW_DEFAULT, &seconds, 0, "Time for each", "seconds"},
+         {"decode", 'd', POPT_ARG_NONE, &decode, 0, "Also decode values, as --store or --metrics-port"},
+         POPT_AUTOHELP {}
+      };
+
+      optCon = poptGetContext (NULL, argc, argv, optionsTable, 0);
+
+      int c;
+      if ((c = poptGetNextOpt (optCon)) < -1)
+         errx (1, "%s: %s\n", poptBadOption (optCon, POPT_BADOPTION_NOALIAS), poptStrerror (c));
+
+      if (poptPeekArg (optCon) || messages <= 0 || tags <= 0 || seconds <= 0)
+      {
+         poptPrintUsage (optCon, stderr, 0);
+         return -1;
+      }
+   }
+
+   char **pl = malloc (messages * sizeof (*pl));
+   size_t *pllen = malloc (messages * sizeof (*pllen));
+   char (*tag)[20] = malloc (messages * sizeof (*tag));
+   size_t bytes = 0;
+   time_t ts0 = time (0);
+   for (int n = 0; n < messages; n++)
+   {
+      char buf[4096];
+      int l = payload (buf, sizeof (buf), n % tags, tags, n, ts0 + n / tags);
+      pl[n] = malloc (l);       // Not terminated, as MQTT payloads are not
+      memcpy (pl[n], buf, l);
+      pllen[n] = l;
+      bytes += l;
+      snprintf (tag[n], sizeof (*tag), "bench%04d", n % tags);
+   }
+
+   int failed = 0;
+   for (int n = 0; n < messages && !failed; n++)
+   {                            // Same SQL and values
+      char *tc,
+      *tv,
+      *sc,
+      *sv;
+      double tval[COLS],
+        sval[COLS];
+      for (int c = 0; c < COLS; c++)
+         tval[c] = sval[c] = NAN;
+      tree (tag[n], pl[n], pllen[n], &tc, &tv, tval);
+      stream (tag[n], pl[n], pllen[n], &sc, &sv, sval);
+      if (strcmp (tc, sc) || strcmp (tv, sv))
+      {
+         warnx ("Different SQL for [%.*s]\nTree   %s\n       %s\nStream %s\n       %s", (int) pllen[n], pl[n], tc, tv, sc, sv);
+         failed = 1;
+      }
+      for (int c = 0; c < COLS && !failed; c++)
+         if (!(isnan (tval[c]) && isnan (sval[c])) && tval[c] != sval[c])
+         {
+            warnx ("Different %s for [%.*s] %g/%g", fks_cols[c].name, (int) pllen[n], pl[n], tval[c], sval[c]);
+            failed = 1;
+         }
+      free (tc);
+      free (tv);
+      free (sc);
+      free (sv);
+   }
+
+   double run (void (*f) (const char *, const char *, size_t, char **, char **, double *))
+   {                            // ns per message
+      double val[COLS];
+      uint64_t count = 0,
+         start = now_ns (),
+         end = start + seconds * 1000000000ULL,
+         now;
+      do
+      {
+         for (int n = 0; n < messages; n++)
+         {
+            char *cols,
+             *vals;
+            f (tag[n], pl[n], pllen[n], &cols, &vals, val);
+            free (cols);
+            free (vals);
+         }
+         count += messages;
+      }
+      while ((now = now_ns ()) < end);
+      return (double) (now - start) / count;
+   }
+   if (!failed)
+   {
+      double t = run (tree),
+         s = run (stream);
+      double avg = (double) bytes / messages;
+      printf ("Payloads  %d, %.0f bytes/msg, %d tags%s\n", messages, avg, tags, decode ? ", with decode" : "");
+      printf ("Tree      %8.0f ns/msg %7.1f MB/s\n", t, avg * 1000 / t);
+      printf ("Stream    %8.0f ns/msg %7.1f MB/s\n", s, avg * 1000 / s);
+      printf ("Speedup   %8.2fx\n", t / s);
+   }
+
+   for (int n = 0; n < messages; n++)
+      free (pl[n]);
+   free (pl);
+   free (pllen);
+   free (tag);
+   poptFreeContext (optCon);
+   return failed;
+}
@@ -0,0 +1,71 @@
+// Faikin report payloads for the benchmarks, see payload.h
+// Copyright (c) 2019-2024 Adrian Kennard, Andrews & Arnold Limited, see LICENSE file (GPL)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include "payload.h"
+
+static const struct
+{                               // Typical values, so payloads look like a real unit's
+   const char *name;
+   double value;
+   double swing;                // Drift either way
+} typical[] = {
+   {"home", 21, 1.5},
+   {"env", 21, 1.5},
+   {"target", 21, 0},
+   {"temp", 21, 0},
+   {"outside", 9, 4},
+   {"inlet", 23, 2},
+   {"liquid", 35, 8},
+   {"fanrpm", 1000, 300},
+   {"comp", 45, 20},
+   {"demand", 100, 0},
+   {"anglev", 40, 20},
+};
+
+static double
+value (const char *name, double drift, double def)
+{                               // Typical value for a field, drifting
+   for (unsigned int i = 0; i < sizeof (typical) / sizeof (*typical); i++)
+      if (!strcmp (typical[i].name, name))
+         return typical[i].value + drift * typical[i].swing;
+   return def + drift;
+}
+
+int
+payload (char *buf, size_t size, int tag, int tags, uint64_t n, time_t ts)
+{                               // A Faikin report, values drifting per tag, returns length
+   size_t len = 0;
+   unsigned int seed = tag * 7919 + n;
+   void add (const char *fmt, ...)
+   {
+      va_list ap;
+      va_start (ap, fmt);
+      if (len < size)
+         len += vsnprintf (buf + len, size - len, fmt, ap);
+      va_end (ap);
+   }
+   int rnd (int m)
+   {                            // Random 0 to m-1
+      return rand_r (&seed) % m;
+   }
+   struct tm tm;
+   gmtime_r (&ts, &tm);
+   add ("{\"ts\":\"%04d-%02d-%02dT%02d:%02d:%02dZ\",\"backfill\":true", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+        tm.tm_min, tm.tm_sec);      // As backfill, so faikinlog uses ts
+   int f = 0;                   // Field number, for different values per field
+   double drift = sin ((n / tags + tag * 13) / 60.0);
+#define	b(name)	f++;if(rnd(3))add(",\""#name"\":%s",(tag+f)%2?"true":"false");else add(",\""#name"\":%.2f",rnd(100)/100.0);
+#define	t(name)	{f++;double v=value(#name,drift,20);if(rnd(3))add(",\""#name"\":%.2f",v);else add(",\""#name"\":[%.2f,%.2f,%.2f]",v-rnd(50)/100.0,v,v+rnd(50)/100.0);}
+#define	r(name)	{f++;double v=value(#name,drift,20)+tag%4-2;if(rnd(3))add(",\""#name"\":%.2f",v);else add(",\""#name"\":[%.2f,%.2f]",v-0.5,v+1.5);}
+#define	i(name)	{f++;int v=strcmp(#name,"Wh")?lround(value(#name,drift,100)):10000+n/tags*5;if(rnd(3))add(",\""#name"\":%d",v);else add(",\""#name"\":[%d,%d,%d]",v-rnd(20),v,v+rnd(20));}
+#define	e(name,values)	f++;add(",\""#name"\":\"%c\"",#values[(tag+n/tags/100)%(sizeof(#values)-1)]);
+#define	s(name,len)	f++;add(",\""#name"\":\"BENCH%d\"",tag%10);
+#include "acextras.m"
+   add ("}");
+   return len < size ? len : size - 1;
+}
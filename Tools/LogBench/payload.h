@@ -0,0 +1,9 @@
+// Faikin report payloads for the benchmarks
+// Copyright (c) 2019-2024 Adrian Kennard, Andrews & Arnold Limited, see LICENSE file (GPL)
+// Built from acextras.m as Faikin.c sends them (scalars, min/avg/max arrays, fractional booleans), values drifting
+// per tag and message, with the ts given.
+
+#include <stdint.h>
+#include <time.h>
+
+int payload (char *buf, size_t size, int tag, int tags, uint64_t n, time_t ts);        // Returns length
@@ -0,0 +1,88 @@
+// Faikin web interface built for the host, with a simulated aircon, for benchmarking the web handlers (see README.md)
+// Copyright (c) 2019-2024 Adrian Kennard, Andrews & Arnold Limited, see LICENSE file (GPL)
+// This is the real Faikin.c in its mock mode (no tx/rx GPIO), with ESP-IDF and ESP32-RevK replaced by shims in host/
+
+#include <popt.h>
+#include <signal.h>
+#include <err.h>
+#include <pthread.h>
+#include "Faikin.c"
+
+extern int host_port;           // host/httpd.c
+
+static void *
+aircon_task (void *arg)
+{                               // Simulated aircon, acknowledges controls and drifts the temperatures, once a second
+   while (!daikin.mutex)
+      usleep (10000);
+   float inlet = 21,
+      outside = 12;
+   int Wh = 0;
+   while (1)
+   {
+      usleep (1000000LL - (esp_timer_get_time () + 500000LL) % 1000000LL);     // Half way between main loop polls
+      uint64_t changed = daikin.control_changed;
+#define	b(name)		if(changed&CONTROL_##name)report_uint8(name,daikin.name);
+#define	e(name,values)	if(changed&CONTROL_##name)report_uint8(name,daikin.name);
+#define	t(name)		if(changed&CONTROL_##name)report_float(name,daikin.name);
+#define	i(name)		if(changed&CONTROL_##name)report_int(name,daikin.name);
+#include "accontrols.m"
+      uint32_t now = uptime ();
+      outside = 12 + 5 * sinf (now * 2 * M_PI / 3600);
+      float target = daikin.power ? daikin.temp : outside;
+      inlet += (target - inlet) / (daikin.power ? 60 : 600) + (random () % 21 - 10) / 100.0;       // Sensor noise
+      int comp = daikin.power ? fminf (fabsf (target - inlet) * 40, 100) : 0;
+      Wh += comp / 10;
+      report_float (inlet, inlet);
+      report_float (home, inlet - 0.5);
+      report_float (outside, outside);
+      report_float (liquid, daikin.power ? inlet + (daikin.heat ? 15 : -10) : inlet);
+      report_int (fanrpm, daikin.power ? 600 + 100 * daikin.fan : 0);
+      report_int (comp, comp);
+      report_int (Wh, Wh);
+   }
+   return NULL;
+}
+
+int
+main (int argc, const char *argv[])
+{
+   int port = 8080;
+   int history = 0,
+      f = 0;
+   poptContext optCon;
+   {
+      const struct poptOption optionsTable[] = {
+         {"port", 'p', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &port, 0, "Port to listen on", "N"},
+         {"history", 0, POPT_ARG_NONE, &history, 0, "Enable on-device history"},
+         {"fahrenheit", 0, POPT_ARG_NONE, &f, 0, "Web shows Fahrenheit"},
+         POPT_AUTOHELP {}
+      };
+
+      optCon = poptGetContext (NULL, argc, argv, optionsTable, 0);
+
+      int c;
+      if ((c = poptGetNextOpt (optCon)) < -1)
+         errx (1, "%s: %s\n", poptBadOption (optCon, POPT_BADOPTION_NOALIAS), poptStrerror (c));
+
+      if (poptPeekArg (optCon))
+      {
+         poptPrintUsage (optCon, stderr, 0);
+         return -1;
+      }
+   }
+   if (!getenv ("GLIBC_TUNABLES"))
+   {                            // One heap and no per thread caches, so the heap figures in /metrics mean something
+      setenv ("GLIBC_TUNABLES", "glibc.malloc.arena_max=1:glibc.malloc.tcache_count=0", 1);
+      execvp (argv[0], (char *const *) argv);
+   }
+   historyenable = history;
+   fahrenheit = f;
+   signal (SIGPIPE, SIG_IGN);
+   host_port = port;
+   pthread_t t;
+   pthread_create (&t, NULL, aircon_task, NULL);
+   app_main ();
+   poptFreeContext (optCon);
+   return 0;
+}
@@ -0,0 +1,19 @@
+// GPIO shim for the host build, there are no pins
+#pragma once
+#include <stdint.h>
+
+typedef int gpio_num_t;
+typedef struct
+{
+   uint64_t pin_bit_mask;
+   int mode;
+   int pull_up_en;
+   int pull_down_en;
+   int intr_type;
+} gpio_config_t;
+
+#define	GPIO_MODE_DISABLE	0
+
+int gpio_config (const gpio_config_t *);
+int gpio_reset_pin (gpio_num_t);
+int gpio_pullup_en (gpio_num_t);
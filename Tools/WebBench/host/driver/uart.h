@@ -0,0 +1,41 @@
+// UART shim for the host build, there is no UART so Faikin runs in mock mode
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+typedef int uart_port_t;
+typedef struct
+{
+   int baud_rate;
+   int data_bits;
+   int parity;
+   int stop_bits;
+   int flow_ctrl;
+   int source_clk;
+} uart_config_t;
+
+enum
+{
+   UART_DATA_8_BITS,
+   UART_PARITY_DISABLE,
+   UART_PARITY_EVEN,
+   UART_STOP_BITS_1,
+   UART_STOP_BITS_2,
+   UART_HW_FLOWCTRL_DISABLE,
+   UART_SCLK_DEFAULT,
+   UART_SCLK_APB,
+};
+#define	UART_SIGNAL_INV_DISABLE	0
+#define	UART_SIGNAL_RXD_INV	1
+#define	UART_SIGNAL_TXD_INV	2
+#define	UART_PIN_NO_CHANGE	(-1)
+
+int uart_param_config (uart_port_t, const uart_config_t *);
+int uart_set_pin (uart_port_t, int, int, int, int);
+int uart_set_line_inverse (uart_port_t, uint32_t);
+int uart_driver_install (uart_port_t, int, int, int, void *, int);
+int uart_driver_delete (uart_port_t);
+int uart_set_rx_full_threshold (uart_port_t, int);
+int uart_flush (uart_port_t);
+int uart_write_bytes (uart_port_t, const void *, size_t);
+int uart_read_bytes (uart_port_t, void *, uint32_t, uint32_t);
@@ -0,0 +1,132 @@
+// esp_http_server shim for the host build, the subset Faikin uses, on POSIX sockets (httpd.c)
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+typedef int esp_err_t;
+typedef void *httpd_handle_t;
+typedef void (*httpd_work_fn_t) (void *arg);
+typedef void (*httpd_close_func_t) (httpd_handle_t hd, int sockfd);
+
+typedef enum
+{
+   HTTP_DELETE = 0,
+   HTTP_GET = 1,
+   HTTP_HEAD = 2,
+   HTTP_POST = 3,
+   HTTP_PUT = 4,
+} httpd_method_t;
+
+typedef enum
+{
+   HTTPD_400_BAD_REQUEST = 400,
+   HTTPD_404_NOT_FOUND = 404,
+   HTTPD_405_METHOD_NOT_ALLOWED = 405,
+   HTTPD_500_INTERNAL_SERVER_ERROR = 500,
+} httpd_err_code_t;
+
+#define	HTTPD_MAX_URI_LEN	512
+typedef struct httpd_req
+{
+   httpd_handle_t handle;
+   int method;                  // HTTP_GET, etc, 0 for web socket frames
+   const char uri[HTTPD_MAX_URI_LEN + 1];
+   size_t content_len;
+   void *aux;                   // Server private
+   void *user_ctx;
+   void *sess_ctx;
+} httpd_req_t;
+
+typedef struct
+{
+   const char *uri;
+   httpd_method_t method;
+   esp_err_t (*handler) (httpd_req_t * r);
+   void *user_ctx;
+   bool is_websocket;
+   bool handle_ws_control_frames;
+   const char *supported_subprotocol;
+} httpd_uri_t;
+
+typedef struct
+{
+   unsigned task_priority;
+   size_t stack_size;
+   uint16_t server_port;
+   uint16_t max_open_sockets;
+   uint16_t max_uri_handlers;
+   uint16_t max_resp_headers;
+   uint16_t backlog_conn;
+   bool lru_purge_enable;
+   uint16_t recv_wait_timeout;
+   uint16_t send_wait_timeout;
+   httpd_close_func_t close_fn;
+} httpd_config_t;
+
+#define HTTPD_DEFAULT_CONFIG() {	\
+   .task_priority = 5,			\
+   .stack_size = 4096,			\
+   .server_port = 80,			\
+   .max_open_sockets = 7,		\
+   .max_uri_handlers = 8,		\
+   .max_resp_headers = 8,		\
+   .backlog_conn = 5,			\
+   .lru_purge_enable = false,		\
+   .recv_wait_timeout = 5,		\
+   .send_wait_timeout = 5,		\
+   .close_fn = NULL,			\
+}
+
+typedef enum
+{
+   HTTPD_WS_TYPE_CONTINUE = 0x0,
+   HTTPD_WS_TYPE_TEXT = 0x1,
+   HTTPD_WS_TYPE_BINARY = 0x2,
+   HTTPD_WS_TYPE_CLOSE = 0x8,
+   HTTPD_WS_TYPE_PING = 0x9,
+   HTTPD_WS_TYPE_PONG = 0xA,
+} httpd_ws_type_t;
+
+typedef struct
+{
+   bool final;
+   bool fragmented;
+   httpd_ws_type_t type;
+   uint8_t *payload;
+   size_t len;
+} httpd_ws_frame_t;
+
+typedef enum
+{
+   HTTPD_WS_CLIENT_INVALID = 0x0,
+   HTTPD_WS_CLIENT_HTTP = 0x1,
+   HTTPD_WS_CLIENT_WEBSOCKET = 0x2,
+} httpd_ws_client_info_t;
+
+#define	HTTPD_RESP_USE_STRLEN	-1
+#define	CONFIG_HTTPD_WS_SUPPORT	1
+
+esp_err_t httpd_start (httpd_handle_t * handle, const httpd_config_t * config);
+esp_err_t httpd_register_uri_handler (httpd_handle_t handle, const httpd_uri_t * uri_handler);
+esp_err_t httpd_queue_work (httpd_handle_t handle, httpd_work_fn_t work, void *arg);
+esp_err_t httpd_sess_trigger_close (httpd_handle_t handle, int sockfd);
+int httpd_req_to_sockfd (httpd_req_t * r);
+int httpd_req_recv (httpd_req_t * r, char *buf, size_t buf_len);
+size_t httpd_req_get_hdr_value_len (httpd_req_t * r, const char *field);
+esp_err_t httpd_req_get_hdr_value_str (httpd_req_t * r, const char *field, char *val, size_t val_size);
+esp_err_t httpd_resp_set_status (httpd_req_t * r, const char *status);
+esp_err_t httpd_resp_set_type (httpd_req_t * r, const char *type);
+esp_err_t httpd_resp_set_hdr (httpd_req_t * r, const char *field, const char *value);
+esp_err_t httpd_resp_send (httpd_req_t * r, const char *buf, ssize_t buf_len);
+esp_err_t httpd_resp_sendstr (httpd_req_t * r, const char *str);
+esp_err_t httpd_resp_send_chunk (httpd_req_t * r, const char *buf, ssize_t buf_len);
+esp_err_t httpd_resp_sendstr_chunk (httpd_req_t * r, const char *str);
+esp_err_t httpd_resp_send_err (httpd_req_t * r, httpd_err_code_t error, const char *msg);
+int httpd_send (httpd_req_t * r, const char *buf, size_t buf_len);
+int httpd_socket_send (httpd_handle_t hd, int sockfd, const char *buf, size_t buf_len, int flags);
+esp_err_t httpd_ws_recv_frame (httpd_req_t * req, httpd_ws_frame_t * pkt, size_t max_len);
+esp_err_t httpd_ws_send_frame_async (httpd_handle_t hd, int fd, httpd_ws_frame_t * frame);
+httpd_ws_client_info_t httpd_ws_get_fd_info (httpd_handle_t hd, int fd);
@@ -0,0 +1,5 @@
+// esp_random shim for the host build
+#pragma once
+#include <stdint.h>
+
+uint32_t esp_random (void);
@@ -0,0 +1,2 @@
+// esp_sleep shim for the host build, nothing needed
+#pragma once
@@ -0,0 +1,2 @@
+// esp_task_wdt shim for the host build, nothing needed
+#pragma once
@@ -0,0 +1,22 @@
+// FreeRTOS shim for the host build, mutexes are pthread mutexes
+#pragma once
+#include <stdint.h>
+
+typedef void *SemaphoreHandle_t;
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef void *TaskHandle_t;
+
+#define	portMAX_DELAY		0xFFFFFFFF
+#define	portTICK_PERIOD_MS	1
+#define	pdTRUE			1
+#define	pdFALSE			0
+#define	pdPASS			1
+#define	pdMS_TO_TICKS(ms)	(ms)
+
+SemaphoreHandle_t xSemaphoreCreateMutex (void);
+BaseType_t xSemaphoreTake (SemaphoreHandle_t, TickType_t);
+BaseType_t xSemaphoreGive (SemaphoreHandle_t);
+UBaseType_t uxTaskGetStackHighWaterMark (TaskHandle_t);
+void vTaskDelay (TickType_t);
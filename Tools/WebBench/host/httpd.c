@@ -0,0 +1,878 @@
+// esp_http_server shim for the host build, the subset Faikin uses, on POSIX sockets
+// Copyright (c) 2019-2024 Adrian Kennard, Andrews & Arnold Limited, see LICENSE file (GPL)
+// Like ESP-IDF, one thread runs the handlers and queued work for all sockets, sockets beyond max_open_sockets are
+// refused, a failed handler closes its socket, and close_fn (if set) is responsible for closing the socket.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include "esp_http_server.h"
+
+#define	ESP_OK			0
+#define	ESP_FAIL		-1
+#define	ESP_ERR_NO_MEM		0x101
+#define	ESP_ERR_INVALID_ARG	0x102
+#define	ESP_ERR_NOT_FOUND	0x105
+#define	ESP_ERR_HTTPD_RESULT_TRUNC	0xB007
+
+#define	HEAD_MAX	8192    // Max request header size
+#define	FRAME_MAX	65536   // Max web socket frame we accept
+#define	IN_SIZE		(HEAD_MAX+FRAME_MAX+16) // Session receive buffer, mmap'd so not counted as heap in /metrics
+
+int host_port = 0;              // Overrides config server_port if set
+uint32_t esp_get_free_heap_size (void); // Sampled while sending, to track minimum (revk.c)
+
+typedef struct
+{                               // Session (socket)
+   int fd;                      // -1 if not in use
+   uint8_t ws:1;                // Web socket
+   uint8_t close:1;             // Close requested
+   const httpd_uri_t *wsuri;    // Web socket handler
+   uint8_t *in;                 // Received, not yet processed
+   size_t inlen;
+   size_t discard;              // Body bytes not read by handler, to skip
+} sess_t;
+
+typedef struct work_s work_t;
+struct work_s
+{
+   httpd_work_fn_t fn;
+   void *arg;
+   work_t *next;
+};
+
+typedef struct
+{                               // Server
+   httpd_config_t config;
+   httpd_uri_t *uri;
+   int uris;
+   sess_t *sess;
+   int listen;
+   int wake[2];                 // Wake server thread for queued work and close requests
+   pthread_mutex_t mutex;       // For work and close requests
+   work_t *work,
+    *worklast;
+   pthread_t thread;
+} server_t;
+
+typedef struct
+{                               // Request private data
+   server_t *s;
+   sess_t *sess;
+   const char *head;            // Request headers (after request line)
+   size_t bodyleft;             // Body not yet read
+   const char *status;
+   const char *type;
+   int hdrs;
+   struct
+   {
+      const char *field;
+      const char *value;
+   } hdr[16];
+   uint8_t sent:1;              // Response head sent
+   uint8_t closeafter:1;        // Close after this request
+   httpd_ws_frame_t frame;      // Web socket frame received
+} aux_t;
+
+static int
+sendall (int fd, const void *buf, size_t len, int flags)
+{                               // Send all of it, returns len or -1
+   size_t done = 0;
+   while (done < len)
+   {
+      ssize_t l = send (fd, (const char *) buf + done, len - done, flags | MSG_NOSIGNAL);
+      if (l <= 0)
+      {
+         if (l < 0 && errno == EINTR)
+            continue;
+         return (flags & MSG_DONTWAIT) && done ? (int) done : -1;
+      }
+      done += l;
+   }
+   return done;
+}
+
+static void
+wake (server_t * s)
+{
+   char c = 0;
+   if (write (s->wake[1], &c, 1) < 0)
+      return;                   // Pipe full means already woken
+}
+
+static sess_t *
+sess_find (server_t * s, int fd)
+{
+   for (int i = 0; i < s->config.max_open_sockets; i++)
+      if (s->sess[i].fd == fd)
+         return &s->sess[i];
+   return NULL;
+}
+
+static void
+sess_close (server_t * s, sess_t * sess)
+{
+   if (sess->fd < 0)
+      return;
+   int fd = sess->fd;
+   sess->fd = -1;
+   sess->inlen = sess->discard = 0;
+   sess->ws = sess->close = 0;
+   sess->wsuri = NULL;
+   if (s->config.close_fn)
+      s->config.close_fn (s, fd);
+   else
+      close (fd);
+}
+
+// SHA1 and base64, for the web socket handshake
+
+static void
+sha1 (const uint8_t * data, size_t len, uint8_t out[20])
+{
+   uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+   size_t total = ((len + 8) / 64 + 1) * 64;
+   uint8_t *m = calloc (1, total);
+   memcpy (m, data, len);
+   m[len] = 0x80;
+   uint64_t bits = (uint64_t) len * 8;
+   for (int i = 0; i < 8; i++)
+      m[total - 1 - i] = bits >> (i * 8);
+#define	rol(v,n)	(((v)<<(n))|((v)>>(32-(n))))
+   for (size_t o = 0; o < total; o += 64)
+   {
+      uint32_t w[80];
+      for (int i = 0; i < 16; i++)
+         w[i] = (m[o + i * 4] << 24) | (m[o + i * 4 + 1] << 16) | (m[o + i * 4 + 2] << 8) | m[o + i * 4 + 3];
+      for (int i = 16; i < 80; i++)
+         w[i] = rol (w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+      uint32_t a = h[0],
+         b = h[1],
+         c = h[2],
+         d = h[3],
+         e = h[4];
+      for (int i = 0; i < 80; i++)
+      {
+         uint32_t f,
+           k;
+         if (i < 20)
+         {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+         } else if (i < 40)
+         {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+         } else if (i < 60)
+         {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+         } else
+         {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+         }
+         uint32_t t = rol (a, 5) + f + e + k + w[i];
+         e = d;
+         d = c;
+         c = rol (b, 30);
+         b = a;
+         a = t;
+      }
+      h[0] += a;
+      h[1] += b;
+      h[2] += c;
+      h[3] += d;
+      h[4] += e;
+   }
+#undef rol
+   free (m);
+   for (int i = 0; i < 20; i++)
+      out[i] = h[i / 4] >> (24 - (i % 4) * 8);
+}
+
+static void
+base64 (const uint8_t * in, size_t len, char *out)
+{
+   const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+   size_t i;
+   for (i = 0; i + 2 < len; i += 3)
+   {
+      *out++ = b64[in[i] >> 2];
+      *out++ = b64[((in[i] & 3) << 4) | (in[i + 1] >> 4)];
+      *out++ = b64[((in[i + 1] & 15) << 2) | (in[i + 2] >> 6)];
+      *out++ = b64[in[i + 2] & 63];
+   }
+   if (i < len)
+   {
+      *out++ = b64[in[i] >> 2];
+      if (i + 1 < len)
+      {
+         *out++ = b64[((in[i] & 3) << 4) | (in[i + 1] >> 4)];
+         *out++ = b64[(in[i + 1] & 15) << 2];
+      } else
+      {
+         *out++ = b64[(in[i] & 3) << 4];
+         *out++ = '=';
+      }
+      *out++ = '=';
+   }
+   *out = 0;
+}
+
+// Requests
+
+static const char *
+hdr_find (const char *head, const char *field, size_t *lenp)
+{                               // Find header value in request headers
+   size_t fl = strlen (field);
+   for (const char *p = head; p && *p; p = strstr (p, "\r\n"), p = p ? p + 2 : NULL)
+      if (!strncasecmp (p, field, fl) && p[fl] == ':')
+      {
+         p += fl + 1;
+         while (*p == ' ' || *p == '\t')
+            p++;
+         const char *e = strstr (p, "\r\n");
+         if (!e)
+            e = p + strlen (p);
+         if (lenp)
+            *lenp = e - p;
+         return p;
+      }
+   return NULL;
+}
+
+static int
+send_head (httpd_req_t * r, ssize_t len)
+{                               // Send response head, len -1 for chunked
+   aux_t *a = r->aux;
+   if (a->sent)
+      return 0;
+   a->sent = 1;
+   esp_get_free_heap_size ();
+   char *head = NULL;
+   size_t hlen = 0;
+   FILE *f = open_memstream (&head, &hlen);
+   fprintf (f, "HTTP/1.1 %s\r\nContent-Type: %s\r\n", a->status ? : "200 OK", a->type ? : "text/html");
+   if (len < 0)
+      fprintf (f, "Transfer-Encoding: chunked\r\n");
+   else
+      fprintf (f, "Content-Length: %zd\r\n", len);
+   for (int i = 0; i < a->hdrs; i++)
+      fprintf (f, "%s: %s\r\n", a->hdr[i].field, a->hdr[i].value);
+   if (a->closeafter)
+      fprintf (f, "Connection: close\r\n");
+   fprintf (f, "\r\n");
+   fclose (f);
+   int e = sendall (a->sess->fd, head, hlen, 0);
+   free (head);
+   return e < 0 ? -1 : 0;
+}
+
+esp_err_t
+httpd_resp_set_status (httpd_req_t * r, const char *status)
+{
+   ((aux_t *) r->aux)->status = status;
+   return ESP_OK;
+}
+
+esp_err_t
+httpd_resp_set_type (httpd_req_t * r, const char *type)
+{
+   ((aux_t *) r->aux)->type = type;
+   return ESP_OK;
+}
+
+esp_err_t
+httpd_resp_set_hdr (httpd_req_t * r, const char *field, const char *value)
+{
+   aux_t *a = r->aux;
+   if (a->hdrs >= a->s->config.max_resp_headers || a->hdrs >= sizeof (a->hdr) / sizeof (*a->hdr))
+      return ESP_FAIL;
+   a->hdr[a->hdrs].field = field;
+   a->hdr[a->hdrs].value = value;
+   a->hdrs++;
+   return ESP_OK;
+}
+
+esp_err_t
+httpd_resp_send (httpd_req_t * r, const char *buf, ssize_t len)
+{
+   aux_t *a = r->aux;
+   if (len == HTTPD_RESP_USE_STRLEN)
+      len = buf ? strlen (buf) : 0;
+   if (a->sent)
+      return ESP_FAIL;
+   if (send_head (r, len) || (len && sendall (a->sess->fd, buf, len, 0) < 0))
+      return ESP_FAIL;
+   return ESP_OK;
+}
+
+esp_err_t
+httpd_resp_sendstr (httpd_req_t * r, const char *str)
+{
+   return httpd_resp_send (r, str, str ? strlen (str) : 0);
+}
+
+esp_err_t
+httpd_resp_send_chunk (httpd_req_t * r, const char *buf, ssize_t len)
+{
+   aux_t *a = r->aux;
+   if (len == HTTPD_RESP_USE_STRLEN)
+      len = buf ? strlen (buf) : 0;
+   if (send_head (r, -1))
+      return ESP_FAIL;
+   esp_get_free_heap_size ();
+   char size[20];
+   if (!buf || !len)
+      return sendall (a->sess->fd, "0\r\n\r\n", 5, 0) < 0 ? ESP_FAIL : ESP_OK;
+   sprintf (size, "%zx\r\n", len);
+   if (sendall (a->sess->fd, size, strlen (size), 0) < 0 || sendall (a->sess->fd, buf, len, 0) < 0
+       || sendall (a->sess->fd, "\r\n", 2, 0) < 0)
+      return ESP_FAIL;
+   return ESP_OK;
+}
+
+esp_err_t
+httpd_resp_sendstr_chunk (httpd_req_t * r, const char *str)
+{
+   return httpd_resp_send_chunk (r, str, str ? strlen (str) : 0);
+}
+
+esp_err_t
+httpd_resp_send_err (httpd_req_t * r, httpd_err_code_t error, const char *msg)
+{
+   const char *status = "500 Internal Server Error";
+   switch (error)
+   {
+   case HTTPD_400_BAD_REQUEST:
+      status = "400 Bad Request";
+      break;
+   case HTTPD_404_NOT_FOUND:
+      status = "404 Not Found";
+      break;
+   case HTTPD_405_METHOD_NOT_ALLOWED:
+      status = "405 Method Not Allowed";
+      break;
+   default:
+      break;
+   }
+   httpd_resp_set_status (r, status);
+   httpd_resp_set_type (r, "text/html");
+   return httpd_resp_sendstr (r, msg ? : status);
+}
+
+int
+httpd_send (httpd_req_t * r, const char *buf, size_t len)
+{                               // Raw send, no response head
+   aux_t *a = r->aux;
+   a->sent = 1;
+   return sendall (a->sess->fd, buf, len, 0);
+}
+
+int
+httpd_socket_send (httpd_handle_t hd, int fd, const char *buf, size_t len, int flags)
+{
+   return sendall (fd, buf, len, flags);
+}
+
+int
+httpd_req_to_sockfd (httpd_req_t * r)
+{
+   return ((aux_t *) r->aux)->sess->fd;
+}
+
+int
+httpd_req_recv (httpd_req_t * r, char *buf, size_t len)
+{                               // Read body, buffered first
+   aux_t *a = r->aux;
+   sess_t *sess = a->sess;
+   if (len > a->bodyleft)
+      len = a->bodyleft;
+   if (!len)
+      return 0;
+   if (sess->inlen)
+   {
+      if (len > sess->inlen)
+         len = sess->inlen;
+      memcpy (buf, sess->in, len);
+      memmove (sess->in, sess->in + len, sess->inlen - len);
+      sess->inlen -= len;
+      a->bodyleft -= len;
+      return len;
+   }
+   ssize_t l = recv (sess->fd, buf, len, 0);
+   if (l <= 0)
+      return -1;
+   a->bodyleft -= l;
+   return l;
+}
+
+size_t
+httpd_req_get_hdr_value_len (httpd_req_t * r, const char *field)
+{
+   size_t len = 0;
+   if (!hdr_find (((aux_t *) r->aux)->head, field, &len))
+      return 0;
+   return len;
+}
+
+esp_err_t
+httpd_req_get_hdr_value_str (httpd_req_t * r, const char *field, char *val, size_t size)
+{
+   size_t len = 0;
+   const char *v = hdr_find (((aux_t *) r->aux)->head, field, &len);
+   if (!v)
+      return ESP_ERR_NOT_FOUND;
+   if (!size)
+      return ESP_ERR_INVALID_ARG;
+   size_t n = len < size - 1 ? len : size - 1;
+   memcpy (val, v, n);
+   val[n] = 0;
+   return n < len ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+}
+
+// Web sockets
+
+esp_err_t
+httpd_ws_recv_frame (httpd_req_t * r, httpd_ws_frame_t * pkt, size_t max_len)
+{                               // Frame already received whole, max_len 0 to get length
+   aux_t *a = r->aux;
+   pkt->final = a->frame.final;
+   pkt->fragmented = a->frame.fragmented;
+   pkt->type = a->frame.type;
+   if (!max_len)
+   {
+      pkt->len = a->frame.len;
+      return ESP_OK;
+   }
+   if (!pkt->payload)
+      return ESP_ERR_INVALID_ARG;
+   pkt->len = a->frame.len < max_len ? a->frame.len : max_len;
+   memcpy (pkt->payload, a->frame.payload, pkt->len);
+   return ESP_OK;
+}
+
+static int
+ws_send (int fd, httpd_ws_type_t type, const uint8_t * payload, size_t len)
+{                               // Server frames are not masked
+   uint8_t head[10];
+   int h = 0;
+   head[h++] = 0x80 | type;
+   if (len < 126)
+      head[h++] = len;
+   else if (len < 65536)
+   {
+      head[h++] = 126;
+      head[h++] = len >> 8;
+      head[h++] = len;
+   } else
+   {
+      head[h++] = 127;
+      for (int i = 7; i >= 0; i--)
+         head[h++] = (uint64_t) len >> (i * 8);
+   }
+   if (sendall (fd, head, h, 0) < 0 || (len && sendall (fd, payload, len, 0) < 0))
+      return -1;
+   return 0;
+}
+
+esp_err_t
+httpd_ws_send_frame_async (httpd_handle_t hd, int fd, httpd_ws_frame_t * frame)
+{
+   server_t *s = hd;
+   sess_t *sess = sess_find (s, fd);
+   if (!sess || !sess->ws)
+      return ESP_FAIL;
+   return ws_send (fd, frame->type, frame->payload, frame->len) ? ESP_FAIL : ESP_OK;
+}
+
+httpd_ws_client_info_t
+httpd_ws_get_fd_info (httpd_handle_t hd, int fd)
+{
+   sess_t *sess = sess_find (hd, fd);
+   if (!sess)
+      return HTTPD_WS_CLIENT_INVALID;
+   return sess->ws ? HTTPD_WS_CLIENT_WEBSOCKET : HTTPD_WS_CLIENT_HTTP;
+}
+
+// Server
+
+esp_err_t
+httpd_register_uri_handler (httpd_handle_t handle, const httpd_uri_t * uri)
+{
+   server_t *s = handle;
+   if (s->uris >= s->config.max_uri_handlers)
+      return ESP_ERR_NO_MEM;
+   for (int i = 0; i < s->uris; i++)
+      if (!strcmp (s->uri[i].uri, uri->uri) && s->uri[i].method == uri->method)
+         return ESP_FAIL;
+   s->uri[s->uris++] = *uri;
+   return ESP_OK;
+}
+
+esp_err_t
+httpd_queue_work (httpd_handle_t handle, httpd_work_fn_t fn, void *arg)
+{
+   server_t *s = handle;
+   work_t *w = calloc (1, sizeof (*w));
+   if (!w)
+      return ESP_ERR_NO_MEM;
+   w->fn = fn;
+   w->arg = arg;
+   pthread_mutex_lock (&s->mutex);
+   if (s->worklast)
+      s->worklast->next = w;
+   else
+      s->work = w;
+   s->worklast = w;
+   pthread_mutex_unlock (&s->mutex);
+   wake (s);
+   return ESP_OK;
+}
+
+esp_err_t
+httpd_sess_trigger_close (httpd_handle_t handle, int fd)
+{
+   server_t *s = handle;
+   pthread_mutex_lock (&s->mutex);
+   sess_t *sess = sess_find (s, fd);
+   if (sess)
+      sess->close = 1;
+   pthread_mutex_unlock (&s->mutex);
+   wake (s);
+   return sess ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+static void
+simple (sess_t * sess, const char *status)
+{                               // Reply when no handler
+   char msg[200];
+   int l = snprintf (msg, sizeof (msg), "HTTP/1.1 %s\r\nContent-Type: text/html\r\nContent-Length: %zu\r\n\r\n%s", status,
+                     strlen (status), status);
+   sendall (sess->fd, msg, l, 0);
+}
+
+static void
+consume (sess_t * sess, size_t len)
+{
+   memmove (sess->in, sess->in + len, sess->inlen - len);
+   sess->inlen -= len;
+}
+
+static int
+do_frame (server_t * s, sess_t * sess)
+{                               // Process web socket frame if whole one received, return 1 if processed, -1 to close
+   if (sess->inlen < 2)
+      return 0;
+   uint8_t *p = sess->in;
+   size_t h = 2;
+   uint64_t len = p[1] & 0x7F;
+   if (len == 126)
+   {
+      if (sess->inlen < 4)
+         return 0;
+      len = (p[2] << 8) | p[3];
+      h = 4;
+   } else if (len == 127)
+   {
+      if (sess->inlen < 10)
+         return 0;
+      len = 0;
+      for (int i = 0; i < 8; i++)
+         len = (len << 8) | p[2 + i];
+      h = 10;
+   }
+   if (len > FRAME_MAX)
+      return -1;
+   uint8_t *mask = NULL;
+   if (p[1] & 0x80)
+   {
+      mask = p + h;
+      h += 4;
+   }
+   if (sess->inlen < h + len)
+      return 0;
+   uint8_t *payload = p + h;
+   if (mask)
+      for (uint64_t i = 0; i < len; i++)
+         payload[i] ^= mask[i & 3];
+   httpd_ws_type_t type = p[0] & 0x0F;
+   int ret = 1;
+   if (type == HTTPD_WS_TYPE_PING)
+      ws_send (sess->fd, HTTPD_WS_TYPE_PONG, payload, len);
+   else if (type == HTTPD_WS_TYPE_CLOSE)
+   {
+      ws_send (sess->fd, HTTPD_WS_TYPE_CLOSE, NULL, 0);
+      ret = -1;
+   } else if (type != HTTPD_WS_TYPE_PONG)
+   {
+      aux_t a = {.s = s,.sess = sess,.head = "" };
+      a.frame.final = (p[0] & 0x80) ? 1 : 0;
+      a.frame.fragmented = !a.frame.final || type == HTTPD_WS_TYPE_CONTINUE;
+      a.frame.type = type;
+      a.frame.payload = payload;
+      a.frame.len = len;
+      httpd_req_t r = {.handle = s,.method = 0,.aux = &a,.user_ctx = sess->wsuri->user_ctx };
+      strncpy ((char *) r.uri, sess->wsuri->uri, HTTPD_MAX_URI_LEN);
+      if (sess->wsuri->handler (&r) != ESP_OK)
+         ret = -1;
+   }
+   consume (sess, h + len);
+   return ret;
+}
+
+static int
+do_request (server_t * s, sess_t * sess)
+{                               // Process HTTP request if whole head received, return 1 if processed, -1 to close
+   if (sess->discard)
+   {                            // Skip body not read by last handler
+      size_t l = sess->discard < sess->inlen ? sess->discard : sess->inlen;
+      consume (sess, l);
+      sess->discard -= l;
+      if (sess->discard)
+         return 0;
+   }
+   char *end = memmem (sess->in, sess->inlen, "\r\n\r\n", 4);
+   if (!end)
+   {
+      if (sess->inlen >= HEAD_MAX)
+      {
+         simple (sess, "431 Request Header Fields Too Large");
+         return -1;
+      }
+      return 0;
+   }
+   size_t headlen = end + 4 - (char *) sess->in;
+   char *head = strndup ((char *) sess->in, headlen - 2);
+   consume (sess, headlen);
+   int ret = 1;
+   char *line = head,
+      *hdrs = strstr (head, "\r\n");
+   *hdrs = 0;
+   hdrs += 2;
+   char *method = strtok (line, " "),
+      *uri = strtok (NULL, " "),
+      *version = strtok (NULL, " ");
+   if (!method || !uri || !version)
+   {
+      simple (sess, "400 Bad Request");
+      free (head);
+      return -1;
+   }
+   if (strlen (uri) > HTTPD_MAX_URI_LEN)
+   {
+      simple (sess, "414 URI Too Long");
+      free (head);
+      return -1;
+   }
+   int m = !strcmp (method, "GET") ? HTTP_GET : !strcmp (method, "POST") ? HTTP_POST : !strcmp (method, "PUT") ? HTTP_PUT :
+      !strcmp (method, "HEAD") ? HTTP_HEAD : !strcmp (method, "DELETE") ? HTTP_DELETE : -1;
+   aux_t a = {.s = s,.sess = sess,.head = hdrs };
+   const char *v;
+   if (!strcmp (version, "HTTP/1.0") || ((v = hdr_find (hdrs, "Connection", NULL)) && !strncasecmp (v, "close", 5)))
+      a.closeafter = 1;
+   if ((v = hdr_find (hdrs, "Content-Length", NULL)))
+      a.bodyleft = strtoul (v, NULL, 10);
+   httpd_req_t r = {.handle = s,.method = m,.content_len = a.bodyleft,.aux = &a };
+   strcpy ((char *) r.uri, uri);
+   size_t pathlen = strcspn (uri, "?");
+   const httpd_uri_t *h = NULL;
+   int found = 0;
+   for (int i = 0; i < s->uris; i++)
+      if (strlen (s->uri[i].uri) == pathlen && !strncmp (s->uri[i].uri, uri, pathlen))
+      {
+         found = 1;
+         if ((int) s->uri[i].method == m)
+            h = &s->uri[i];
+      }
+   if (!h)
+   {
+      simple (sess, found ? "405 Method Not Allowed" : "404 Not Found");
+      ret = -1;
+   } else
+   {
+      r.user_ctx = h->user_ctx;
+      if (h->is_websocket)
+      {                         // Handshake, then handler called with HTTP_GET
+         size_t keylen = 0;
+         const char *key = hdr_find (hdrs, "Sec-WebSocket-Key", &keylen);
+         if (!key || !(v = hdr_find (hdrs, "Upgrade", NULL)) || strncasecmp (v, "websocket", 9))
+         {
+            simple (sess, "400 Bad Request");
+            ret = -1;
+         } else
+         {
+            char accept[100];
+            snprintf (accept, sizeof (accept), "%.*s258EAFA5-E914-47DA-95CA-C5AB0DC85B11", (int) keylen, key);
+            uint8_t hash[20];
+            sha1 ((uint8_t *) accept, strlen (accept), hash);
+            base64 (hash, sizeof (hash), accept);
+            char reply[200];
+            int l = snprintf (reply, sizeof (reply),
+                              "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n",
+                              accept);
+            if (sendall (sess->fd, reply, l, 0) < 0)
+               ret = -1;
+            else
+            {
+               sess->ws = 1;
+               sess->wsuri = h;
+               a.sent = 1;
+               if (h->handler (&r) != ESP_OK)
+                  ret = -1;
+            }
+         }
+      } else if (h->handler (&r) != ESP_OK || a.closeafter)
+         ret = -1;
+   }
+   sess->discard = a.bodyleft;
+   free (head);
+   return ret;
+}
+
+static void *
+server_task (void *arg)
+{
+   server_t *s = arg;
+   int max = s->config.max_open_sockets;
+   struct pollfd *p = calloc (max + 2, sizeof (*p));
+   while (1)
+   {
+      int n = 0,
+         used = 0;
+      p[n].fd = s->wake[0];
+      p[n++].events = POLLIN;
+      for (int i = 0; i < max; i++)
+         if (s->sess[i].fd >= 0)
+            used++;
+      p[n].fd = s->listen;
+      p[n++].events = POLLIN;
+      for (int i = 0; i < max; i++)
+         if (s->sess[i].fd >= 0)
+         {
+            p[n].fd = s->sess[i].fd;
+            p[n++].events = POLLIN;
+         }
+      if (poll (p, n, 1000) < 0)
+         continue;
+      if (p[0].revents)
+      {                         // Queued work
+         char buf[64];
+         while (read (s->wake[0], buf, sizeof (buf)) == sizeof (buf));
+         pthread_mutex_lock (&s->mutex);
+         work_t *w = s->work;
+         s->work = s->worklast = NULL;
+         pthread_mutex_unlock (&s->mutex);
+         while (w)
+         {
+            work_t *next = w->next;
+            w->fn (w->arg);
+            free (w);
+            w = next;
+         }
+      }
+      if (p[1].revents)
+      {                         // New connection
+         int fd = accept (s->listen, NULL, NULL);
+         if (fd >= 0)
+         {
+            if (used >= max)
+               close (fd);      // No space
+            else
+            {
+               struct timeval rt = {.tv_sec = s->config.recv_wait_timeout },
+                  st = {.tv_sec = s->config.send_wait_timeout };
+               setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &rt, sizeof (rt));
+               setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &st, sizeof (st));
+               int on = 1;
+               setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+               for (int i = 0; i < max; i++)
+                  if (s->sess[i].fd < 0)
+                  {
+                     s->sess[i].fd = fd;
+                     break;
+                  }
+            }
+         }
+      }
+      for (int i = 2; i < n; i++)
+         if (p[i].revents)
+         {
+            sess_t *sess = sess_find (s, p[i].fd);
+            if (!sess)
+               continue;
+            if (sess->inlen == IN_SIZE)
+            {                   // Handler is not reading
+               sess_close (s, sess);
+               continue;
+            }
+            ssize_t l = recv (sess->fd, sess->in + sess->inlen, IN_SIZE - sess->inlen, MSG_DONTWAIT);
+            if (l <= 0)
+            {
+               if (l < 0 && (errno == EAGAIN || errno == EINTR))
+                  continue;
+               sess_close (s, sess);
+               continue;
+            }
+            sess->inlen += l;
+            int r;
+            while (sess->fd >= 0 && sess->inlen && (r = (sess->ws ? do_frame (s, sess) : do_request (s, sess))))
+               if (r < 0)
+                  sess_close (s, sess);
+         }
+      for (int i = 0; i < max; i++)
+         if (s->sess[i].fd >= 0 && s->sess[i].close)
+            sess_close (s, &s->sess[i]);
+   }
+   return NULL;
+}
+
+esp_err_t
+httpd_start (httpd_handle_t * handle, const httpd_config_t * config)
+{
+   server_t *s = calloc (1, sizeof (*s));
+   if (!s)
+      return ESP_ERR_NO_MEM;
+   s->config = *config;
+   if (host_port)
+      s->config.server_port = host_port;
+   s->uri = calloc (s->config.max_uri_handlers, sizeof (*s->uri));
+   s->sess = calloc (s->config.max_open_sockets, sizeof (*s->sess));
+   for (int i = 0; i < s->config.max_open_sockets; i++)
+   {
+      s->sess[i].fd = -1;
+      s->sess[i].in = mmap (NULL, IN_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   }
+   pthread_mutex_init (&s->mutex, NULL);
+   if (pipe (s->wake) < 0)
+      return ESP_FAIL;
+   fcntl (s->wake[0], F_SETFL, O_NONBLOCK);
+   fcntl (s->wake[1], F_SETFL, O_NONBLOCK);
+   s->listen = socket (AF_INET6, SOCK_STREAM, 0);
+   int on = 1;
+   setsockopt (s->listen, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+   struct sockaddr_in6 addr = {.sin6_family = AF_INET6,.sin6_port = htons (s->config.server_port),.sin6_addr = in6addr_any };
+   if (bind (s->listen, (struct sockaddr *) &addr, sizeof (addr)) < 0 || listen (s->listen, s->config.backlog_conn) < 0)
+   {
+      fprintf (stderr, "Cannot listen on port %d: %s\n", s->config.server_port, strerror (errno));
+      close (s->listen);
+      free (s->uri);
+      free (s->sess);
+      free (s);
+      return ESP_FAIL;
+   }
+   pthread_create (&s->thread, NULL, server_task, s);
+   *handle = s;
+   return ESP_OK;
+}
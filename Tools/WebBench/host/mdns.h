@@ -0,0 +1,2 @@
+// mdns shim for the host build, nothing needed
+#pragma once
@@ -0,0 +1,17 @@
+// NVS shim for the host build, nothing is stored
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint32_t nvs_handle_t;
+typedef enum
+{
+   NVS_READONLY,
+   NVS_READWRITE,
+} nvs_open_mode_t;
+
+int nvs_open (const char *, nvs_open_mode_t, nvs_handle_t *);
+int nvs_get_blob (nvs_handle_t, const char *, void *, size_t *);
+int nvs_set_blob (nvs_handle_t, const char *, const void *, size_t);
+int nvs_commit (nvs_handle_t);
+void nvs_close (nvs_handle_t);
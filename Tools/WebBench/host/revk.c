@@ -0,0 +1,468 @@
+// ESP32-RevK and ESP-IDF system shim for the host build, just what Faikin.c uses
+// Copyright (c) 2019-2024 Adrian Kennard, Andrews & Arnold Limited, see LICENSE file (GPL)
+// MQTT goes nowhere, settings stay as the settings.def defaults, there is no NVS or UART, and the heap figures are
+// a notional ESP32 heap less what this process has allocated, so /metrics shows leaks and peaks under load. For that
+// faikin-host runs with one malloc arena and no tcache, and the minimum is sampled as responses are sent.
+
+#include "revk.h"
+#include <pthread.h>
+#include <errno.h>
+#include <malloc.h>
+#include "nvs.h"
+#include "driver/gpio.h"
+#include "driver/uart.h"
+#include "esp_random.h"
+#include "cn_wired_driver.h"
+
+#define	HOST_HEAP	(200*1024)      // Notional free heap at boot
+
+const char *appname = "Faikin";
+char *hostname = "faikin-host";
+const char revk_version[] = "host";
+char revk_id[] = "000000000000";
+char *topiccommand = "command";
+char *topicstate = "state";
+
+static struct timespec boot;
+static size_t heap_base;
+static uint32_t heap_min = HOST_HEAP;
+
+void revk_state_extra (jo_t j);
+void revk_web_extra (httpd_req_t * req, int page);
+
+void
+revk_boot (app_callback_t * app_callback)
+{
+   clock_gettime (CLOCK_MONOTONIC, &boot);
+   heap_base = mallinfo2 ().uordblks;
+}
+
+void
+revk_start (void)
+{
+}
+
+int64_t
+esp_timer_get_time (void)
+{
+   struct timespec now;
+   clock_gettime (CLOCK_MONOTONIC, &now);
+   return (int64_t) (now.tv_sec - boot.tv_sec) * 1000000LL + (now.tv_nsec - boot.tv_nsec) / 1000;
+}
+
+uint32_t
+uptime (void)
+{
+   return esp_timer_get_time () / 1000000LL + 1;
+}
+
+int
+revk_shutting_down (const char **reason)
+{
+   return 0;
+}
+
+int
+revk_link_down (void)
+{
+   return 0;
+}
+
+const char *
+revk_wifi (void)
+{
+   return "host";
+}
+
+void
+revk_blink (uint8_t on, uint8_t off, const char *colours)
+{
+}
+
+void *
+mallocspi (size_t size)
+{
+   return malloc (size);
+}
+
+int
+gpio_ok (uint8_t gpio)
+{
+   return 0;
+}
+
+void
+sys_msleep (uint32_t ms)
+{
+   usleep (ms * 1000);
+}
+
+const char *
+esp_err_to_name (esp_err_t e)
+{
+   return e ? "ESP_FAIL" : "ESP_OK";
+}
+
+uint32_t
+esp_get_free_heap_size (void)
+{
+   size_t used = mallinfo2 ().uordblks;
+   uint32_t free = used > heap_base + HOST_HEAP ? 0 : HOST_HEAP - (used > heap_base ? used - heap_base : 0);
+   if (free < heap_min)
+      heap_min = free;
+   return free;
+}
+
+uint32_t
+esp_get_minimum_free_heap_size (void)
+{
+   esp_get_free_heap_size ();
+   return heap_min;
+}
+
+uint32_t
+esp_random (void)
+{
+   return random ();
+}
+
+// FreeRTOS
+
+SemaphoreHandle_t
+xSemaphoreCreateMutex (void)
+{
+   pthread_mutex_t *m = malloc (sizeof (*m));
+   pthread_mutex_init (m, NULL);
+   return m;
+}
+
+BaseType_t
+xSemaphoreTake (SemaphoreHandle_t s, TickType_t wait)
+{
+   if (wait == portMAX_DELAY)
+      return pthread_mutex_lock (s) ? pdFALSE : pdTRUE;
+   if (!wait)
+      return pthread_mutex_trylock (s) ? pdFALSE : pdTRUE;
+   struct timespec t;
+   clock_gettime (CLOCK_REALTIME, &t);
+   t.tv_sec += wait / 1000;
+   t.tv_nsec += (wait % 1000) * 1000000L;
+   if (t.tv_nsec >= 1000000000L)
+   {
+      t.tv_sec++;
+      t.tv_nsec -= 1000000000L;
+   }
+   return pthread_mutex_timedlock (s, &t) ? pdFALSE : pdTRUE;
+}
+
+BaseType_t
+xSemaphoreGive (SemaphoreHandle_t s)
+{
+   return pthread_mutex_unlock (s) ? pdFALSE : pdTRUE;
+}
+
+UBaseType_t
+uxTaskGetStackHighWaterMark (TaskHandle_t t)
+{
+   return 0;
+}
+
+void
+vTaskDelay (TickType_t ticks)
+{
+   usleep (ticks * portTICK_PERIOD_MS * 1000);
+}
+
+// MQTT, messages are discarded
+
+char *
+revk_topic (const char *name, const char *id, const char *suffix)
+{
+   char *t = NULL;
+   asprintf (&t, "%s/%s%s%s", name, id ? : hostname, suffix ? "/" : "", suffix ? : "");
+   return t;
+}
+
+lwmqtt_t
+revk_mqtt (int client)
+{
+   return NULL;
+}
+
+void
+lwmqtt_subscribe (lwmqtt_t m, const char *topic)
+{
+}
+
+const char *
+revk_mqtt_send_clients (const char *prefix, int retain, const char *suffix, jo_t * jp, uint8_t clients)
+{
+   jo_free (jp);
+   return NULL;
+}
+
+const char *
+revk_mqtt_send (const char *prefix, int retain, const char *suffix, jo_t * jp)
+{
+   return revk_mqtt_send_clients (prefix, retain, suffix, jp, 1);
+}
+
+const char *
+revk_mqtt_send_str (const char *topic)
+{
+   return NULL;
+}
+
+const char *
+revk_state (const char *suffix, jo_t * jp)
+{
+   return revk_mqtt_send (topicstate, 1, suffix, jp);
+}
+
+const char *
+revk_info (const char *suffix, jo_t * jp)
+{
+   return revk_mqtt_send ("info", 0, suffix, jp);
+}
+
+const char *
+revk_error (const char *suffix, jo_t * jp)
+{
+   return revk_mqtt_send ("error", 0, suffix, jp);
+}
+
+const char *
+revk_command (const char *tag, jo_t j)
+{
+   if (!strcmp (tag, "status"))
+   {                            // Status as sent on connect, so the state is built as on a device
+      jo_t s = jo_object_alloc ();
+      revk_state_extra (s);
+      revk_state (NULL, &s);
+   }
+   return NULL;
+}
+
+const char *
+revk_settings_store (jo_t j, const char **location, uint8_t flags)
+{                               // Settings are not stored in the host build
+   return NULL;
+}
+
+// Web
+
+int
+revk_num_web_handlers (void)
+{
+   return 1;
+}
+
+esp_err_t
+revk_web_settings (httpd_req_t * req)
+{
+   httpd_resp_set_type (req, "text/html; charset=utf-8");
+   revk_web_send (req, "<html><body><h1>%s</h1><p>Settings are fixed at their defaults in the host build.</p><table>",
+                  hostname);
+   revk_web_extra (req, 0);
+   revk_web_send (req, "</table></body></html>");
+   httpd_resp_sendstr_chunk (req, NULL);
+   return ESP_OK;
+}
+
+void
+revk_web_settings_add (httpd_handle_t webserver)
+{
+   httpd_uri_t uri = {
+      .uri = "/revk-settings",
+      .method = HTTP_GET,
+      .handler = revk_web_settings,
+   };
+   httpd_register_uri_handler (webserver, &uri);
+}
+
+void
+revk_web_setting (httpd_req_t * req, const char *tag, const char *field)
+{
+   revk_web_send (req, "<tr><td>%s</td><td>%s</td></tr>", tag, field);
+}
+
+void
+revk_web_send (httpd_req_t * req, const char *format, ...)
+{
+   va_list ap;
+   va_start (ap, format);
+   char *v = NULL;
+   vasprintf (&v, format, ap);
+   va_end (ap);
+   if (v)
+      httpd_resp_sendstr_chunk (req, v);
+   free (v);
+}
+
+jo_t
+revk_web_query (httpd_req_t * req)
+{                               // Query string as an object of strings
+   const char *q = strchr (req->uri, '?');
+   if (!q)
+      return NULL;
+   jo_t j = jo_object_alloc ();
+   q++;
+   while (*q)
+   {
+      const char *e = q;
+      while (*e && *e != '&')
+         e++;
+      char *pair = strndup (q, e - q),
+         *o = pair;
+      for (char *p = pair; *p; p++)
+         if (*p == '+')
+            *o++ = ' ';
+         else if (*p == '%' && isxdigit ((int) p[1]) && isxdigit ((int) p[2]))
+         {
+            char hex[3] = { p[1], p[2], 0 };
+            *o++ = strtol (hex, NULL, 16);
+            p += 2;
+         } else
+            *o++ = *p;
+      *o = 0;
+      char *v = strchr (pair, '=');
+      if (v)
+         *v++ = 0;
+      if (*pair)
+         jo_string (j, pair, v ? : "");
+      free (pair);
+      q = *e ? e + 1 : e;
+   }
+   return j;
+}
+
+// No NVS, UART or CN_WIRED
+
+int
+nvs_open (const char *name, nvs_open_mode_t mode, nvs_handle_t * h)
+{
+   return ESP_ERR_NOT_FOUND;
+}
+
+int
+nvs_get_blob (nvs_handle_t h, const char *key, void *data, size_t *len)
+{
+   return ESP_ERR_NOT_FOUND;
+}
+
+int
+nvs_set_blob (nvs_handle_t h, const char *key, const void *data, size_t len)
+{
+   return ESP_FAIL;
+}
+
+int
+nvs_commit (nvs_handle_t h)
+{
+   return ESP_FAIL;
+}
+
+void
+nvs_close (nvs_handle_t h)
+{
+}
+
+int
+gpio_config (const gpio_config_t * c)
+{
+   return ESP_OK;
+}
+
+int
+gpio_reset_pin (gpio_num_t p)
+{
+   return ESP_OK;
+}
+
+int
+gpio_pullup_en (gpio_num_t p)
+{
+   return ESP_OK;
+}
+
+int
+uart_param_config (uart_port_t u, const uart_config_t * c)
+{
+   return ESP_FAIL;
+}
+
+int
+uart_set_pin (uart_port_t u, int tx, int rx, int rts, int cts)
+{
+   return ESP_FAIL;
+}
+
+int
+uart_set_line_inverse (uart_port_t u, uint32_t inv)
+{
+   return ESP_FAIL;
+}
+
+int
+uart_driver_install (uart_port_t u, int rx, int tx, int q, void *h, int f)
+{
+   return ESP_FAIL;
+}
+
+int
+uart_driver_delete (uart_port_t u)
+{
+   return ESP_OK;
+}
+
+int
+uart_set_rx_full_threshold (uart_port_t u, int t)
+{
+   return ESP_FAIL;
+}
+
+int
+uart_flush (uart_port_t u)
+{
+   return ESP_OK;
+}
+
+int
+uart_write_bytes (uart_port_t u, const void *buf, size_t len)
+{
+   return -1;
+}
+
+int
+uart_read_bytes (uart_port_t u, void *buf, uint32_t len, uint32_t wait)
+{
+   return -1;
+}
+
+esp_err_t
+cn_wired_driver_install (gpio_num_t rx_num, gpio_num_t tx_num, int rx_invert, int tx_invert)
+{
+   return ESP_FAIL;
+}
+
+void
+cn_wired_driver_delete (void)
+{
+}
+
+esp_err_t
+cn_wired_read_bytes (uint8_t * rx, int timeout)
+{
+   return ESP_ERR_TIMEOUT;
+}
+
+esp_err_t
+cn_wired_write_bytes (const uint8_t * buf)
+{
+   return ESP_FAIL;
+}
+
+void
+cn_wired_stats (jo_t j)
+{
+}
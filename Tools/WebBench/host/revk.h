@@ -0,0 +1,82 @@
+// ESP32-RevK shim for the host build, just what Faikin.c uses (revk.c)
+// MQTT goes nowhere, settings are the defaults from settings.def, and the settings page just lists them
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <ctype.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_http_server.h"
+#include "jo.h"
+
+#define	ESP_OK			0
+#define	ESP_FAIL		-1
+#define	ESP_ERR_NO_MEM		0x101
+#define	ESP_ERR_INVALID_ARG	0x102
+#define	ESP_ERR_INVALID_STATE	0x103
+#define	ESP_ERR_NOT_FOUND	0x105
+#define	ESP_ERR_TIMEOUT		0x107
+#define	ESP_LOGE(tag,...)	do{fprintf(stderr,__VA_ARGS__);fputc('\n',stderr);}while(0)
+#define	ESP_LOGI(tag,...)	do{}while(0)
+#define	ESP_LOGW(tag,...)	do{}while(0)
+#define	ESP_LOG_BUFFER_HEX(tag,buf,len)	do{}while(0)
+
+typedef struct
+{                               // GPIO setting
+   uint16_t num:10;
+   uint16_t invert:1;
+   uint16_t set:1;
+} revk_gpio_t;
+
+#include "settings.h"
+
+typedef struct lwmqtt_s *lwmqtt_t;
+typedef const char *app_callback_t (int client, const char *prefix, const char *target, const char *suffix, jo_t j);
+
+extern const char *appname;
+extern char *hostname;
+extern const char revk_version[];
+extern char revk_id[];
+extern char *topiccommand;
+extern char *topicstate;
+
+void revk_boot (app_callback_t * app_callback);
+void revk_start (void);
+uint32_t uptime (void);
+int revk_shutting_down (const char **reason);
+int revk_link_down (void);
+const char *revk_wifi (void);
+void revk_blink (uint8_t on, uint8_t off, const char *colours);
+void *mallocspi (size_t);
+int gpio_ok (uint8_t gpio);
+
+char *revk_topic (const char *name, const char *id, const char *suffix);
+lwmqtt_t revk_mqtt (int client);
+void lwmqtt_subscribe (lwmqtt_t, const char *topic);
+const char *revk_mqtt_send (const char *prefix, int retain, const char *suffix, jo_t * jp);
+const char *revk_mqtt_send_clients (const char *prefix, int retain, const char *suffix, jo_t * jp, uint8_t clients);
+const char *revk_mqtt_send_str (const char *topic);
+const char *revk_state (const char *suffix, jo_t * jp);
+const char *revk_info (const char *suffix, jo_t * jp);
+const char *revk_error (const char *suffix, jo_t * jp);
+const char *revk_command (const char *tag, jo_t j);
+const char *revk_settings_store (jo_t j, const char **location, uint8_t flags);
+
+int revk_num_web_handlers (void);
+void revk_web_settings_add (httpd_handle_t webserver);
+esp_err_t revk_web_settings (httpd_req_t * req);
+void revk_web_setting (httpd_req_t * req, const char *tag, const char *field);
+void revk_web_send (httpd_req_t * req, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+jo_t revk_web_query (httpd_req_t * req);
+
+// ESP-IDF system calls
+const char *esp_err_to_name (esp_err_t);
+int64_t esp_timer_get_time (void);
+uint32_t esp_get_free_heap_size (void);
+uint32_t esp_get_minimum_free_heap_size (void);
+void sys_msleep (uint32_t ms);
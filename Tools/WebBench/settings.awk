@@ -0,0 +1,58 @@
+# Make settings.h (-v out=h) or settings.c (-v out=c) for the host build from ESP/settings.def
+# Settings are just the defaults, GPIOs are left unset so Faikin runs without a UART (mock aircon)
+BEGIN {
+   type["bit"] = "uint8_t"; type["u8"] = "uint8_t"; type["u16"] = "uint16_t"; type["u32"] = "uint32_t";
+   type["s8"] = "int8_t"; type["s16"] = "int16_t"; type["s32"] = "int32_t"; type["s"] = "char *"; type["gpio"] = "revk_gpio_t";
+   print "// Generated from settings.def by settings.awk, do not edit"
+   if (out == "h")
+      print "#pragma once"
+   else
+      print "#include \"revk.h\""
+}
+{
+   sub(/\/\/.*/, "")
+}
+/^#/ {
+   print
+   next
+}
+NF < 2 {
+   next
+}
+{
+   name = $2
+   gsub(/\./, "", name)
+   def = ""
+   array = 0
+   decimal = 0
+   for (i = 3; i <= NF; i++) {
+      if ($i ~ /^\.array=/) {
+         array = substr($i, 8) + 0
+      } else if ($i ~ /^\.decimal=/) {
+         decimal = substr($i, 10) + 0
+      } else if ($i !~ /^\./ && i == 3) {
+         def = $i
+      }
+   }
+   dim = array ? "[" array "]" : ""
+   sp = type[$1] ~ /\*$/ ? "" : " "
+   if (out == "h") {
+      print "extern " type[$1] sp name dim ";"
+      if (decimal)
+         printf "#define	%s_scale	%d\n", name, 10 ^ decimal
+      next
+   }
+   if ($1 == "gpio")
+      val = "{0}"
+   else if ($1 == "s")
+      val = "\"" def "\""
+   else
+      val = sprintf ("%d", def * (10 ^ decimal) + (def < 0 ? -0.5 : 0.5))
+   if (array) {
+      list = val
+      for (i = 1; i < array; i++)
+         list = list ", " val
+      val = "{" list "}"
+   }
+   print type[$1] sp name dim " = " val ";"
+}
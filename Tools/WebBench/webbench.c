@@ -0,0 +1,785 @@
+// Faikin web load benchmark, mixed dashboard, legacy poller, REST, web socket and SSE clients
+// Copyright (c) 2019-2024 Adrian Kennard, Andrews & Arnold Limited, see LICENSE file (GPL)
+// Runs against faikin-host or a real device, reports requests/s and latency per client type, and from /metrics the
+// heap and poll cycles (a cycle over 1s is a missed tick). Exit status 1 if a --max-*/--min-* limit is not met.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <popt.h>
+#include <err.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+const char *host = "localhost";
+const char *port = "80";
+int seconds = 10;
+int view = 10;                  // Dashboard seconds per page view
+int interval = 0;               // ms between legacy/api polls
+int timeout = 5;
+volatile int running = 1;
+int active = 0;                 // Client threads running
+
+typedef struct
+{                               // Results for one type of request
+   const char *name;
+   pthread_mutex_t mutex;
+   uint32_t *us;                // Latencies
+   size_t count,
+     size;
+   uint32_t errors;
+   uint32_t refused;            // Could not connect (or closed at once)
+   uint64_t bytes;
+   uint32_t messages;           // Pushed status messages (ws/sse)
+   uint32_t maxgap;             // Longest gap between pushed messages (ms)
+} stat_t;
+
+enum
+{ STAT_PAGE, STAT_CAPS, STAT_LEGACY, STAT_API, STAT_WS, STAT_SSE, STATS };
+stat_t stat[STATS] = {
+   {.name = "page"},
+   {.name = "capabilities"},
+   {.name = "legacy"},
+   {.name = "api"},
+   {.name = "websocket"},
+   {.name = "sse"},
+};
+
+static uint64_t
+now_us (void)
+{
+   struct timespec t;
+   clock_gettime (CLOCK_MONOTONIC, &t);
+   return (uint64_t) t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
+
+static void
+record (stat_t * s, uint64_t start, size_t bytes)
+{
+   pthread_mutex_lock (&s->mutex);
+   if (s->count == s->size)
+   {
+      s->size = s->size * 2 + 1024;
+      s->us = realloc (s->us, s->size * sizeof (*s->us));
+   }
+   s->us[s->count++] = now_us () - start;
+   s->bytes += bytes;
+   pthread_mutex_unlock (&s->mutex);
+}
+
+static void
+fail (stat_t * s, int refused)
+{
+   pthread_mutex_lock (&s->mutex);
+   if (refused)
+      s->refused++;
+   else
+      s->errors++;
+   pthread_mutex_unlock (&s->mutex);
+}
+
+static void
+pushed (stat_t * s, uint64_t * last)
+{                               // Status message pushed
+   uint64_t now = now_us ();
+   pthread_mutex_lock (&s->mutex);
+   s->messages++;
+   if (*last && (now - *last) / 1000 > s->maxgap)
+      s->maxgap = (now - *last) / 1000;
+   pthread_mutex_unlock (&s->mutex);
+   *last = now;
+}
+
+// Connections
+
+typedef struct
+{
+   int fd;
+   char buf[65536];
+   size_t len;
+} conn_t;
+
+#define	CONNS	1024
+conn_t *conns[CONNS];           // All connections, so they can be shut down at the end
+pthread_mutex_t conns_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static conn_t *
+conn_new (void)
+{
+   conn_t *c = calloc (1, sizeof (*c));
+   c->fd = -1;
+   pthread_mutex_lock (&conns_mutex);
+   for (int i = 0; i < CONNS; i++)
+      if (!conns[i])
+      {
+         conns[i] = c;
+         break;
+      }
+   pthread_mutex_unlock (&conns_mutex);
+   return c;
+}
+
+static void
+conn_shutdown (void)
+{                               // Wake any thread waiting on a connection
+   pthread_mutex_lock (&conns_mutex);
+   for (int i = 0; i < CONNS; i++)
+      if (conns[i] && conns[i]->fd >= 0)
+         shutdown (conns[i]->fd, SHUT_RDWR);
+   pthread_mutex_unlock (&conns_mutex);
+}
+
+static int
+conn_open (conn_t * c)
+{
+   struct addrinfo hints = {.ai_socktype = SOCK_STREAM },
+      *res = NULL;
+   c->len = 0;
+   c->fd = -1;
+   if (getaddrinfo (host, port, &hints, &res) || !res)
+      return -1;
+   int fd = -1;
+   for (struct addrinfo * a = res; a && fd < 0; a = a->ai_next)
+   {
+      fd = socket (a->ai_family, a->ai_socktype, a->ai_protocol);
+      if (fd >= 0 && connect (fd, a->ai_addr, a->ai_addrlen))
+      {
+         close (fd);
+         fd = -1;
+      }
+   }
+   pthread_mutex_lock (&conns_mutex);
+   c->fd = fd;
+   pthread_mutex_unlock (&conns_mutex);
+   freeaddrinfo (res);
+   if (c->fd < 0)
+      return -1;
+   struct timeval t = {.tv_sec = timeout };
+   setsockopt (c->fd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof (t));
+   setsockopt (c->fd, SOL_SOCKET, SO_SNDTIMEO, &t, sizeof (t));
+   int on = 1;
+   setsockopt (c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+   return 0;
+}
+
+static void
+conn_close (conn_t * c)
+{
+   pthread_mutex_lock (&conns_mutex);
+   if (c->fd >= 0)
+      close (c->fd);
+   c->fd = -1;
+   c->len = 0;
+   pthread_mutex_unlock (&conns_mutex);
+}
+
+static void
+conn_free (conn_t * c)
+{
+   conn_close (c);
+   pthread_mutex_lock (&conns_mutex);
+   for (int i = 0; i < CONNS; i++)
+      if (conns[i] == c)
+         conns[i] = NULL;
+   pthread_mutex_unlock (&conns_mutex);
+   free (c);
+}
+
+static int
+conn_fill (conn_t * c)
+{                               // Read more, returns bytes read, 0 closed, -1 error
+   if (c->len == sizeof (c->buf))
+      return -1;
+   ssize_t l = recv (c->fd, c->buf + c->len, sizeof (c->buf) - c->len, 0);
+   if (l > 0)
+      c->len += l;
+   return l;
+}
+
+static void
+conn_consume (conn_t * c, size_t len)
+{
+   memmove (c->buf, c->buf + len, c->len - len);
+   c->len -= len;
+}
+
+static int
+conn_send (conn_t * c, const void *data, size_t len)
+{
+   size_t done = 0;
+   while (done < len)
+   {
+      ssize_t l = send (c->fd, (const char *) data + done, len - done, MSG_NOSIGNAL);
+      if (l <= 0)
+         return -1;
+      done += l;
+   }
+   return 0;
+}
+
+static const char *
+head_field (const char *head, const char *field)
+{
+   size_t l = strlen (field);
+   for (const char *p = strstr (head, "\r\n"); p; p = strstr (p + 2, "\r\n"))
+      if (!strncasecmp (p + 2, field, l) && p[2 + l] == ':')
+      {
+         p += 3 + l;
+         while (*p == ' ')
+            p++;
+         return p;
+      }
+   return NULL;
+}
+
+static int
+http_get (conn_t * c, const char *path, const char *etag, char *etagout, size_t *bytesp, char **bodyp)
+{                               // GET on keep-alive connection, returns status, or -1 for error
+   char req[1024];
+   if (c->fd < 0 && conn_open (c))
+      return -2;
+   int l = snprintf (req, sizeof (req), "GET %s HTTP/1.1\r\nHost: %s\r\nAccept-Encoding: gzip\r\n%s%s%s\r\n", path, host,
+                     etag && *etag ? "If-None-Match: " : "", etag && *etag ? etag : "", etag && *etag ? "\r\n" : "");
+   if (conn_send (c, req, l))
+      return -1;
+   char *end;
+   while (!(end = memmem (c->buf, c->len, "\r\n\r\n", 4)))
+      if (conn_fill (c) <= 0)
+         return -1;
+   size_t headlen = end + 4 - c->buf;
+   char head[4096];
+   if (headlen >= sizeof (head))
+      return -1;
+   memcpy (head, c->buf, headlen);
+   head[headlen] = 0;
+   conn_consume (c, headlen);
+   int status = 0;
+   if (sscanf (head, "HTTP/1.%*d %d", &status) != 1)
+      return -1;
+   const char *v;
+   if (etagout && (v = head_field (head, "ETag")))
+   {
+      size_t n = strcspn (v, "\r");
+      if (n < 64)
+      {
+         memcpy (etagout, v, n);
+         etagout[n] = 0;
+      }
+   }
+   char *body = NULL;
+   size_t blen = 0;
+   FILE *f = bodyp ? open_memstream (&body, &blen) : NULL;
+   size_t total = 0;
+   if ((v = head_field (head, "Transfer-Encoding")) && !strncasecmp (v, "chunked", 7))
+   {
+      while (1)
+      {
+         char *e;
+         while (!(e = memmem (c->buf, c->len, "\r\n", 2)))
+            if (conn_fill (c) <= 0)
+               goto bad;
+         size_t size = strtoul (c->buf, NULL, 16);
+         conn_consume (c, e + 2 - c->buf);
+         while (c->len < size + 2)
+            if (conn_fill (c) <= 0)
+               goto bad;
+         if (f)
+            fwrite (c->buf, 1, size, f);
+         total += size;
+         conn_consume (c, size + 2);
+         if (!size)
+            break;
+      }
+   } else if ((v = head_field (head, "Content-Length")))
+   {
+      size_t size = strtoul (v, NULL, 10);
+      while (size)
+      {
+         if (!c->len && conn_fill (c) <= 0)
+            goto bad;
+         size_t n = size < c->len ? size : c->len;
+         if (f)
+            fwrite (c->buf, 1, n, f);
+         total += n;
+         conn_consume (c, n);
+         size -= n;
+      }
+   }
+   if ((v = head_field (head, "Connection")) && !strncasecmp (v, "close", 5))
+      conn_close (c);
+   if (f)
+   {
+      fclose (f);
+      *bodyp = body;
+   }
+   if (bytesp)
+      *bytesp = total;
+   return status;
+ bad:
+   if (f)
+   {
+      fclose (f);
+      free (body);
+   }
+   return -1;
+}
+
+static int
+get (conn_t * c, stat_t * s, const char *path, char *etag)
+{                               // Timed GET, reconnecting as needed
+   uint64_t start = now_us ();
+   size_t bytes = 0;
+   int status = http_get (c, path, etag, etag, &bytes, NULL);
+   if (status == -1 && c->fd >= 0)
+   {                            // Keep-alive closed under us, try once on a new connection
+      conn_close (c);
+      start = now_us ();
+      status = http_get (c, path, etag, etag, &bytes, NULL);
+   }
+   if (status == 200 || status == 304)
+      record (s, start, bytes);
+   else
+   {
+      fail (s, status == -2 || (status == -1 && !c->len));
+      conn_close (c);
+   }
+   return status;
+}
+
+static void
+pause_ms (int ms)
+{
+   if (ms > 0)
+      usleep (ms * 1000);
+}
+
+// Web socket and SSE listeners
+
+static int
+ws_open (conn_t * c)
+{
+   if (conn_open (c))
+      return -2;
+   char req[512];
+   int l = snprintf (req, sizeof (req),
+                     "GET /status HTTP/1.1\r\nHost: %s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n",
+                     host);
+   if (conn_send (c, req, l))
+      return -1;
+   char *end;
+   while (!(end = memmem (c->buf, c->len, "\r\n\r\n", 4)))
+      if (conn_fill (c) <= 0)
+         return -1;
+   if (strncmp (c->buf + 9, "101", 3))
+      return -1;
+   conn_consume (c, end + 4 - c->buf);
+   return 0;
+}
+
+static int
+ws_frame (conn_t * c)
+{                               // Wait for a text frame, returns length, -1 error
+   while (1)
+   {
+      while (c->len < 2)
+         if (conn_fill (c) <= 0)
+            return -1;
+      uint8_t *p = (uint8_t *) c->buf;
+      size_t h = 2,
+         len = p[1] & 0x7F;
+      if (len == 126)
+      {
+         while (c->len < 4)
+            if (conn_fill (c) <= 0)
+               return -1;
+         len = (p[2] << 8) | p[3];
+         h = 4;
+      } else if (len == 127)
+         return -1;
+      while (c->len < h + len)
+         if (conn_fill (c) <= 0)
+            return -1;
+      int op = p[0] & 0x0F;
+      conn_consume (c, h + len);
+      if (op == 8)
+         return -1;
+      if (op == 1)
+         return len;
+   }
+}
+
+static void
+ws_listen (conn_t * c, stat_t * s, uint64_t until)
+{                               // Count pushed status until time or error
+   uint64_t last = 0;
+   while (running && now_us () < until)
+   {
+      int l = ws_frame (c);
+      if (l < 0)
+      {
+         if (running && now_us () < until)
+            fail (s, 0);
+         break;
+      }
+      pushed (s, &last);
+   }
+}
+
+static void *
+ws_task (void *arg)
+{                               // Web socket listener, as an open page
+   conn_t *c = conn_new ();
+   while (running)
+   {
+      uint64_t start = now_us ();
+      int e = ws_open (c);
+      if (e || ws_frame (c) < 0)
+      {                         // First status is sent on connect
+         fail (&stat[STAT_WS], e == -2 || !c->len);
+         conn_close (c);
+         pause_ms (1000);
+         continue;
+      }
+      record (&stat[STAT_WS], start, 0);
+      ws_listen (c, &stat[STAT_WS], (uint64_t) - 1);
+      conn_close (c);
+   }
+   conn_free (c);
+   __atomic_sub_fetch (&active, 1, __ATOMIC_RELAXED);
+   return NULL;
+}
+
+static void *
+sse_task (void *arg)
+{                               // Server-Sent Events listener
+   conn_t *c = conn_new ();
+   stat_t *s = &stat[STAT_SSE];
+   while (running)
+   {
+      uint64_t start = now_us (),
+         last = 0;
+      char req[256];
+      int l = snprintf (req, sizeof (req), "GET /events HTTP/1.1\r\nHost: %s\r\nAccept: text/event-stream\r\n\r\n", host);
+      if (conn_open (c) || conn_send (c, req, l))
+      {
+         fail (s, 1);
+         conn_close (c);
+         pause_ms (1000);
+         continue;
+      }
+      int first = 1;
+      while (running)
+      {
+         char *e;
+         while (!(e = memmem (c->buf, c->len, "\n\n", 2)))
+            if (conn_fill (c) <= 0)
+               break;
+         if (!e)
+         {
+            if (running)
+               fail (s, first && !c->len);
+            if (first)
+               pause_ms (1000);
+            break;
+         }
+         size_t n = e + 2 - c->buf;
+         if (memmem (c->buf, n, "event: status", 13) || memmem (c->buf, n, "event: delta", 12))
+         {
+            if (first)
+               record (s, start, 0);
+            first = 0;
+            pushed (s, &last);
+         }
+         conn_consume (c, n);
+      }
+      conn_close (c);
+   }
+   conn_free (c);
+   __atomic_sub_fetch (&active, 1, __ATOMIC_RELAXED);
+   return NULL;
+}
+
+// Pollers
+
+static void *
+dashboard_task (void *arg)
+{                               // Page load, capabilities, then the page's web socket for the view time
+   conn_t *c = conn_new (),
+      *w = conn_new ();
+   char pagetag[64] = "",
+      capstag[64] = "";
+   while (running)
+   {                            // Revalidated with ETags as a browser would
+      if (get (c, &stat[STAT_PAGE], "/", pagetag) < 0 || get (c, &stat[STAT_CAPS], "/capabilities", capstag) < 0)
+      {
+         pause_ms (1000);
+         continue;
+      }
+      conn_close (c);           // A browser would keep this a while, but the page has all it needs
+      uint64_t start = now_us ();
+      int e = ws_open (w);
+      if (e || ws_frame (w) < 0)
+      {
+         fail (&stat[STAT_WS], e == -2 || !w->len);
+         conn_close (w);
+         pause_ms (1000);
+         continue;
+      }
+      record (&stat[STAT_WS], start, 0);
+      ws_listen (w, &stat[STAT_WS], now_us () + view * 1000000ULL);
+      conn_close (w);
+   }
+   conn_free (c);
+   conn_free (w);
+   __atomic_sub_fetch (&active, 1, __ATOMIC_RELAXED);
+   return NULL;
+}
+
+static void *
+legacy_task (void *arg)
+{                               // Daikin app / integration style polling
+   const char *paths[] = { "/aircon/get_control_info", "/aircon/get_sensor_info", "/common/basic_info", "/aircon/get_model_info" };
+   conn_t *c = conn_new ();
+   int n = 0;
+   while (running)
+   {
+      if (get (c, &stat[STAT_LEGACY], paths[n++ % (sizeof (paths) / sizeof (*paths))], NULL) < 0)
+         pause_ms (100);
+      pause_ms (interval);
+   }
+   conn_free (c);
+   __atomic_sub_fetch (&active, 1, __ATOMIC_RELAXED);
+   return NULL;
+}
+
+static void *
+api_task (void *arg)
+{                               // REST polling with ETag
+   conn_t *c = conn_new ();
+   char etag[64] = "";
+   while (running)
+   {
+      if (get (c, &stat[STAT_API], "/api/status", etag) < 0)
+         pause_ms (100);
+      pause_ms (interval);
+   }
+   conn_free (c);
+   __atomic_sub_fetch (&active, 1, __ATOMIC_RELAXED);
+   return NULL;
+}
+
+// Device metrics
+
+typedef struct
+{
+   int ok;
+   double heap,
+     heapmin,
+     cycles,
+     under1s,
+     uptime;
+} metrics_t;
+
+static metrics_t
+metrics (void)
+{
+   metrics_t m = { 0 };
+   conn_t *c = conn_new ();
+   char *body = NULL;
+   if (http_get (c, "/metrics", NULL, NULL, NULL, &body) == 200 && body)
+   {
+      m.ok = 1;
+      for (char *l = strtok (body, "\n"); l; l = strtok (NULL, "\n"))
+      {
+         char *v = strrchr (l, ' ');
+         if (*l == '#' || !v)
+            continue;
+         double d = strtod (v + 1, NULL);
+         if (!strncmp (l, "faikin_heap_free_bytes ", 23))
+            m.heap = d;
+         else if (!strncmp (l, "faikin_heap_min_free_bytes ", 27))
+            m.heapmin = d;
+         else if (!strncmp (l, "faikin_poll_cycle_seconds_count ", 32))
+            m.cycles = d;
+         else if (!strncmp (l, "faikin_poll_cycle_seconds_bucket{le=\"1.000\"} ", 45))
+            m.under1s = d;
+         else if (!strncmp (l, "faikin_uptime_seconds ", 22))
+            m.uptime = d;
+      }
+   }
+   free (body);
+   conn_free (c);
+   return m;
+}
+
+static int
+cmp_u32 (const void *a, const void *b)
+{
+   uint32_t x = *(const uint32_t *) a,
+      y = *(const uint32_t *) b;
+   return x < y ? -1 : x > y;
+}
+
+static double
+pct (stat_t * s, double p)
+{                               // Percentile in ms, us sorted
+   if (!s->count)
+      return 0;
+   size_t i = (size_t) (p * (s->count - 1) + 0.5);
+   return s->us[i] / 1000.0;
+}
+
+int
+main (int argc, const char *argv[])
+{
+   int dashboard = 1,
+      legacy = 2,
+      api = 1,
+      ws = 0,
+      sse = 1,
+      json = 0;
+   double maxp99 = 0,
+      minrps = 0;
+   int maxmissed = -1,
+      maxerrors = -1;
+   poptContext optCon;
+   {
+      const struct poptOption optionsTable[] = {
+         {"host", 'h', POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &host, 0, "Faikin hostname", "host"},
+         {"port", 'p', POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &port, 0, "Port", "port"},
+         {"seconds", 's', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &seconds, 0, "Test duration", "seconds"},
+         {"dashboard", 'd', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &dashboard, 0, "Dashboard users (page, capabilities, web socket)", "N"},
+         {"view", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &view, 0, "Dashboard seconds per page view", "seconds"},
+         {"legacy", 'l', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &legacy, 0, "Legacy pollers", "N"},
+         {"api", 'a', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &api, 0, "REST pollers (with ETag)", "N"},
+         {"ws", 'w', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &ws, 0, "Web socket listeners", "N"},
+         {"sse", 'e', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &sse, 0, "SSE listeners", "N"},
+         {"interval", 'i', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &interval, 0, "Poller delay between requests", "ms"},
+         {"timeout", 't', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &timeout, 0, "Socket timeout", "seconds"},
+         {"json", 'j', POPT_ARG_NONE, &json, 0, "JSON report"},
+         {"max-p99", 0, POPT_ARG_DOUBLE, &maxp99, 0, "Fail if any request p99 is over this", "ms"},
+         {"min-rps", 0, POPT_ARG_DOUBLE, &minrps, 0, "Fail if total requests/s is under this", "N"},
+         {"max-missed", 0, POPT_ARG_INT, &maxmissed, 0, "Fail if more poll cycles than this are over 1s or missed", "N"},
+         {"max-errors", 0, POPT_ARG_INT, &maxerrors, 0, "Fail if more errors than this", "N"},
+         POPT_AUTOHELP {}
+      };
+
+      optCon = poptGetContext (NULL, argc, argv, optionsTable, 0);
+
+      int c;
+      if ((c = poptGetNextOpt (optCon)) < -1)
+         errx (1, "%s: %s\n", poptBadOption (optCon, POPT_BADOPTION_NOALIAS), poptStrerror (c));
+
+      if (poptPeekArg (optCon) || seconds <= 0)
+      {
+         poptPrintUsage (optCon, stderr, 0);
+         return -1;
+      }
+   }
+   for (int i = 0; i < STATS; i++)
+      pthread_mutex_init (&stat[i].mutex, NULL);
+   metrics_t before = metrics ();
+   int threads = 0;
+   pthread_t t[dashboard + legacy + api + ws + sse];
+#define	start(n,fn)	for(int i=0;i<n;i++){__atomic_add_fetch(&active,1,__ATOMIC_RELAXED);pthread_create(&t[threads++],NULL,fn,NULL);}
+   start (dashboard, dashboard_task);
+   start (legacy, legacy_task);
+   start (api, api_task);
+   start (ws, ws_task);
+   start (sse, sse_task);
+#undef start
+   uint64_t begin = now_us ();
+   sleep (seconds);
+   running = 0;
+   double elapsed = (now_us () - begin) / 1000000.0;
+   while (__atomic_load_n (&active, __ATOMIC_RELAXED))
+   {                            // Listeners may be waiting in recv
+      conn_shutdown ();
+      usleep (100000);
+   }
+   for (int i = 0; i < threads; i++)
+      pthread_join (t[i], NULL);
+   usleep (100000);             // Let the server see the closes
+   metrics_t after = metrics ();
+
+   int failed = 0;
+   double total = 0;
+   uint32_t errors = 0;
+   for (int i = 0; i < STATS; i++)
+   {
+      stat_t *s = &stat[i];
+      qsort (s->us, s->count, sizeof (*s->us), cmp_u32);
+      if (i != STAT_WS && i != STAT_SSE)
+         total += s->count;
+      errors += s->errors + s->refused;
+      if (maxp99 > 0 && pct (s, 0.99) > maxp99)
+         failed = 1;
+   }
+   double slow = 0,
+      missed = 0;
+   if (before.ok && after.ok)
+   {                            // Cycles over 1s, and seconds with no cycle at all
+      slow = (after.cycles - after.under1s) - (before.cycles - before.under1s);
+      missed = (after.uptime - before.uptime) - (after.cycles - before.cycles) - 1;
+      if (missed < 0)
+         missed = 0;
+   }
+   if (minrps > 0 && total / elapsed < minrps)
+      failed = 1;
+   if (maxmissed >= 0 && slow + missed > maxmissed)
+      failed = 1;
+   if (maxerrors >= 0 && errors > maxerrors)
+      failed = 1;
+
+   if (json)
+   {
+      printf ("{\"host\":\"%s\",\"seconds\":%.1f,\"rps\":%.1f,\"errors\":%u", host, elapsed, total / elapsed, errors);
+      for (int i = 0; i < STATS; i++)
+      {
+         stat_t *s = &stat[i];
+         printf (",\"%s\":{\"count\":%zu,\"rps\":%.1f,\"p50\":%.2f,\"p99\":%.2f,\"max\":%.2f,\"errors\":%u,\"refused\":%u,\"bytes\":%llu",
+                 s->name, s->count, s->count / elapsed, pct (s, 0.5), pct (s, 0.99), pct (s, 1), s->errors, s->refused,
+                 (unsigned long long) s->bytes);
+         if (i == STAT_WS || i == STAT_SSE)
+            printf (",\"messages\":%u,\"maxgap\":%u", s->messages, s->maxgap);
+         printf ("}");
+      }
+      if (after.ok)
+         printf (",\"heap\":%.0f,\"heapmin\":%.0f,\"heapdelta\":%.0f", after.heap, after.heapmin, after.heap - before.heap);
+      if (before.ok && after.ok)
+         printf (",\"cycles\":%.0f,\"slow\":%.0f,\"missed\":%.0f", after.cycles - before.cycles, slow, missed);
+      printf (",\"pass\":%s}\n", failed ? "false" : "true");
+   } else
+   {
+      printf ("%-13s %8s %8s %9s %9s %9s %7s %7s\n", "", "count", "req/s", "p50 ms", "p99 ms", "max ms", "errors", "refused");
+      for (int i = 0; i < STATS; i++)
+      {
+         stat_t *s = &stat[i];
+         if (!s->count && !s->errors && !s->refused)
+            continue;
+         printf ("%-13s %8zu %8.1f %9.2f %9.2f %9.2f %7u %7u", s->name, s->count, s->count / elapsed, pct (s, 0.5), pct (s, 0.99),
+                 pct (s, 1), s->errors, s->refused);
+         if (i == STAT_WS || i == STAT_SSE)
+            printf ("  %u pushed, max gap %ums", s->messages, s->maxgap);
+         printf ("\n");
+      }
+      printf ("Total %.1f req/s over %.1fs, %u errors\n", total / elapsed, elapsed, errors);
+      if (after.ok)
+         printf ("Heap free %.0f (min %.0f, change %+.0f)\n", after.heap, after.heapmin, after.heap - before.heap);
+      if (before.ok && after.ok)
+         printf ("Poll cycles %.0f, over 1s %.0f, missed %.0f\n", after.cycles - before.cycles, slow, missed);
+      else
+         printf ("No /metrics (webmetrics off?)\n");
+      if (failed)
+         printf ("FAIL\n");
+   }
+   poptFreeContext (optCon);
+   return failed;
+}
@@ -1,4 +1,4 @@
-// Daikin graph from mariadb
+// Daikin graph from mariadb, or from the faikinlog file store
 // Copyright (c) 2022 Adrian Kennard, Andrews & Arnold Limited, see LICENSE file (GPL)
 
 #include <stdio.h>
@@ -10,6 +10,8 @@
 #include <sqllib.h>
 #include <axl.h>
 #include <math.h>
+#include <ctype.h>
+#include "faikinstore.h"
 
 int debug = 0;
 
@@ -23,6 +25,7 @@ main (int argc, const char *argv[])
    const char *sqlconffile = NULL;
    const char *sqltable = "faikin";
    const char *sqlweather = "weather";
+   const char *store = NULL;
    const char *weathertag = NULL;
    const char *tag = NULL;
    const char *skip = NULL;
@@ -52,6 +55,8 @@ main (int argc, const char *argv[])
    int nolabels = 0;
    int back = 0;
    int temptop = 0;
+   int days = 1;
+   int norollup = 0;
    poptContext optCon;          // context for parsing command-line options
    {                            // POPT
       const struct poptOption optionsTable[] = {
@@ -64,7 +69,8 @@ main (int argc, const char *argv[])
          {"sql-weather", 0, POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &sqlweather, 0, "SQL weather table", "table"},
          {"weather-tag", 0, POPT_ARG_STRING, &weathertag, 0, "SQL weather tag", "tag"},
          {"sql-debug", 'v', POPT_ARG_NONE, &sqldebug, 0, "SQL Debug"},
-         {"x-size", 0, POPT_ARG_DOUBLE | POPT_ARGFLAG_SHOW_DEFAULT, &xsize, 0, "X size per hour", "pixels"},
+         {"store", 0, POPT_ARG_STRING, &store, 0, "Use file store, not SQL", "directory"},
+         {"x-size", 0, POPT_ARG_DOUBLE | POPT_ARGFLAG_SHOW_DEFAULT, &xsize, 0, "X size per hour (divided by days)", "pixels"},
          {"y-size", 0, POPT_ARG_DOUBLE | POPT_ARGFLAG_SHOW_DEFAULT, &ysize, 0, "Y size per step", "pixels"},
          {"date", 'D', POPT_ARG_STRING, &date, 0, "Date", "YYYY-MM-DD"},
          {"tag", 'i', POPT_ARG_STRING, &tag, 0, "Device ID", "tag"},
@@ -72,6 +78,8 @@ main (int argc, const char *argv[])
          {"title", 'T', POPT_ARG_STRING, &title, 0, "Title", "text"},
          {"temp-top", 0, POPT_ARG_INT, &temptop, 0, "Top temp", "C"},
          {"back", 0, POPT_ARG_INT, &back, 0, "Back days", "N"},
+         {"days", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &days, 0, "Days to show", "N"},
+         {"no-rollup", 0, POPT_ARG_NONE, &norollup, 0, "Use raw rows even for many days"},
          {"control", 'C', POPT_ARG_STRING, &control, 0, "Control", "[-]N[T/C/R]"},
          {"no-grid", 0, POPT_ARG_NONE, &nogrid, 0, "No grid lines"},
          {"no-axis", 0, POPT_ARG_NONE, &noaxis, 0, "No axis labels"},
@@ -109,6 +117,9 @@ main (int argc, const char *argv[])
    }
    if (noaxis)
       left = 0;
+   if (days < 1)
+      days = 1;
+   xsize /= days;
 
    if (control)
    {                            // PATH_INFO typically
@@ -202,14 +213,30 @@ main (int argc, const char *argv[])
       t.tm_isdst = -1;
       sod = mktime (&t);
       localtime_r (&sod, &t);
-      t.tm_mday++;
+      t.tm_mday += days;
       t.tm_isdst = -1;
       eod = mktime (&t);
       hours = (eod - sod) / 3600;
    }
 
+   // Long ranges use the hourly or daily rollup tables made by faikinlog, where values are averages (sum/n)
+   const char *datatable = sqltable;
+   int period = 0;
+   if (!norollup && !store && days >= 3)
+   {
+      period = (days >= 60 ? 86400 : 3600);
+      char *t = NULL;
+      asprintf (&t, "%s_%s", sqltable, period == 3600 ? "hour" : "day");
+      datatable = t;
+   }
+   double gap = (period ? xsize * period / 3600 * 1.5 : xsize / 30);    // Gap in trace
+
    SQL sql;
-   sql_real_connect (&sql, sqlhostname, sqlusername, sqlpassword, sqldatabase, 0, NULL, 0, 1, sqlconffile);
+   fks_rows_t *rows = NULL;     // File store, all rows loaded once
+   if (store)
+      rows = fks_load (store, tag, sod, eod + 1);
+   else
+      sql_real_connect (&sql, sqlhostname, sqlusername, sqlpassword, sqldatabase, 0, NULL, 0, 1, sqlconffile);
 
    xml_t svg = xml_tree_new ("svg");
    if (me)
@@ -232,12 +259,18 @@ main (int argc, const char *argv[])
       return xsize * (t - sod) / 3600;
    }
 
-   double tempy (SQL_RES * res, const char *field)
-   {
+   double colnum (SQL_RES * res, const char *field)
+   {                            // NAN for NULL
       char *val = sql_col (res, field);
       if (!val || !*val)
          return NAN;
-      double temp = strtod (val, NULL);
+      return strtod (val, NULL);
+   }
+
+   double tempy (double temp)
+   {
+      if (isnan (temp))
+         return NAN;
       if (isnan (mintemp) || mintemp > temp)
          mintemp = temp;
       if (isnan (maxtemp) || maxtemp < temp)
@@ -245,6 +278,84 @@ main (int argc, const char *argv[])
       return temp * ysize;
    }
 
+   char *rolled (const char *t, const char *expr)
+   {                            // Expression for table, fields (leading or `quoted`) are averages on a rollup table
+      if (!period || t != datatable)
+         return strdup (expr);
+      char *out;
+      size_t len;
+      FILE *f = open_memstream (&out, &len);
+      const char *p = expr;
+      const char *e = p;
+      while (isalnum (*e))
+         e++;
+      if (islower (*p) && *e != '(')
+      {
+         fprintf (f, "(`sum%.*s`/`n%.*s`)", (int) (e - p), p, (int) (e - p), p);
+         p = e;
+      }
+      while (*p)
+      {
+         if (*p == '`' && (e = strchr (p + 1, '`')))
+         {
+            fprintf (f, "(`sum%.*s`/`n%.*s`)", (int) (e - p - 1), p + 1, (int) (e - p - 1), p + 1);
+            p = e + 1;
+         } else
+            fputc (*p++, f);
+      }
+      fclose (f);
+      return out;
+   }
+
+   double col (const char *prefix, const char *name, int row)
+   {                            // Store value, NAN for NULL, enums as a number as SQL does for a char(1)
+      char field[50];
+      int c = fks_colindex (field, snprintf (field, sizeof (field), "%s%s", prefix, name));
+      if (c < 0 || !rows->val[c])
+         return NAN;
+      double v = rows->val[c][row];
+      if (fks_cols[c].isenum && !isnan (v))
+         v = (isdigit ((int) v) ? v - '0' : 0);
+      return v;
+   }
+
+   int fetch (const char *table, const char *tag, const char *a, double (*ca) (const char *, int), const char *b,
+              double (*cb) (const char *, int), double **x)
+   {                            // Rows of x, a, b (trusted expressions, b optional) in time order, as x[n*3], caller frees
+      // For the store, ca and cb are the C versions of a and b, or NULL if just a field name
+      SQL_RES *res = NULL;
+      int max = (rows ? rows->rows : 0);
+      if (!rows)
+      {
+         res = sql_safe_query_store_free (&sql,
+                                          sql_printf
+                                          ("SELECT `utc`,%s AS `a`,%s AS `b` FROM `%#S` WHERE `tag`=%#s AND `utc`>=%#U AND `utc`<=%#U ORDER BY `utc`",
+                                           a, b ? : "NULL", table, tag, sod, eod));
+         max = sql_num_rows (res);
+      }
+      double *v = malloc (3 * (max + 1) * sizeof (*v));
+      int n = 0;
+      if (rows)
+         for (n = 0; n < max; n++)
+         {
+            v[n * 3] = xsize * (rows->utc[n] - sod) / 3600;
+            v[n * 3 + 1] = (ca ? ca ("", n) : col ("", a, n));
+            v[n * 3 + 2] = (!b ? NAN : cb ? cb ("", n) : col ("", b, n));
+      } else
+      {
+         while (n < max && sql_fetch_row (res))
+         {
+            v[n * 3] = utcx (res);
+            v[n * 3 + 1] = colnum (res, "a");
+            v[n * 3 + 2] = colnum (res, "b");
+            n++;
+         }
+         sql_free_result (res);
+      }
+      *x = v;
+      return n;
+   }
+
    void addpos (FILE * f, char *m, double x, double y)
    {
       if (isnan (x) || isnan (y))
@@ -253,8 +364,9 @@ main (int argc, const char *argv[])
       *m = 'L';
    }
 
-   const char *range (xml_t g, const char *table, const char *tag, const char *field, const char *colour, int group)
-   {                            // Plot a temp range based on min/max of field
+   const char *range (xml_t g, const char *table, const char *tag, const char *field, double (*calc) (const char *, int),
+                      const char *colour, int group)
+   {                            // Plot a temp range based on min/max of field, calc being its C version for the store
       if (!colour || !*colour)
          return NULL;
       char *path;
@@ -262,38 +374,70 @@ main (int argc, const char *argv[])
       FILE *f = open_memstream (&path, &len);
       char m = 'M';
       double last;
-      SQL_RES *select (const char *order)
+      int n = 0;
+      double *v;                // x, max, min per group, in time order
+      if (rows)
+      {                         // Group by time as SQL does by substring of utc
+         int secs = (group <= 10 ? 86400 : group <= 13 ? 3600 : group <= 15 ? 600 : group <= 16 ? 60 : 1);
+         v = malloc (3 * (rows->rows + 1) * sizeof (*v));
+         time_t bucket = 0;
+         for (int r = 0; r < rows->rows; r++)
+         {
+            time_t b = rows->utc[r] - rows->utc[r] % secs;
+            if (!n || b != bucket)
+            {
+               bucket = b;
+               v[n * 3] = xsize * (rows->utc[r] - sod) / 3600;
+               v[n * 3 + 1] = v[n * 3 + 2] = NAN;
+               n++;
+            }
+            double *g = v + (n - 1) * 3;
+            double t = (calc ? calc ("max", r) : col ("max", field, r));
+            if (!isnan (t) && (isnan (g[1]) || t > g[1]))
+               g[1] = t;
+            t = (calc ? calc ("min", r) : col ("min", field, r));
+            if (!isnan (t) && (isnan (g[2]) || t < g[2]))
+               g[2] = t;
+         }
+      } else
       {                         // Trust field name
-         return sql_safe_query_store_free (&sql,
-                                           sql_printf
-                                           ("SELECT min(`utc`) AS `utc`,max(max%s) AS `max`,min(min%s) AS `min` FROM `%#S` WHERE `tag`=%#s AND `utc`>=%#U AND `utc`<=%#U GROUP BY substring(`utc`,1,%d) ORDER BY `utc` %s",
-                                            field, field, table, tag, sod, eod, group, order));
+         SQL_RES *res = sql_safe_query_store_free (&sql,
+                                                   sql_printf
+                                                   ("SELECT min(`utc`) AS `utc`,max(max%s) AS `max`,min(min%s) AS `min` FROM `%#S` WHERE `tag`=%#s AND `utc`>=%#U AND `utc`<=%#U GROUP BY substring(`utc`,1,%d) ORDER BY `utc`",
+                                                    field, field, table, tag, sod, eod, group));
+         int max = sql_num_rows (res);
+         v = malloc (3 * (max + 1) * sizeof (*v));
+         while (n < max && sql_fetch_row (res))
+         {
+            v[n * 3] = utcx (res);
+            v[n * 3 + 1] = colnum (res, "max");
+            v[n * 3 + 2] = colnum (res, "min");
+            n++;
+         }
+         sql_free_result (res);
       }
       // Forward
       last = NAN;
-      SQL_RES *res = select ("asc");
-      while (sql_fetch_row (res))
+      for (int i = 0; i < n; i++)
       {
-         double t = tempy (res, "max");
-         addpos (f, &m, utcx (res), isnan (last) || t > last ? t : last);
+         double t = tempy (v[i * 3 + 1]);
+         addpos (f, &m, v[i * 3], isnan (last) || t > last ? t : last);
          last = t;
       }
-      sql_free_result (res);
       // Reverse
-      res = select ("desc");
       last = NAN;
       double lastx = NAN;
-      while (sql_fetch_row (res))
+      for (int i = n; i--;)
       {
-         double t = tempy (res, "min");
+         double t = tempy (v[i * 3 + 2]);
          if (!isnan (lastx))
             addpos (f, &m, lastx, isnan (last) || t < last ? t : last);
          last = t;
-         lastx = utcx (res);
+         lastx = v[i * 3];
       }
       if (!isnan (lastx))
          addpos (f, &m, lastx, last);
-      sql_free_result (res);
+      free (v);
       fclose (f);
       if (*path)
       {
@@ -307,8 +451,9 @@ main (int argc, const char *argv[])
       free (path);
       return colour;
    }
-   const char *trace (xml_t g, const char *table, const char *tag, const char *field, const char *width, const char *colour)
-   {                            // Plot trace
+   const char *trace (xml_t g, const char *table, const char *tag, const char *field, double (*calc) (const char *, int),
+                      const char *width, double (*wcalc) (const char *, int), const char *colour)
+   {                            // Plot trace, width NULL for 1, calc and wcalc being C versions for the store
       if (!colour || !*colour)
          return NULL;
       char *path = NULL;
@@ -332,16 +477,19 @@ main (int argc, const char *argv[])
          free (path);
       }
       // Forward (trust the trace field name)
-      SQL_RES *res =
-         sql_safe_query_store_free (&sql,
-                                    sql_printf
-                                    ("SELECT `utc`,%s AS `val`,%s AS `w` FROM `%#S` WHERE `tag`=%#s AND `utc`>=%#U AND `utc`<=%#U ORDER BY `utc`",
-                                     field, width, table, tag, sod, eod));
-      while (sql_fetch_row (res))
+      char *val = rolled (table, field);
+      if (period && table == datatable)
+         width = NULL;
+      double *v;
+      int n = fetch (table, tag, val, calc, width, wcalc, &v);
+      free (val);
+      for (int i = 0; i < n; i++)
       {
-         double x = utcx (res);
-         double y = tempy (res, "val");
-         double w = strtod (sql_colz (res, "w"), NULL);
+         double x = v[i * 3];
+         double y = tempy (v[i * 3 + 1]);
+         double w = (width ? v[i * 3 + 2] : 1);
+         if (isnan (w))
+            w = 0;
          if (isnan (lastw) || w != lastw)
          {
             if (f)
@@ -354,41 +502,60 @@ main (int argc, const char *argv[])
             m = 'M';
             lastx = NAN;
          }
-         if (isnan (y) || isnan (lastx) || x - lastx > xsize / 30)
+         if (isnan (y) || isnan (lastx) || x - lastx > gap)
             m = 'M';            // gap
          addpos (f, &m, x, y);
          lastx = x;
       }
-      sql_free_result (res);
+      free (v);
       if (f)
          endpath ();
       return colour;
    }
-   const char *rangetrace (xml_t g, xml_t g2, const char *table, const char *tag, const char *field, const char *width,
+   const char *rangetrace (xml_t g, xml_t g2, const char *table, const char *tag, const char *field,
+                           double (*calc) (const char *, int), const char *width, double (*wcalc) (const char *, int),
                            const char *colour)
    {                            // Plot a temp range based on min/max of field and trace
-      const char *col = range (g, table, tag, field, colour, 15);
-      trace (g2, table, tag, field, width, colour);
-      return col;
+      const char *c = range (g, table, tag, field, calc, colour, 15);
+      trace (g2, table, tag, field, calc, width, wcalc, colour);
+      return c;
    }
 
-   targetcol = range (ranges, sqltable, tag, "target", targetcol, 19);
+   // C versions of the SQL expressions, for the store, given the field prefix (min, max, or none)
+   double target (const char *prefix, int r)
+   {                            // IF(mintarget=maxtarget,mintarget,NULL)
+      double min = col ("min", "target", r);
+      return min == col ("max", "target", r) ? min : NAN;
+   }
+   double fanrpm (const char *prefix, int r)
+   {                            // fanrpm/100
+      return col (prefix, "fanrpm", r) / 100;
+   }
+   double envwidth (const char *prefix, int r)
+   {                            // GREATEST(COALESCE(round((`fanrpm`-900)/100),`fan`)/2.0,0.5)
+      double w = col ("", "fanrpm", r);
+      w = (isnan (w) ? col ("", "fan", r) : round ((w - 900) / 100)) / 2.0;
+      return isnan (w) || w > 0.5 ? w : 0.5;
+   }
+
+   targetcol = range (ranges, datatable, tag, "target", NULL, targetcol, 19);
    if (targetcol)
    {
-      trace (traces, sqltable, tag, "IF(mintarget=maxtarget,mintarget,NULL)", "1", targetcol);
+      trace (traces, datatable, tag, "IF(mintarget=maxtarget,mintarget,NULL)", target, NULL, NULL, targetcol);
       tempcol = NULL;
    }
-   fanrpmcol = rangetrace (ranges, traces, sqltable, tag, "fanrpm/100", "1", fanrpmcol);
-   tempcol = rangetrace (ranges, traces, sqltable, tag, "temp", "1", tempcol);
-   if (sqlweather && weathertag)
-      outsidecol = trace (traces, sqlweather, weathertag, "tempc", "1", outsidecol);
+   fanrpmcol = rangetrace (ranges, traces, datatable, tag, "fanrpm/100", fanrpm, NULL, NULL, fanrpmcol);
+   tempcol = rangetrace (ranges, traces, datatable, tag, "temp", NULL, NULL, NULL, tempcol);
+   if (sqlweather && weathertag && !store)
+      outsidecol = trace (traces, sqlweather, weathertag, "tempc", NULL, NULL, NULL, outsidecol);
    else
-      outsidecol = rangetrace (ranges, traces, sqltable, tag, "outside", "1", outsidecol);
-   liquidcol = rangetrace (ranges, traces, sqltable, tag, "liquid", "1", liquidcol);
-   inletcol = rangetrace (ranges, traces, sqltable, tag, "inlet", "1", inletcol);
-   homecol = rangetrace (ranges, traces, sqltable, tag, "home", "1", homecol);
+      outsidecol = rangetrace (ranges, traces, datatable, tag, "outside", NULL, NULL, NULL, outsidecol);
+   liquidcol = rangetrace (ranges, traces, datatable, tag, "liquid", NULL, NULL, NULL, liquidcol);
+   inletcol = rangetrace (ranges, traces, datatable, tag, "inlet", NULL, NULL, NULL, inletcol);
+   homecol = rangetrace (ranges, traces, datatable, tag, "home", NULL, NULL, NULL, homecol);
    envcol =
-      rangetrace (ranges, traces, sqltable, tag, "env", "GREATEST(COALESCE(round((`fanrpm`-900)/100),`fan`)/2.0,0.5)", envcol);
+      rangetrace (ranges, traces, datatable, tag, "env", NULL, "GREATEST(COALESCE(round((`fanrpm`-900)/100),`fan`)/2.0,0.5)",
+                  envwidth, envcol);
 
    // Set range of temps shown
    if (isnan (mintemp))
@@ -402,19 +569,19 @@ main (int argc, const char *argv[])
    maxtemp = ceil (maxtemp) + 0.5;
 
    // Bands (booleans)
-   const char *band (const char *table, const char *tag, const char *field, const char *colour)
-   {
+   const char *band (const char *table, const char *tag, const char *field, double (*calc) (const char *, int),
+                     const char *colour)
+   {                            // Plot a band where field (0 to 1), calc being its C version for the store
       if (!colour || !*colour)
          return NULL;
       char *path;
       size_t len;
       FILE *f = open_memstream (&path, &len);
       char m = 'M';
-      SQL_RES *res =
-         sql_safe_query_store_free (&sql,
-                                    sql_printf
-                                    ("SELECT `utc`,%s AS `val` FROM `%#S` WHERE `tag`=%#s AND `utc`>=%#U AND `utc`<=%#U ORDER BY `utc`",
-                                     field, table, tag, sod, eod));
+      char *val = rolled (table, field);
+      double *vals;
+      int n = fetch (table, tag, val, calc, NULL, NULL, &vals);
+      free (val);
       double lastx = NAN;
       double startx = NAN;
       void end (double x, double v)
@@ -427,11 +594,11 @@ main (int argc, const char *argv[])
          addpos (f, &m, endx, ysize * mintemp);
          startx = NAN;
       }
-      while (sql_fetch_row (res))
+      for (int i = 0; i < n; i++)
       {
-         double x = utcx (res);
-         double v = strtod (sql_colz (res, "val"), NULL);
-         if (v < 0)
+         double x = vals[i * 3];
+         double v = vals[i * 3 + 1];
+         if (isnan (v) || v < 0)
             v = 0;
          if (v > 1)
             v = 1;
@@ -446,7 +613,7 @@ main (int argc, const char *argv[])
       }
       if (!isnan (startx))
          end (lastx, 1);
-      sql_free_result (res);
+      free (vals);
       fclose (f);
       if (*path)
       {
@@ -460,11 +627,38 @@ main (int argc, const char *argv[])
       free (path);
       return colour;
    }
-   heatcol = band (sqltable, tag, "least(`power`,`heat`,1-COALESCE(`slave`,0))", heatcol);
-   coolcol = band (sqltable, tag, "least(`power`,1-`heat`,1-COALESCE(`slave`,0),1-COALESCE(`antifreeze`,0))", coolcol);
-   antifreezecol = band (sqltable, tag, "least(`power`,COALESCE(`antifreeze`,0))", antifreezecol);
-   slavecol = band (sqltable, tag, "least(`power`,COALESCE(`slave`,0))", slavecol);
+   double least (double a, double b)
+   {                            // As SQL, NULL if either NULL
+      return isnan (a) || isnan (b) ? NAN : a < b ? a : b;
+   }
+   double zero (double v)
+   {                            // COALESCE(v,0)
+      return isnan (v) ? 0 : v;
+   }
+   double heat (const char *prefix, int r)
+   {                            // least(`power`,`heat`,1-COALESCE(`slave`,0))
+      return least (least (col ("", "power", r), col ("", "heat", r)), 1 - zero (col ("", "slave", r)));
+   }
+   double cool (const char *prefix, int r)
+   {                            // least(`power`,1-`heat`,1-COALESCE(`slave`,0),1-COALESCE(`antifreeze`,0))
+      return least (least (least (col ("", "power", r), 1 - col ("", "heat", r)), 1 - zero (col ("", "slave", r))),
+                    1 - zero (col ("", "antifreeze", r)));
+   }
+   double antifreeze (const char *prefix, int r)
+   {                            // least(`power`,COALESCE(`antifreeze`,0))
+      return least (col ("", "power", r), zero (col ("", "antifreeze", r)));
+   }
+   double slave (const char *prefix, int r)
+   {                            // least(`power`,COALESCE(`slave`,0))
+      return least (col ("", "power", r), zero (col ("", "slave", r)));
+   }
+   heatcol = band (datatable, tag, "least(`power`,`heat`,1-COALESCE(`slave`,0))", heat, heatcol);
+   coolcol =
+      band (datatable, tag, "least(`power`,1-`heat`,1-COALESCE(`slave`,0),1-COALESCE(`antifreeze`,0))", cool, coolcol);
+   antifreezecol = band (datatable, tag, "least(`power`,COALESCE(`antifreeze`,0))", antifreeze, antifreezecol);
+   slavecol = band (datatable, tag, "least(`power`,COALESCE(`slave`,0))", slave, slavecol);
 
+   int step = (days == 1 ? 1 : days <= 31 ? 24 : 24 * 7);        // Hours per grid line
    // Grid
    if (!nogrid)
    {
@@ -472,7 +666,7 @@ main (int argc, const char *argv[])
       size_t len;
       FILE *f = open_memstream (&path, &len);
       char m;
-      for (int h = 0; h <= hours; h++)
+      for (int h = 0; h <= hours; h += step)
       {
          m = 'M';
          addpos (f, &m, xsize * h, ysize * mintemp);
@@ -504,12 +698,12 @@ main (int argc, const char *argv[])
       double y = maxtemp;
       if (mintemp > 0)
          y = maxtemp - mintemp;
-      for (int h = 0; h < hours; h++)
+      for (int h = 0; h < hours; h += step)
       {
          struct tm tm;
          time_t when = sod + 3600 * h;
          localtime_r (&when, &tm);
-         xml_t t = xml_addf (axis, "+text", "%02d", tm.tm_hour);
+         xml_t t = xml_addf (axis, "+text", "%02d", step == 1 ? tm.tm_hour : tm.tm_mday);
          xml_addf (t, "@x", "%.2f", left + xsize * h + 1);
          xml_addf (t, "@y", "%.2f", ysize * y - 1);
       }
@@ -573,7 +767,7 @@ main (int argc, const char *argv[])
             y += 17;
             struct tm tm;
             localtime_r (&sod, &tm);
-            tm.tm_mday--;
+            tm.tm_mday -= days;
             tm.tm_isdst = 0;
             mktime (&tm);
             xml_t t = xml_element_add (labels, "a");
@@ -595,7 +789,7 @@ main (int argc, const char *argv[])
             }
             t = xml_element_add (labels, "a");
             localtime_r (&sod, &tm);
-            tm.tm_mday++;
+            tm.tm_mday += days;
             tm.tm_isdst = 0;
             mktime (&tm);
             xml_addf (t, "@href", "%s/%04d-%02d-%02d/%s/%s", href, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tag, skip);
@@ -632,7 +826,10 @@ main (int argc, const char *argv[])
    // Write out
    xml_write (stdout, svg);
    xml_tree_delete (svg);
-   sql_close (&sql);
+   if (rows)
+      fks_free (rows);
+   else
+      sql_close (&sql);
    poptFreeContext (optCon);
    return 0;
 }
@@ -0,0 +1,625 @@
+// Faikin report JSON to faikinlog columns, see faikinjson.h
+// Copyright (c) 2022 Adrian Kennard, Andrews & Arnold Limited, see LICENSE file (GPL)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "faikinjson.h"
+
+#define	FIELDHASH	256     // Power of 2, well over the number of fields
+#define	MAXDEPTH	32      // Nesting allowed in skipped values
+#define	MAXNUM		63      // Longer numbers are not taken as numbers
+
+static const struct
+{                               // Fields as sent, and the first column each goes in
+   const char *name;
+   uint8_t len;
+   uint8_t type;                // b, i, t, r, e as acextras.m
+   uint8_t col;
+} fields[] = {
+#define	b(name)	{#name,sizeof(#name)-1,'b',col_##name},
+#define	i(name)	{#name,sizeof(#name)-1,'i',col_min##name},
+#define	t(name)	{#name,sizeof(#name)-1,'t',col_min##name},
+#define	r(name)	{#name,sizeof(#name)-1,'r',col_min##name},
+#define	e(name,t)	{#name,sizeof(#name)-1,'e',col_##name},
+#include "acextras.m"
+};
+
+#define	FIELDS	(sizeof(fields)/sizeof(*fields))
+
+_Static_assert (FIELDS * 2 <= FIELDHASH, "FIELDHASH too small");
+
+static unsigned char fieldhash[FIELDHASH];      // Key hash to fields index + 1
+static pthread_once_t fieldhash_once = PTHREAD_ONCE_INIT;
+static char *colsql[COLS];      // ,`name` for each column
+static uint8_t colsqllen[COLS];
+static size_t colsqltotal;
+
+static unsigned int
+hashof (const char *name, size_t len)
+{                               // FNV-1a
+   unsigned int h = 2166136261U;
+   while (len--)
+      h = (h ^ (unsigned char) *name++) * 16777619U;
+   return h;
+}
+
+static void
+fieldhash_init (void)
+{
+   for (unsigned int f = 0; f < FIELDS; f++)
+   {
+      unsigned int h = hashof (fields[f].name, fields[f].len);
+      while (fieldhash[h & (FIELDHASH - 1)])
+         h++;
+      fieldhash[h & (FIELDHASH - 1)] = f + 1;
+   }
+   for (int c = 0; c < COLS; c++)
+      colsqltotal += (colsqllen[c] = asprintf (&colsql[c], ",`%s`", fks_cols[c].name));
+}
+
+static int
+field (const char *key, size_t len)
+{                               // Field for key, or -1
+   unsigned int h = hashof (key, len);
+   int f;
+   while ((f = fieldhash[h & (FIELDHASH - 1)]))
+   {
+      if (fields[f - 1].len == len && !memcmp (fields[f - 1].name, key, len))
+         return f - 1;
+      h++;
+   }
+   return -1;
+}
+
+typedef struct
+{
+   const char *p,
+    *e;
+} scan_t;
+
+static void
+ws (scan_t * s)
+{
+   while (s->p < s->e && (*s->p == ' ' || *s->p == '\t' || *s->p == '\n' || *s->p == '\r'))
+      s->p++;
+}
+
+static int
+isdig (scan_t * s)
+{
+   return s->p < s->e && *s->p >= '0' && *s->p <= '9';
+}
+
+static int
+ishex (char c)
+{
+   return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+static int
+number (scan_t * s)
+{                               // Skip a JSON number, 0 if not one
+   if (s->p < s->e && *s->p == '-')
+      s->p++;
+   if (!isdig (s))
+      return 0;
+   if (*s->p++ != '0')
+      while (isdig (s))
+         s->p++;
+   if (s->p < s->e && *s->p == '.')
+   {
+      s->p++;
+      if (!isdig (s))
+         return 0;
+      while (isdig (s))
+         s->p++;
+   }
+   if (s->p < s->e && (*s->p == 'e' || *s->p == 'E'))
+   {
+      s->p++;
+      if (s->p < s->e && (*s->p == '+' || *s->p == '-'))
+         s->p++;
+      if (!isdig (s))
+         return 0;
+      while (isdig (s))
+         s->p++;
+   }
+   return 1;
+}
+
+static const char *
+string (scan_t * s, const char **start, size_t *len)
+{                               // Skip a string, giving its content as sent (escapes not decoded)
+   if (s->p >= s->e || *s->p != '"')
+      return "Expected string";
+   const char *q = ++s->p;
+   while (s->p < s->e && *s->p != '"')
+   {
+      if (*s->p < ' ')
+         return "Control character in string";
+      if (*s->p++ != '\\')
+         continue;
+      if (s->p >= s->e)
+         break;
+      char c = *s->p++;
+      if (c == 'u')
+      {
+         if (s->e - s->p < 4 || !ishex (s->p[0]) || !ishex (s->p[1]) || !ishex (s->p[2]) || !ishex (s->p[3]))
+            return "Bad \\u escape";
+         s->p += 4;
+      } else if (!strchr ("\"\\/bfnrt", c) || !c)
+         return "Bad escape";
+   }
+   if (s->p >= s->e)
+      return "Unterminated string";
+   if (start)
+      *start = q;
+   if (len)
+      *len = s->p - q;
+   s->p++;
+   return NULL;
+}
+
+static int
+literal (scan_t * s, const char *word)
+{                               // Skip true, false, or null
+   size_t l = strlen (word);
+   if ((size_t) (s->e - s->p) < l || memcmp (s->p, word, l))
+      return 0;
+   s->p += l;
+   return 1;
+}
+
+static const char *
+skip (scan_t * s, int depth)
+{                               // Skip any value
+   if (depth > MAXDEPTH)
+      return "Too deep";
+   if (s->p >= s->e)
+      return "Expected value";
+   char close = 0;
+   switch (*s->p)
+   {
+   case '"':
+      return string (s, NULL, NULL);
+   case '{':
+      close = '}';
+      break;
+   case '[':
+      close = ']';
+      break;
+   case 't':
+      return literal (s, "true") ? NULL : "Bad value";
+   case 'f':
+      return literal (s, "false") ? NULL : "Bad value";
+   case 'n':
+      return literal (s, "null") ? NULL : "Bad value";
+   default:
+      return number (s) ? NULL : "Bad number";
+   }
+   s->p++;
+   ws (s);
+   if (s->p < s->e && *s->p == close)
+   {
+      s->p++;
+      return NULL;
+   }
+   while (1)
+   {
+      const char *er;
+      if (close == '}')
+      {
+         if ((er = string (s, NULL, NULL)))
+            return er;
+         ws (s);
+         if (s->p >= s->e || *s->p++ != ':')
+            return "Expected :";
+         ws (s);
+      }
+      if ((er = skip (s, depth + 1)))
+         return er;
+      ws (s);
+      if (s->p >= s->e)
+         break;
+      if (*s->p == close)
+      {
+         s->p++;
+         return NULL;
+      }
+      if (*s->p++ != ',')
+         break;
+      ws (s);
+   }
+   return close == '}' ? "Expected , or }" : "Expected , or ]";
+}
+
+static int
+num (scan_t * s, const char **start, uint8_t * len)
+{                               // Skip a number, giving where it is, 0 if not a number (s not moved)
+   const char *q = s->p;
+   if (s->p >= s->e || (*s->p != '-' && (*s->p < '0' || *s->p > '9')) || !number (s) || s->p - q > MAXNUM)
+   {
+      s->p = q;
+      return 0;
+   }
+   *start = q;
+   *len = s->p - q;
+   return 1;
+}
+
+static inline void
+set (fkj_t * j, int c, const char *p, uint8_t len)
+{
+   j->have[c / 64] |= (1ULL << (c % 64));
+   j->num[c] = p;
+   j->len[c] = len;
+}
+
+static const char *
+range (scan_t * s, fkj_t * j, int c, int n)
+{                               // A number, or array of n numbers, n=3 is min/value/max, n=2 is min/max
+   const char *p[3];
+   uint8_t l[3];
+   if (num (s, p, l))
+   {
+      for (int i = 0; i < n; i++)
+         set (j, c + i, p[0], l[0]);
+      return NULL;
+   }
+   if (s->p >= s->e || *s->p != '[')
+      return skip (s, 1);
+   s->p++;
+   ws (s);
+   int count = 0,
+      ok = 1;
+   if (s->p < s->e && *s->p == ']')
+      ok = 0;
+   else
+      while (1)
+      {
+         if (count < n && num (s, p + count, l + count))
+            count++;
+         else
+         {
+            const char *er = skip (s, 2);
+            if (er)
+               return er;
+            ok = 0;
+         }
+         ws (s);
+         if (s->p < s->e && *s->p == ',')
+         {
+            s->p++;
+            ws (s);
+            continue;
+         }
+         break;
+      }
+   if (s->p >= s->e || *s->p++ != ']')
+      return "Expected , or ]";
+   if (ok && count == n)
+      for (int i = 0; i < n; i++)
+         set (j, c + i, p[i], l[i]);
+   return NULL;
+}
+
+static int
+unescape (const char *p, size_t len)
+{                               // First character of a string as sent, 0 if empty, -1 if not one byte
+   if (!len)
+      return 0;
+   if (*p != '\\')
+      return *p;
+   switch (p[1])
+   {
+   case 'b':
+      return '\b';
+   case 'f':
+      return '\f';
+   case 'n':
+      return '\n';
+   case 'r':
+      return '\r';
+   case 't':
+      return '\t';
+   case 'u':
+      {
+         int c = strtol (strndupa (p + 2, 4), NULL, 16);
+         return c && c < 0x80 ? c : -1;
+      }
+   }
+   return p[1];
+}
+
+static time_t
+timestamp (const char *p, size_t len)
+{                               // YYYY-MM-DDTHH:MM:SSZ, 0 if not
+   static const char format[] = "0000-00-00T00:00:00Z";
+   if (len != sizeof (format) - 1)
+      return 0;
+   for (unsigned int i = 0; i < len; i++)
+      if (format[i] == '0' ? p[i] < '0' || p[i] > '9' : p[i] != format[i])
+         return 0;
+#define	d2(i)	((p[i]-'0')*10+p[i+1]-'0')
+   int y = d2 (0) * 100 + d2 (2),
+      m = d2 (5),
+      d = d2 (8),
+      H = d2 (11),
+      M = d2 (14),
+      S = d2 (17);
+#undef d2
+   if (m < 1 || m > 12 || d < 1 || d > 31 || H > 23 || M > 59 || S > 60)
+      return 0;
+   // Days from 1970-01-01, years starting in March so the leap day is last
+   if (m <= 2)
+      y--;
+   int era = y / 400,
+      yoe = y - era * 400,
+      doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1,
+      doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+   return ((time_t) era * 146097 + doe - 719468) * 86400 + H * 3600 + M * 60 + S;
+}
+
+const char *
+fkj_parse (fkj_t * j, const char *json, size_t len)
+{
+   pthread_once (&fieldhash_once, fieldhash_init);
+   memset (j->have, 0, sizeof (j->have));
+   j->ts = 0;
+   j->backfill = 0;
+   scan_t s = {.p = json,.e = json + len };
+   const char *er = NULL;
+   ws (&s);
+   if (s.p >= s.e || *s.p++ != '{')
+      return "Expected {";
+   ws (&s);
+   if (s.p < s.e && *s.p == '}')
+      s.p++;
+   else
+      while (1)
+      {
+         const char *key;
+         size_t keylen;
+         if ((er = string (&s, &key, &keylen)))
+            return er;
+         ws (&s);
+         if (s.p >= s.e || *s.p++ != ':')
+            return "Expected :";
+         ws (&s);
+         int f = field (key, keylen);
+         if (f >= 0 && (j->have[fields[f].col / 64] & (1ULL << (fields[f].col % 64))))
+            f = -1;             // Repeated, first one counts
+         if (f >= 0)
+         {
+            int c = fields[f].col;
+            switch (fields[f].type)
+            {
+            case 'b':
+               if (literal (&s, "true"))
+                  set (j, c, "1", 1);
+               else if (literal (&s, "false"))
+                  set (j, c, "0", 1);
+               else
+               {
+                  const char *p;
+                  uint8_t l;
+                  if (num (&s, &p, &l))
+                     set (j, c, p, l);
+                  else
+                  {
+                     er = skip (&s, 1);
+                     set (j, c, NULL, 0);
+                  }
+               }
+               break;
+            case 'i':
+            case 't':
+               er = range (&s, j, c, 3);
+               break;
+            case 'r':
+               er = range (&s, j, c, 2);
+               break;
+            case 'e':
+               if (s.p < s.e && *s.p == '"')
+               {
+                  const char *p;
+                  size_t l;
+                  if (!(er = string (&s, &p, &l)))
+                  {
+                     int ch = unescape (p, l);
+                     if (ch >= 0)
+                        set (j, c, NULL, ch);
+                  }
+               } else
+                  er = skip (&s, 1);
+               break;
+            }
+         } else if (keylen == 2 && !memcmp (key, "ts", 2) && s.p < s.e && *s.p == '"')
+         {                      // Device timestamp, e.g. 2024-01-02T03:04:05Z
+            const char *p;
+            size_t l;
+            if (!(er = string (&s, &p, &l)) && !j->ts)
+               j->ts = timestamp (p, l);
+         } else if (keylen == 8 && !memcmp (key, "backfill", 8) && literal (&s, "true"))
+            j->backfill = 1;
+         else
+            er = skip (&s, 1);
+         if (er)
+            return er;
+         ws (&s);
+         if (s.p < s.e && *s.p == ',')
+         {
+            s.p++;
+            ws (&s);
+            continue;
+         }
+         if (s.p >= s.e || *s.p++ != '}')
+            return "Expected , or }";
+         break;
+      }
+   ws (&s);
+   if (s.p < s.e)
+      return "Extra after JSON";
+   return NULL;
+}
+
+int
+fkj_has (const fkj_t * j, int c)
+{
+   return (j->have[c / 64] >> (c % 64)) & 1;
+}
+
+double
+fkj_val (const fkj_t * j, int c)
+{
+   if (!fkj_has (j, c))
+      return NAN;
+   if (fks_cols[c].isenum)
+      return j->len[c] ? j->len[c] : NAN;
+   if (!j->num[c])
+      return NAN;
+   {                            // Up to 15 digits, no exponent, is exactly digits / 10^places, as strtod would give
+      static const double pow10[] = { 1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15 };
+      const char *p = j->num[c],
+         *e = p + j->len[c];
+      int neg = (*p == '-');
+      p += neg;
+      int64_t v = 0;
+      int digits = 0,
+         places = -1;
+      for (; p < e && digits <= 15; p++)
+         if (*p == '.' && places < 0)
+            places = 0;
+         else if (*p >= '0' && *p <= '9')
+         {
+            v = v * 10 + *p - '0';
+            digits++;
+            if (places >= 0)
+               places++;
+         } else
+            break;
+      if (p == e && digits <= 15)
+         return (neg ? -v : v) / pow10[places < 0 ? 0 : places];
+   }
+   char n[MAXNUM + 1];
+   memcpy (n, j->num[c], j->len[c]);
+   n[j->len[c]] = 0;
+   return strtod (n, NULL);
+}
+
+static char *
+reserve (fkj_buf_t * b, size_t len)
+{                               // Empty, with room for len and a null
+   if (len >= b->size)
+      b->buf = realloc (b->buf, b->size = len + 1024);
+   b->len = 0;
+   return b->buf;
+}
+
+static char *
+quote (char *p, const char *s, size_t len)
+{                               // Quoted, escaped as mysql_real_escape_string, at most len * 2 + 2
+   *p++ = '\'';
+   while (len--)
+   {
+      char c = *s++;
+      switch (c)
+      {
+      case 0:
+         c = '0';
+         break;
+      case '\n':
+         c = 'n';
+         break;
+      case '\r':
+         c = 'r';
+         break;
+      case 0x1A:
+         c = 'Z';
+         break;
+      case '\\':
+      case '\'':
+      case '"':
+         break;
+      default:
+         *p++ = c;
+         continue;
+      }
+      *p++ = '\\';
+      *p++ = c;
+   }
+   *p++ = '\'';
+   return p;
+}
+
+static inline char *
+copy (char *p, const char *s, int len)
+{                               // Short, where memcpy ends up as a rep movs that costs more than the copy
+   while (len--)
+      *p++ = *s++;
+   return p;
+}
+
+static inline void
+d2 (char *p, int v)
+{
+   p[0] = '0' + v / 10;
+   p[1] = '0' + v % 10;
+}
+
+void
+fkj_sql (const fkj_t * j, const char *tag, time_t utc, fkj_buf_t * cols, fkj_buf_t * vals)
+{
+   pthread_once (&fieldhash_once, fieldhash_init);
+   size_t taglen = strlen (tag);
+   char *c = reserve (cols, colsqltotal + 11),
+      *v = reserve (vals, taglen * 2 + 25 + COLS * (MAXNUM + 1) + 1);
+   memcpy (c, "`tag`,`utc`", 11);
+   c += 11;
+   *v++ = '(';
+   v = quote (v, tag, taglen);
+   struct tm tm;
+   gmtime_r (&utc, &tm);
+   memcpy (v, ",'0000-00-00 00:00:00'", 22);
+   d2 (v + 2, (tm.tm_year + 1900) / 100);
+   d2 (v + 4, tm.tm_year % 100);
+   d2 (v + 7, tm.tm_mon + 1);
+   d2 (v + 10, tm.tm_mday);
+   d2 (v + 13, tm.tm_hour);
+   d2 (v + 16, tm.tm_min);
+   d2 (v + 19, tm.tm_sec);
+   v += 22;
+   for (int w = 0; w < (COLS + 63) / 64; w++)
+      for (uint64_t m = j->have[w]; m; m &= m - 1)
+      {
+         int n = w * 64 + __builtin_ctzll (m);
+         c = copy (c, colsql[n], colsqllen[n]);
+         *v++ = ',';
+         if (fks_cols[n].isenum)
+         {
+            char ch = j->len[n];
+            v = quote (v, &ch, ch ? 1 : 0);
+         } else if (j->num[n])
+            v = copy (v, j->num[n], j->len[n]);
+         else
+         {
+            memcpy (v, "NULL", 4);
+            v += 4;
+         }
+      }
+   *v++ = ')';
+   *c = *v = 0;
+   cols->len = c - cols->buf;
+   vals->len = v - vals->buf;
+}
+
+void
+fkj_buf_free (fkj_buf_t * b)
+{
+   free (b->buf);
+   b->buf = NULL;
+   b->len = b->size = 0;
+}
@@ -0,0 +1,39 @@
+// Faikin report JSON to faikinlog columns, in one pass and without building a tree
+// Copyright (c) 2022 Adrian Kennard, Andrews & Arnold Limited, see LICENSE file (GPL)
+// The payload is walked once. Each key is looked up in a hash of the acextras.m fields, and numbers are left where
+// they are in the payload, so they can be copied as sent in to SQL, or decoded for the store and metrics. Other keys
+// are skipped, but the whole payload is still checked to be valid JSON.
+
+#ifndef FAIKINJSON_H
+#define FAIKINJSON_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include "faikinstore.h"
+
+typedef struct fkj_s fkj_t;
+struct fkj_s
+{                               // Columns in a report, valid only while the payload is
+   time_t ts;                   // Device timestamp, 0 if none
+   uint8_t backfill;            // "backfill":true, i.e. ts is when this was, not just the device clock now
+   uint64_t have[(COLS + 63) / 64];     // Columns present (may be NULL)
+   const char *num[COLS];       // Number as sent, in the payload, NULL for NULL
+   uint8_t len[COLS];           // Length of num, or for enums the character (0 for empty string)
+};
+
+typedef struct fkj_buf_s fkj_buf_t;
+struct fkj_buf_s
+{                               // Reusable text buffer, grows as needed, always null terminated
+   char *buf;
+   size_t len,
+     size;
+};
+
+const char *fkj_parse (fkj_t *, const char *json, size_t len);  // Returns error, or NULL
+int fkj_has (const fkj_t *, int c);     // Column present
+double fkj_val (const fkj_t *, int c);  // Value, NAN if none or NULL, enums as character code
+void fkj_sql (const fkj_t *, const char *tag, time_t utc, fkj_buf_t * cols, fkj_buf_t * vals);  // Replaces cols and vals, as faikinlog INSERTs
+void fkj_buf_free (fkj_buf_t *);
+
+#endif
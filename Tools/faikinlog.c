@@ -1,5 +1,21 @@
 // Daikin A/C log to mariadb from MQTT
 // Copyright (c) 2022 Adrian Kennard, Andrews & Arnold Limited, see LICENSE file (GPL)
+// Messages are decoded on the MQTT thread (faikinjson.c, one pass over the payload, no JSON tree) and passed to writer
+// threads through a lock free queue. If the queue is full, or the database is down, rows go to an append only spool
+// file, which is replayed when the database is back.
+// As rows are INSERT IGNORE, replaying a row that did in fact get stored is harmless.
+// Which columns exist is a bitmap, loaded on connect, and missing columns are added in one ALTER TABLE before a batch.
+// Hourly and daily rollup tables (table_hour, table_day) hold min/max/sum/count per field, and each hour and day
+// touched by a batch is recalculated from the rows below it, so replays and backfill give the same answer.
+// Several brokers, prefixes and tables (--source) share the one queue and pool of writers, each broker having its
+// own MQTT loop thread, so adding brokers does not add database connections.
+// --metrics-port serves the latest value of each field per tag, and the counts, for Prometheus. The MQTT threads update
+// the latest values in a lock free map, so scrapes need no database.
+// Alternatively --store writes to the file store in faikinstore.c, for one table, and no SQL server is needed.
+// --partition creates tables partitioned by month, and --retention tiers (e.g. 7d:15m,90d:1h,2y:drop) are applied by a
+// housekeeping thread, at start and then daily. Compacting replaces a tag's raw rows, a day at a time, with one row per
+// period (min of min, avg, max of max, last enum) in the same table, so graphs work as before with fewer rows. Drop
+// deletes rows, dropping whole partitions first. The hourly and daily rollups are left alone, so keep full history.
 
 #include <stdio.h>
 #include <string.h>
@@ -10,7 +26,357 @@
 #include <sqllib.h>
 #include <stdlib.h>
 #include <mosquitto.h>
-#include <ajl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/stat.h>
+#include <math.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include "faikinstore.h"
+#include "faikinjson.h"
+
+#define	COLWORDS	((COLS+63)/64)
+#define	MAXTIERS	8
+#define	TO_DAYS_1970	719528  // SQL TO_DAYS('1970-01-01')
+
+typedef struct tier_s tier_t;
+struct tier_s
+{                               // --retention, in order of age
+   time_t age;                  // Rows older than this
+   int res;                     // are compacted to a row per res seconds, or 0 to delete them
+};
+
+typedef struct table_s table_t;
+struct table_s
+{                               // SQL table, and its rollup tables
+   table_t *next;
+   char *name;
+   char *hour;
+   char *day;
+   uint64_t present[COLWORDS];  // Columns known to be in the table, shared by writers
+   time_t compacted[MAXTIERS];  // Days before this are done, per tier (housekeeping thread)
+};
+
+typedef struct source_s source_t;
+struct source_s
+{                               // MQTT broker and prefix, and the table it logs to
+   source_t *next;
+   source_t *broker;            // First source on the same broker, which has the MQTT connection
+   char *host;
+   int port;
+   char *prefix;
+   table_t *table;
+   struct mosquitto *mqtt;
+   unsigned long long received, // Counts for this source
+     inserted,
+     spooled,
+     dropped;
+};
+
+typedef struct rec_s rec_t;
+struct rec_s
+{                               // A row waiting to be inserted
+   rec_t *next;
+   table_t *table;
+   source_t *src;               // NULL if replayed from spool
+   char *tag;
+   time_t utc;
+   char *cols;                  // Column list
+   char *vals;                  // (...) values
+   double *val;                 // COLS values, for the file store
+};
+
+typedef struct batch_s batch_t;
+struct batch_s
+{                               // Rows with the same table and columns, inserted as one multi-row INSERT
+   batch_t *next;
+   table_t *table;
+   const char *cols;            // Column list (of the first row)
+   uint64_t need[COLWORDS];     // Columns used
+   rec_t *rows,
+    *last;
+};
+
+typedef struct latest_s latest_t;
+struct latest_s
+{                               // Latest values for a tag, for /metrics
+   char *tag;                   // Set once, when the slot is claimed
+   time_t utc;
+   uint64_t val[COLS];          // Bits of a double, NAN for none
+};
+
+typedef struct slot_s slot_t;
+struct slot_s
+{                               // Queue slot, seq says if it is ready to write or to read
+   size_t seq;
+   rec_t *rec;
+};
+
+static const struct
+{                               // Column types, in the same order as the col_ enum
+   const char *name;
+   const char *type;
+   const char *agg;             // How rows are compacted, min, max, avg, or last
+} coltypes[] = {
+#define	b(name)	{#name,"decimal(4,2)","avg"},
+#define	i(name)	{"min"#name,"int","min"},{#name,"int","avg"},{"max"#name,"int","max"},
+#define	t(name)	{"min"#name,"decimal(6,2)","min"},{#name,"decimal(6,2)","avg"},{"max"#name,"decimal(6,2)","max"},
+#define	r(name)	{"min"#name,"decimal(6,2)","min"},{"max"#name,"decimal(6,2)","max"},
+#define	e(name,t)	{#name,"char(1)","last"},
+#include "acextras.m"
+};
+
+static const struct
+{                               // Rollup columns, and the raw column each is made from
+   const char *agg;             // min, max, sum, or n (count)
+   const char *name;
+   const char *type;
+   int col;
+} rollcols[] = {
+#define	b(name)	{"sum",#name,"decimal(10,2)",col_##name},{"n",#name,"int",col_##name},
+#define	i(name)	{"min",#name,"int",col_min##name},{"max",#name,"int",col_max##name},{"sum",#name,"bigint",col_##name},{"n",#name,"int",col_##name},
+#define	t(name)	{"min",#name,"decimal(6,2)",col_min##name},{"max",#name,"decimal(6,2)",col_max##name},{"sum",#name,"decimal(12,2)",col_##name},{"n",#name,"int",col_##name},
+#define	r(name)	{"min",#name,"decimal(6,2)",col_min##name},{"max",#name,"decimal(6,2)",col_max##name},
+#include "acextras.m"
+};
+
+#define	ROLLCOLS	(sizeof(rollcols)/sizeof(*rollcols))
+
+static table_t *tables = NULL;  // First is the default for old spool lines
+static source_t *sources = NULL;
+static tier_t tiers[MAXTIERS];
+static int ntiers = 0;
+
+static volatile int stop = 0;
+
+static latest_t *latest = NULL; // Open addressing by tag, slots claimed with compare and swap
+static size_t latestmask = 0;
+static unsigned long long latestfull = 0;
+
+static slot_t *queue = NULL;    // Bounded multi producer multi consumer queue
+static size_t queuemask = 0;
+static size_t queuein = 0,
+   queueout = 0;
+static sem_t queueready;
+
+static pthread_mutex_t spoollock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t replaying = PTHREAD_MUTEX_INITIALIZER;
+static FILE *spoolf = NULL;
+static long long spoolsize = 0;
+
+static unsigned long long received = 0,
+   inserted = 0,
+   spooled = 0,
+   replayed = 0,
+   dropped = 0,
+   failures = 0;
+
+#define	count(v,n)	__atomic_add_fetch(&(v),(n),__ATOMIC_RELAXED)
+
+static void
+stopped (int s)
+{
+   stop = s;
+}
+
+static long long
+now_ms (void)
+{
+   struct timespec t;
+   clock_gettime (CLOCK_MONOTONIC, &t);
+   return t.tv_sec * 1000LL + t.tv_nsec / 1000000;
+}
+
+static time_t
+duration (const char *s, char **end)
+{                               // e.g. 15m, 7d, 2y, no unit is seconds, 0 if not valid
+   long long v = strtoll (s, end, 10);
+   static const char units[] = "smhdwy";
+   static const int secs[] = { 1, 60, 3600, 86400, 7 * 86400, 365 * 86400 };
+   const char *u = (**end ? strchr (units, **end) : NULL);
+   if (u)
+   {
+      v *= secs[u - units];
+      (*end)++;
+   }
+   return v > 0 ? v : 0;
+}
+
+static time_t
+month (time_t utc, int add)
+{                               // Start of UTC month, add months on
+   struct tm tm;
+   gmtime_r (&utc, &tm);
+   tm.tm_mday = 1;
+   tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+   tm.tm_mon += add;
+   return timegm (&tm);
+}
+
+static void
+monthpartitions (FILE * f, time_t from, time_t to)
+{                               // PARTITION for each month from and before to, then one for the rest
+   for (time_t m = from; m < to; m = month (m, 1))
+   {
+      struct tm tm;
+      gmtime_r (&m, &tm);
+      fprintf (f, "PARTITION `p%04d%02d` VALUES LESS THAN (%lld),", tm.tm_year + 1900, tm.tm_mon + 1,
+               (long long) month (m, 1) / 86400 + TO_DAYS_1970);
+   }
+   fprintf (f, "PARTITION `pmax` VALUES LESS THAN MAXVALUE");
+}
+
+static int
+colis (table_t * t, int c)
+{                               // Column is in the table
+   return (__atomic_load_n (&t->present[c / 64], __ATOMIC_RELAXED) >> (c % 64)) & 1;
+}
+
+static void
+colneed (const char *cols, uint64_t * need)
+{                               // Columns in a column list
+   for (const char *p = strchr (cols, '`'); p; p = strchr (p + 1, '`'))
+   {
+      const char *q = strchr (p + 1, '`');
+      if (!q)
+         break;
+      int c = fks_colindex (p + 1, q - p - 1);
+      if (c >= 0)
+         need[c / 64] |= 1ULL << (c % 64);
+      p = q;
+   }
+}
+
+static int
+enqueue (rec_t * r)
+{                               // Add to queue, non zero if full
+   size_t pos = __atomic_load_n (&queuein, __ATOMIC_RELAXED);
+   while (1)
+   {
+      slot_t *s = &queue[pos & queuemask];
+      intptr_t d = (intptr_t) __atomic_load_n (&s->seq, __ATOMIC_ACQUIRE) - (intptr_t) pos;
+      if (d < 0)
+         return -1;
+      if (!d && __atomic_compare_exchange_n (&queuein, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      {
+         s->rec = r;
+         __atomic_store_n (&s->seq, pos + 1, __ATOMIC_RELEASE);
+         sem_post (&queueready);
+         return 0;
+      }
+      if (d)
+         pos = __atomic_load_n (&queuein, __ATOMIC_RELAXED);
+   }
+}
+
+static rec_t *
+dequeue (void)
+{                               // Next from queue, NULL if empty
+   size_t pos = __atomic_load_n (&queueout, __ATOMIC_RELAXED);
+   while (1)
+   {
+      slot_t *s = &queue[pos & queuemask];
+      intptr_t d = (intptr_t) __atomic_load_n (&s->seq, __ATOMIC_ACQUIRE) - (intptr_t) (pos + 1);
+      if (d < 0)
+         return NULL;
+      if (!d && __atomic_compare_exchange_n (&queueout, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      {
+         rec_t *r = s->rec;
+         __atomic_store_n (&s->seq, pos + queuemask + 1, __ATOMIC_RELEASE);
+         return r;
+      }
+      if (d)
+         pos = __atomic_load_n (&queueout, __ATOMIC_RELAXED);
+   }
+}
+
+static size_t
+queuedepth (void)
+{
+   return __atomic_load_n (&queuein, __ATOMIC_RELAXED) - __atomic_load_n (&queueout, __ATOMIC_RELAXED);
+}
+
+static void
+latest_init (int tags)
+{
+   size_t n = 2;
+   while (n < (size_t) tags * 2)
+      n <<= 1;                  // Kept at most half full
+   latest = calloc (n, sizeof (*latest));
+   if (!latest)
+      errx (1, "Cannot allocate metrics");
+   latestmask = n - 1;
+   for (size_t i = 0; i < n; i++)
+      for (int c = 0; c < COLS; c++)
+      {
+         double v = NAN;
+         memcpy (&latest[i].val[c], &v, sizeof (v));
+      }
+}
+
+static void
+latest_set (const char *tag, time_t utc, const double *val)
+{                               // Update latest values for a tag, fields not in val are left as they were
+   unsigned int h = 2166136261U;        // FNV-1a
+   for (const char *p = tag; *p; p++)
+      h = (h ^ (unsigned char) *p) * 16777619U;
+   char *mine = NULL;
+   latest_t *l = NULL;
+   for (size_t probe = 0; probe <= latestmask / 2 && !l; probe++)
+   {
+      latest_t *s = &latest[(h + probe) & latestmask];
+      char *t = __atomic_load_n (&s->tag, __ATOMIC_ACQUIRE);
+      if (!t)
+      {                         // Claim it
+         if (!mine)
+            mine = strdup (tag);
+         if (__atomic_compare_exchange_n (&s->tag, &t, mine, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+         {
+            t = mine;
+            mine = NULL;
+         }
+      }
+      if (!strcmp (t, tag))
+         l = s;
+   }
+   free (mine);
+   if (!l)
+   {
+      count (latestfull, 1);
+      return;
+   }
+   for (int c = 0; c < COLS; c++)
+      if (!isnan (val[c]))
+      {
+         uint64_t bits;
+         memcpy (&bits, &val[c], sizeof (bits));
+         __atomic_store_n (&l->val[c], bits, __ATOMIC_RELAXED);
+      }
+   __atomic_store_n (&l->utc, utc, __ATOMIC_RELEASE);
+}
+
+static double
+latest_get (latest_t * l, int c)
+{
+   uint64_t bits = __atomic_load_n (&l->val[c], __ATOMIC_RELAXED);
+   double v;
+   memcpy (&v, &bits, sizeof (v));
+   return v;
+}
+
+static void
+rec_free (rec_t * r)
+{
+   free (r->tag);
+   free (r->cols);
+   free (r->vals);
+   free (r->val);
+   free (r);
+}
 
 int
 main (int argc, const char *argv[])
@@ -26,7 +392,26 @@ main (int argc, const char *argv[])
    const char *mqttpassword = NULL;
    const char *mqttprefix = "Faikin";
    const char *mqttid = NULL;
+   const char *spool = "faikinlog.spool";
+   const char *store = NULL;
+   const char *source = NULL;
+   const char **sourcespecs = NULL;
+   int nsourcespecs = 0;
    int interval = 60;
+   int batchrows = 100;
+   int batchms = 1000;
+   int writers = 1;
+   int queuesize = 4096;
+   int spoolmax = 1024;
+   int stats = 0;
+   int metricsport = 0;
+   int metricstags = 1024;
+   int norollup = 0;
+   int backfill = 0;
+   int partition = 0;
+   const char *retention = NULL;
+   int retentionhour = 3;
+   int retentionnow = 0;
    int debug = 0;
    poptContext optCon;          // context for parsing command-line options
    {                            // POPT
@@ -43,7 +428,27 @@ main (int argc, const char *argv[])
          {"mqtt-password", 'p', POPT_ARG_STRING, &mqttpassword, 0, "MQTT password", "password"},
          {"mqtt-prefix", 'a', POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &mqttprefix, 0, "MQTT prefix", "prefix"},
          {"mqtt-id", 0, POPT_ARG_STRING, &mqttid, 0, "MQTT id", "id"},
+         {"source", 'S', POPT_ARG_STRING, &source, 'S', "Broker, prefix and table (repeat for more)",
+          "hostname[:port][/prefix][=table]"},
          {"interval", 'i', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &interval, 0, "Recording interval", "seconds"},
+         {"batch-rows", 'n', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &batchrows, 0, "Rows per INSERT transaction", "rows"},
+         {"batch-ms", 'm', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &batchms, 0, "Max delay before rows are inserted", "ms"},
+         {"writers", 'w', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &writers, 0, "SQL writer threads", "n"},
+         {"queue", 'q', POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &queuesize, 0, "Rows queued for writers", "rows"},
+         {"spool", 's', POPT_ARG_STRING | POPT_ARGFLAG_SHOW_DEFAULT, &spool, 0, "Spool file, empty for none", "filename"},
+         {"spool-max", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &spoolmax, 0, "Max spool size", "MB"},
+         {"store", 0, POPT_ARG_STRING, &store, 0, "Use file store, not SQL", "directory"},
+         {"no-rollup", 0, POPT_ARG_NONE, &norollup, 0, "Do not update hourly and daily rollup tables"},
+         {"backfill", 0, POPT_ARG_NONE, &backfill, 0, "Rebuild rollup tables from all rows, and exit"},
+         {"partition", 0, POPT_ARG_NONE, &partition, 0, "Create tables partitioned by month"},
+         {"retention", 0, POPT_ARG_STRING, &retention, 0, "Compact or delete old rows (resolution or drop by age)",
+          "age:res,...e.g. 7d:15m,90d:1h,2y:drop"},
+         {"retention-hour", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &retentionhour, 0, "Daily housekeeping time",
+          "UTC hour"},
+         {"retention-now", 0, POPT_ARG_NONE, &retentionnow, 0, "Do --retention and partitions now, and exit"},
+         {"stats", 0, POPT_ARG_INT, &stats, 0, "Log queue, spool and drop counts", "seconds"},
+         {"metrics-port", 0, POPT_ARG_INT, &metricsport, 0, "Serve latest values and counts on /metrics", "port"},
+         {"metrics-tags", 0, POPT_ARG_INT | POPT_ARGFLAG_SHOW_DEFAULT, &metricstags, 0, "Max tags for /metrics", "n"},
          {"debug", 'V', POPT_ARG_NONE, &debug, 0, "Debug"},
          POPT_AUTOHELP {}
       };
@@ -51,7 +456,12 @@ main (int argc, const char *argv[])
       optCon = poptGetContext (NULL, argc, argv, optionsTable, 0);
 
       int c;
-      if ((c = poptGetNextOpt (optCon)) < -1)
+      while ((c = poptGetNextOpt (optCon)) == 'S')
+      {
+         sourcespecs = realloc (sourcespecs, (nsourcespecs + 1) * sizeof (*sourcespecs));
+         sourcespecs[nsourcespecs++] = source;
+      }
+      if (c < -1)
          errx (1, "%s: %s\n", poptBadOption (optCon, POPT_BADOPTION_NOALIAS), poptStrerror (c));
 
       if (poptPeekArg (optCon))
@@ -59,40 +469,556 @@ main (int argc, const char *argv[])
          poptPrintUsage (optCon, stderr, 0);
          return -1;
       }
+      if (batchrows < 1)
+         batchrows = 1;
+      if (batchms < 0)
+         batchms = 0;
+      if (writers < 1)
+         writers = 1;
+      if ((spool && !*spool) || store)
+         spool = NULL;
+      if (store && backfill)
+         errx (1, "--backfill is for SQL");
+      if (store && partition)
+         errx (1, "--partition is for SQL");
+      for (char *p = (retention ? strdupa (retention) : NULL), *spec; p && (spec = strsep (&p, ","));)
+      {
+         char *res = strchr (spec, ':'),
+            *e;
+         if (!res)
+            errx (1, "--retention %s is not age:resolution", spec);
+         *res++ = 0;
+         tier_t t = {.age = duration (spec, &e) };
+         if (!t.age || *e)
+            errx (1, "--retention age %s is not valid, e.g. 7d", spec);
+         if (strcmp (res, "drop") && (!(t.res = duration (res, &e)) || *e || 86400 % t.res))
+            errx (1, "--retention resolution %s is not valid, e.g. 15m, a whole number per day", res);
+         if (ntiers == MAXTIERS)
+            errx (1, "--retention has too many tiers");
+         if (ntiers && (t.age <= tiers[ntiers - 1].age || !tiers[ntiers - 1].res || (t.res && t.res < tiers[ntiers - 1].res)))
+            errx (1, "--retention tiers must be in order of age and resolution, with drop last");
+         if (store && t.res)
+            warnx ("--retention %s:%s ignored, only drop applies to --store", spec, res);
+         tiers[ntiers++] = t;
+      }
+      if (retentionnow && !ntiers && !partition)
+         errx (1, "--retention-now needs --retention or --partition");
+   }
+   table_t *tablefor (const char *name)
+   {
+      table_t **tp;
+      for (tp = &tables; *tp && strcmp ((*tp)->name, name); tp = &(*tp)->next);
+      if (!*tp)
+      {
+         table_t *t = calloc (1, sizeof (*t));
+         t->name = strdup (name);
+         asprintf (&t->hour, "%s_hour", name);
+         asprintf (&t->day, "%s_day", name);
+         *tp = t;
+      }
+      return *tp;
+   }
+   void addsource (const char *spec)
+   {                            // hostname[:port][/prefix][=table], missing parts from --mqtt-hostname, --mqtt-prefix, --sql-table
+      source_t *s = calloc (1, sizeof (*s));
+      char *h = strdupa (spec);
+      char *t = strchr (h, '=');
+      if (t)
+         *t++ = 0;
+      char *p = strchr (h, '/');
+      if (p)
+         *p++ = 0;
+      char *port = strchr (h, ':');
+      s->port = 1883;
+      if (port)
+      {
+         *port++ = 0;
+         s->port = atoi (port);
+      }
+      s->host = strdup (*h ? h : mqtthostname);
+      s->prefix = strdup (p && *p ? p : mqttprefix);
+      s->table = tablefor (t && *t ? t : sqltable);
+      source_t **sp;
+      for (sp = &sources; *sp; sp = &(*sp)->next)
+         if (!s->broker && !strcmp ((*sp)->host, s->host) && (*sp)->port == s->port)
+            s->broker = (*sp)->broker;
+      if (!s->broker)
+         s->broker = s;
+      *sp = s;
+   }
+   for (int n = 0; n < nsourcespecs; n++)
+      addsource (sourcespecs[n]);
+   if (!sources)
+      addsource ("");
+   free (sourcespecs);
+   if (store && tables->next)
+      errx (1, "--store holds one table, run one faikinlog per table");
+   if (metricsport)
+      latest_init (metricstags < 1 ? 1 : metricstags);
+   fks_t *fks = (store ? fks_open (store) : NULL);
+   void storerec (rec_t * r)
+   {                            // Write to file store, and free
+      const char *err = fks_append (fks, r->tag, r->utc, r->val);
+      if (err)
+      {
+         warnx ("Store %s: %s", r->tag, err);
+         count (dropped, 1);
+         if (r->src)
+            count (r->src->dropped, 1);
+      } else
+      {
+         count (inserted, 1);
+         if (r->src)
+            count (r->src->inserted, 1);
+      }
+      rec_free (r);
+   }
+   {                            // Queue, a power of 2
+      size_t n = 2;
+      while (n < (size_t) queuesize)
+         n <<= 1;
+      queue = calloc (n, sizeof (*queue));
+      if (!queue)
+         errx (1, "Cannot allocate queue");
+      for (size_t i = 0; i < n; i++)
+         queue[i].seq = i;
+      queuemask = n - 1;
+      sem_init (&queueready, 0, 0);
+   }
+   char *replayname = NULL;
+   if (spool)
+   {
+      asprintf (&replayname, "%s.replay", spool);
+      if (!(spoolf = fopen (spool, "a")))
+         err (1, "Cannot open %s", spool);
+      spoolsize = ftell (spoolf);
+   }
+   void spoolrec (rec_t * r)
+   {                            // Append to spool, or drop, and free
+      int ok = 0;
+      pthread_mutex_lock (&spoollock);
+      if (spoolf && spoolsize < spoolmax * 1024LL * 1024LL)
+      {                         // utc/table, the table being the default if missing
+         int l = fprintf (spoolf, "%ld/%s\t%s\t%s\t%s\n", (long) r->utc, r->table->name, r->tag, r->cols, r->vals);
+         if (l >= 0 && !fflush (spoolf))
+         {
+            spoolsize += l;
+            ok = 1;
+         }
+      }
+      pthread_mutex_unlock (&spoollock);
+      if (ok)
+         count (spooled, 1);
+      else
+         count (dropped, 1);
+      if (r->src)
+      {
+         if (ok)
+            count (r->src->spooled, 1);
+         else
+            count (r->src->dropped, 1);
+      }
+      rec_free (r);
+   }
+   int colload (SQL * sql, table_t * t)
+   {                            // Which columns are in the table
+      SQL_RES *res = sql_query_store_free (sql, sql_printf ("SELECT * FROM `%#S` LIMIT 0", t->name));
+      if (!res)
+         return -1;
+      for (int c = 0; c < COLS; c++)
+         if (sql_colnum (res, coltypes[c].name) >= 0)
+            __atomic_or_fetch (&t->present[c / 64], 1ULL << (c % 64), __ATOMIC_RELAXED);
+      sql_free_result (res);
+      return 0;
+   }
+   int rollupschema (SQL * sql, table_t * t)
+   {                            // Make rollup tables, with all columns
+      for (int day = 0; day < 2; day++)
+      {
+         const char *table = day ? t->day : t->hour;
+         if (sql_query_free (sql,
+                             sql_printf
+                             ("CREATE TABLE IF NOT EXISTS `%#S` (`tag` varchar(20) not null,`utc` datetime not null,`n` int,primary key (`tag`,`utc`))",
+                              table)))
+            return -1;
+         SQL_RES *res = sql_query_store_free (sql, sql_printf ("SELECT * FROM `%#S` LIMIT 0", table));
+         if (!res)
+            return -1;
+         char *q = NULL;
+         size_t len;
+         FILE *f = open_memstream (&q, &len);
+         char *a = sql_printf ("ALTER TABLE `%#S`", table);
+         fprintf (f, "%s", a);
+         free (a);
+         int n = 0;
+         for (unsigned int c = 0; c < ROLLCOLS; c++)
+         {
+            char field[100];
+            snprintf (field, sizeof (field), "%s%s", rollcols[c].agg, rollcols[c].name);
+            if (sql_colnum (res, field) < 0)
+               fprintf (f, "%sADD `%s` %s", n++ ? "," : " ", field, rollcols[c].type);
+         }
+         fclose (f);
+         sql_free_result (res);
+         if (n && sql_query_free (sql, q))
+            return -1;
+         if (!n)
+            free (q);
+      }
+      return 0;
+   }
+   int rollup (SQL * sql, table_t * t, int day, const char *where)
+   {                            // Recalculate hours (from rows) or days (from hours) matching where
+      char *q = NULL;
+      size_t len;
+      FILE *f = open_memstream (&q, &len);
+      char *a = sql_printf ("INSERT INTO `%#S` (`tag`,`utc`,`n`", day ? t->day : t->hour);
+      fprintf (f, "%s", a);
+      free (a);
+      for (unsigned int c = 0; c < ROLLCOLS; c++)
+         if (colis (t, rollcols[c].col))
+            fprintf (f, ",`%s%s`", rollcols[c].agg, rollcols[c].name);
+      if (day)
+         fprintf (f, ") SELECT `tag`,DATE(`utc`) AS `p`,sum(`n`)");
+      else
+         fprintf (f, ") SELECT `tag`,DATE_FORMAT(`utc`,'%%Y-%%m-%%d %%H:00:00') AS `p`,count(*)");
+      for (unsigned int c = 0; c < ROLLCOLS; c++)
+         if (colis (t, rollcols[c].col))
+         {
+            const char *agg = rollcols[c].agg,
+               *name = rollcols[c].name;
+            if (*agg == 'n')
+               fprintf (f, day ? ",sum(`n%s`)" : ",count(`%s`)", name);
+            else if (*agg == 's')
+               fprintf (f, day ? ",sum(`sum%s`)" : ",sum(`%s`)", name);
+            else
+               fprintf (f, ",%s(`%s%s`)", agg, agg, name);
+         }
+      a = sql_printf (" FROM `%#S` WHERE %s GROUP BY `tag`,`p` ON DUPLICATE KEY UPDATE `n`=VALUES(`n`)", day ? t->hour : t->name,
+                      where);
+      fprintf (f, "%s", a);
+      free (a);
+      for (unsigned int c = 0; c < ROLLCOLS; c++)
+         if (colis (t, rollcols[c].col))
+            fprintf (f, ",`%s%s`=VALUES(`%s%s`)", rollcols[c].agg, rollcols[c].name, rollcols[c].agg, rollcols[c].name);
+      fclose (f);
+      return sql_query_free (sql, q);
+   }
+   void cleanup (void)
+   {
+      while (sources)
+      {
+         source_t *s = sources;
+         sources = s->next;
+         free (s->host);
+         free (s->prefix);
+         free (s);
+      }
+      while (tables)
+      {
+         table_t *t = tables;
+         tables = t->next;
+         free (t->name);
+         free (t->hour);
+         free (t->day);
+         free (t);
+      }
+      poptFreeContext (optCon);
+   }
+   char *createtable (table_t * t)
+   {                            // CREATE TABLE, partitioned by month (this and next, then the rest) if --partition
+      char *q = NULL;
+      size_t len;
+      FILE *f = open_memstream (&q, &len);
+      char *a = sql_printf ("CREATE TABLE IF NOT EXISTS `%#S` (`tag` varchar(20) not null,`utc` datetime not null,primary key (`tag`,`utc`))",
+                            t->name);
+      fprintf (f, "%s", a);
+      free (a);
+      if (partition)
+      {
+         fprintf (f, " PARTITION BY RANGE (TO_DAYS(`utc`)) (");
+         monthpartitions (f, month (time (0), 0), month (time (0), 2));
+         fprintf (f, ")");
+      }
+      fclose (f);
+      return q;
+   }
+   int partitions (SQL * sql, table_t * t, time_t dropbefore)
+   {                            // Drop monthly partitions wholly before dropbefore, and add the next two months
+      SQL_RES *res = sql_query_store_free (sql,
+                                           sql_printf
+                                           ("SELECT `PARTITION_NAME` AS `name`,`PARTITION_DESCRIPTION` AS `to`,`PARTITION_EXPRESSION` AS `expr` FROM `information_schema`.`PARTITIONS` WHERE `TABLE_SCHEMA`=DATABASE() AND `TABLE_NAME`=%#s AND `PARTITION_NAME` IS NOT NULL",
+                                            t->name));
+      if (!res)
+         return -1;
+      char *drop = NULL;
+      size_t len;
+      FILE *f = open_memstream (&drop, &len);
+      time_t last = 0;
+      int n = 0,
+         ours = 1,
+         pmax = 0,
+         drops = 0;
+      while (sql_fetch_row (res))
+      {
+         const char *name = sql_colz (res, "name"),
+            *to = sql_colz (res, "to");
+         n++;
+         if (!strcasestr (sql_colz (res, "expr"), "to_days") || !strstr (sql_colz (res, "expr"), "utc"))
+            ours = 0;           // Not our partitioning, leave alone
+         else if (!strcmp (to, "MAXVALUE"))
+            pmax = !strcmp (name, "pmax");
+         else
+         {
+            time_t end = (atoll (to) - TO_DAYS_1970) * 86400;   // First day after partition
+            if (end > last)
+               last = end;
+            if (dropbefore && end <= dropbefore)
+            {
+               char *q = sql_printf ("%s`%#S`", drops++ ? "," : "", name);
+               fprintf (f, "%s", q);
+               free (q);
+            }
+         }
+      }
+      fclose (f);
+      sql_free_result (res);
+      int fail = 0;
+      if (n && ours && drops)
+      {
+         char *a = sql_printf ("ALTER TABLE `%#S` DROP PARTITION %s", t->name, drop);
+         fail = sql_query_free (sql, a);
+         if (!fail && debug)
+            warnx ("Dropped %d partition%s of %s", drops, drops == 1 ? "" : "s", t->name);
+      }
+      free (drop);
+      time_t ahead = month (time (0), 2);
+      if (!fail && n && ours && pmax && last < ahead)
+      {                         // Split the rest, moving any rows already there
+         char *q = NULL;
+         f = open_memstream (&q, &len);
+         char *a = sql_printf ("ALTER TABLE `%#S` REORGANIZE PARTITION `pmax` INTO (", t->name);
+         fprintf (f, "%s", a);
+         free (a);
+         monthpartitions (f, last ? : month (time (0), 0), ahead);
+         fprintf (f, ")");
+         fclose (f);
+         fail = sql_query_free (sql, q);
+      }
+      return fail;
+   }
+   int compact (SQL * sql, table_t * t, const char *tag, time_t d, int res)
+   {                            // Replace a tag's rows for the day from d with a row per res seconds, or delete them if res is 0
+      if (!res)
+         return sql_query_free (sql, sql_printf ("DELETE FROM `%#S` WHERE `tag`=%#s AND `utc`>=%#U AND `utc`<%#U", t->name, tag, d, d + 86400));
+      char *q = NULL;
+      size_t len;
+      FILE *f = open_memstream (&q, &len);
+      char *a = sql_printf ("INSERT INTO `%#S` (`tag`,`utc`", t->name);
+      fprintf (f, "%s", a);
+      free (a);
+      for (int c = 0; c < COLS; c++)
+         if (colis (t, c))
+            fprintf (f, ",`%s`", coltypes[c].name);
+      a = sql_printf (") SELECT `tag`,TIMESTAMPADD(SECOND,TIMESTAMPDIFF(SECOND,%#U,`utc`) DIV %d*%d,%#U) AS `p`", d, res, res, d);
+      fprintf (f, "%s", a);
+      free (a);
+      for (int c = 0; c < COLS; c++)
+         if (colis (t, c))
+         {
+            const char *agg = coltypes[c].agg,
+               *name = coltypes[c].name;
+            if (*agg == 'l')    // Last value, as the utc sorts as text
+               fprintf (f, ",SUBSTRING(MAX(CONCAT(`utc`,`%s`)),20)", name);
+            else if (*agg == 'a')
+               fprintf (f, ",ROUND(AVG(`%s`),%d)", name, fks_cols[c].decimals);
+            else
+               fprintf (f, ",%s(`%s`)", agg, name);
+         }
+      a = sql_printf (" FROM `%#S` WHERE `tag`=%#s AND `utc`>=%#U AND `utc`<%#U GROUP BY `tag`,`p` ON DUPLICATE KEY UPDATE `utc`=VALUES(`utc`)",
+                      t->name, tag, d, d + 86400);
+      fprintf (f, "%s", a);
+      free (a);
+      for (int c = 0; c < COLS; c++)
+         if (colis (t, c))
+            fprintf (f, ",`%s`=VALUES(`%s`)", coltypes[c].name, coltypes[c].name);
+      fclose (f);
+      char *del = sql_printf ("DELETE FROM `%#S` WHERE `tag`=%#s AND `utc`>=%#U AND `utc`<%#U AND TIMESTAMPDIFF(SECOND,%#U,`utc`) MOD %d<>0",
+                              t->name, tag, d, d + 86400, d, res);
+      int fail = 0;
+      for (int try = 0; try < 2; try++)
+      {
+         fail = (sql_query (sql, "START TRANSACTION") || sql_query (sql, q) || sql_query (sql, del) || sql_query (sql, "COMMIT"));
+         if (!fail)
+            break;
+         int e = sql_errno (sql);
+         warnx ("Compacting %s %s failed: %s", t->name, tag, sql_error (sql));
+         sql_query (sql, "ROLLBACK");
+         if (e != 1213 && e != 1205)
+            break;              // Not deadlock or lock wait with a writer, so no point trying again
+      }
+      free (q);
+      free (del);
+      return fail;
+   }
+   int housekeep (SQL * sql)
+   {                            // Partitions, and --retention, a day per tag at a time, oldest tier first
+      time_t now = time (0);
+      time_t cutoff[MAXTIERS + 1];      // Tier k is whole days from cutoff[k+1] to before cutoff[k]
+      for (int k = 0; k < ntiers; k++)
+         cutoff[k] = (now - tiers[k].age) - (now - tiers[k].age) % 86400;
+      cutoff[ntiers] = 0;
+      for (table_t * t = tables; t && !stop; t = t->next)
+      {
+         if (colload (sql, t))
+         {
+            if (sql_errno (sql) == 1146)
+               continue;        // No table yet
+            return -1;
+         }
+         if (partitions (sql, t, ntiers && !tiers[ntiers - 1].res ? cutoff[ntiers - 1] : 0))
+            return -1;
+         if (!ntiers)
+            continue;
+         SQL_RES *res = sql_query_store_free (sql, sql_printf ("SELECT `tag`,min(`utc`) AS `from` FROM `%#S` GROUP BY `tag`", t->name));
+         if (!res)
+            return -1;
+         int days = 0;
+         while (sql_fetch_row (res) && !stop)
+         {
+            const char *tag = sql_colz (res, "tag");
+            time_t from = sql_time_utc (sql_colz (res, "from"));
+            for (int k = ntiers - 1; k >= 0 && !stop; k--)
+            {
+               time_t d = cutoff[k + 1];
+               if (d < t->compacted[k])
+                  d = t->compacted[k];
+               if (d < from - from % 86400)
+                  d = from - from % 86400;
+               for (; d < cutoff[k] && !stop; d += 86400, days++)
+                  if (compact (sql, t, tag, d, tiers[k].res))
+                  {
+                     sql_free_result (res);
+                     return -1;
+                  }
+            }
+         }
+         sql_free_result (res);
+         if (stop)
+            break;
+         for (int k = 0; k < ntiers; k++)
+            t->compacted[k] = cutoff[k];
+         if (debug)
+            warnx ("Housekeeping %s done, %d tag day%s", t->name, days, days == 1 ? "" : "s");
+      }
+      return 0;
+   }
+   void expire (void)
+   {                            // Only drop applies to the file store
+      if (!ntiers || tiers[ntiers - 1].res)
+         return;
+      time_t before = time (0) - tiers[ntiers - 1].age;
+      int n = fks_expire (store, before - before % 86400);
+      if (n < 0)
+         warn ("Cannot expire %s", store);
+      else if (debug)
+         warnx ("Deleted %d old day file%s", n, n == 1 ? "" : "s");
+   }
+   if (retentionnow)
+   {
+      if (store)
+         expire ();
+      else
+      {
+         SQL sql;
+         sql_real_connect (&sql, sqlhostname, sqlusername, sqlpassword, sqldatabase, 0, NULL, 0, 1, sqlconffile);
+         if (housekeep (&sql))
+            errx (1, "Housekeeping failed: %s", sql_error (&sql));
+         sql_close (&sql);
+      }
+      cleanup ();
+      return 0;
+   }
+   if (backfill)
+   {                            // Rebuild rollups a day at a time
+      SQL sql;
+      sql_real_connect (&sql, sqlhostname, sqlusername, sqlpassword, sqldatabase, 0, NULL, 0, 1, sqlconffile);
+      for (table_t * t = tables; t; t = t->next)
+      {
+         if (colload (&sql, t) || rollupschema (&sql, t))
+            errx (1, "Cannot set up rollup tables for %s: %s", t->name, sql_error (&sql));
+         SQL_RES *res = sql_safe_query_store_free (&sql, sql_printf ("SELECT min(`utc`) AS `from`,max(`utc`) AS `to` FROM `%#S`", t->name));
+         if (sql_fetch_row (res) && sql_col (res, "from"))
+         {
+            time_t from = sql_time_utc (sql_col (res, "from")),
+               to = sql_time_utc (sql_col (res, "to"));
+            for (time_t d = from - from % 86400; d <= to; d += 86400)
+            {
+               char *where = sql_printf ("`utc`>=%#U AND `utc`<%#U", d, d + 86400);
+               if (rollup (&sql, t, 0, where) || rollup (&sql, t, 1, where))
+                  errx (1, "Rollup failed: %s", sql_error (&sql));
+               free (where);
+               if (debug)
+               {
+                  struct tm tm;
+                  gmtime_r (&d, &tm);
+                  warnx ("Rolled up %s %04d-%02d-%02d", t->name, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+               }
+            }
+         }
+         sql_free_result (res);
+      }
+      sql_close (&sql);
+      cleanup ();
+      return 0;
    }
-   SQL sql;
    int e = mosquitto_lib_init ();
    if (e)
       errx (1, "MQTT init failed %s", mosquitto_strerror (e));
-   struct mosquitto *mqtt = mosquitto_new (mqttid, 1, NULL);
-   if (mqttusername)
-   {
-      e = mosquitto_username_pw_set (mqtt, mqttusername, mqttpassword);
-      if (e)
-         errx (1, "MQTT auth failed %s", mosquitto_strerror (e));
-   }
+   for (source_t * s = sources; s; s = s->next)
+      if (s->broker == s)
+      {                         // One connection per broker
+         s->mqtt = mosquitto_new (mqttid, 1, s);
+         if (!s->mqtt)
+            errx (1, "MQTT new failed (%s)", s->host);
+         if (mqttusername)
+         {
+            e = mosquitto_username_pw_set (s->mqtt, mqttusername, mqttpassword);
+            if (e)
+               errx (1, "MQTT auth failed %s", mosquitto_strerror (e));
+         }
+      }
    void connect (struct mosquitto *mqtt, void *obj, int rc)
-   {
-      obj = obj;
+   {                            // Subscribe to the prefixes on this broker
       rc = rc;
-      char *sub = NULL;
-      asprintf (&sub, "%s/#", mqttprefix);
-      int e = mosquitto_subscribe (mqtt, NULL, sub, 0);
-      if (e)
-         errx (1, "MQTT subscribe failed %s (%s)", mosquitto_strerror (e), sub);
-      if (debug)
-         warnx ("MQTT Sub %s", sub);
-      free (sub);
+      for (source_t * s = sources; s; s = s->next)
+         if (s->broker == obj)
+         {
+            char *sub = NULL;
+            asprintf (&sub, "%s/#", s->prefix);
+            int e = mosquitto_subscribe (mqtt, NULL, sub, 0);
+            if (e)
+               errx (1, "MQTT subscribe failed %s (%s)", mosquitto_strerror (e), sub);
+            if (debug)
+               warnx ("MQTT Sub %s %s", s->host, sub);
+            free (sub);
+         }
    }
    void disconnect (struct mosquitto *mqtt, void *obj, int rc)
    {
       obj = obj;
       rc = rc;
    }
-   SQL_RES *res = NULL;
    void message (struct mosquitto *mqtt, void *obj, const struct mosquitto_message *msg)
-   {
-      obj = obj;
+   {                            // Decode to a row for the writers, no SQL here
+      source_t *src = NULL;     // Longest prefix on this broker
+      for (source_t * s = sources; s; s = s->next)
+      {
+         size_t l = strlen (s->prefix);
+         if (s->broker == obj && !strncmp (msg->topic, s->prefix, l) && msg->topic[l] == '/'
+             && (!src || strlen (src->prefix) < l))
+            src = s;
+      }
       char *topic = strdupa (msg->topic);
       if (!msg->payloadlen)
       {
@@ -106,92 +1032,663 @@ main (int argc, const char *argv[])
          return;
       }
       *tag++ = 0;
-      j_t data = j_create ();
-      const char *e = j_read_mem (data, msg->payload, msg->payloadlen);
+      if (!src)
+      {
+         warnx ("Unknown prefix %s", topic);
+         return;
+      }
+      fkj_t j;
+      const char *e = fkj_parse (&j, msg->payload, msg->payloadlen);
       if (e)
-         warnx ("Bad JSON [%s] Val [%.*s]", tag, msg->payloadlen, (char *) msg->payload);
+      {
+         warnx ("Bad JSON [%s] %s Val [%.*s]", tag, e, msg->payloadlen, (char *) msg->payload);
+         return;
+      }
+      if (debug)
+         warnx ("%.*s", msg->payloadlen, (char *) msg->payload);
+      // Device timestamp only for history backfilled after an MQTT outage, as a live report may be before the clock is set
+      time_t utc = (j.backfill && j.ts ? j.ts : time (0));
+      rec_t *rec = calloc (1, sizeof (*rec));
+      rec->table = src->table;
+      rec->src = src;
+      rec->tag = strdup (tag);
+      rec->utc = utc;
+      double val[COLS];         // Decoded values, for the store and metrics
+      if (fks || latest)
+         for (int c = 0; c < COLS; c++)
+            val[c] = fkj_val (&j, c);
+      if (!fks)
+      {                         // Built in this thread's buffers, so one allocation each for the row
+         static __thread fkj_buf_t cols,
+           vals;
+         fkj_sql (&j, tag, utc, &cols, &vals);
+         rec->cols = strndup (cols.buf, cols.len);
+         rec->vals = strndup (vals.buf, vals.len);
+      }
+      if (latest)
+         latest_set (tag, utc, val);
+      if (fks)
+      {
+         rec->val = malloc (sizeof (val));
+         memcpy (rec->val, val, sizeof (val));
+      }
+      count (received, 1);
+      count (src->received, 1);
+      if (!enqueue (rec))
+         return;
+      if (fks)
+         storerec (rec);
       else
-      {                         // Process log
+         spoolrec (rec);
+   }
+   void *writer (void *arg)
+   {                            // Drain the queue to SQL, in batches
+      int id = (long) arg;
+      SQL sql;
+      int up = 0;
+      long long retry = 0;
+      batch_t *batches = NULL;
+      int pending = 0;          // Rows in batches
+      long long due = 0;        // When pending rows must be inserted
+      void discard (int spool)
+      {                         // Free (or spool) all pending rows
+         while (batches)
+         {
+            batch_t *b = batches;
+            batches = b->next;
+            while (b->rows)
+            {
+               rec_t *r = b->rows;
+               b->rows = r->next;
+               if (spool)
+                  spoolrec (r);
+               else
+                  rec_free (r);
+            }
+            free (b);
+         }
+         pending = 0;
+      }
+      void down (void)
+      {
+         warnx ("Writer %d SQL failed: %s", id, sql_error (&sql));
+         count (failures, 1);
+         sql_close (&sql);
+         up = 0;
+         retry = now_ms () + 5000;
+      }
+      int schema (table_t * t)
+      {                         // Add any missing columns for pending rows, in one ALTER TABLE
+         for (int try = 0; try < 2; try++)
+         {
+            uint64_t missing[COLWORDS] = { 0 };
+            int n = 0;
+            for (int w = 0; w < COLWORDS; w++)
+            {
+               for (batch_t * b = batches; b; b = b->next)
+                  if (b->table == t)
+                     missing[w] |= b->need[w];
+               missing[w] &= ~__atomic_load_n (&t->present[w], __ATOMIC_RELAXED);
+               n += __builtin_popcountll (missing[w]);
+            }
+            if (!n)
+               return 0;
+            char *q = NULL;
+            size_t len;
+            FILE *f = open_memstream (&q, &len);
+            char *a = sql_printf ("ALTER TABLE `%#S`", t->name);
+            fprintf (f, "%s", a);
+            free (a);
+            for (int c = 0, first = 1; c < COLS; c++)
+               if (missing[c / 64] & (1ULL << (c % 64)))
+               {
+                  fprintf (f, "%sADD `%s` %s", first ? " " : ",", coltypes[c].name, coltypes[c].type);
+                  first = 0;
+               }
+            fclose (f);
+            if (!sql_query_free (&sql, q))
+            {
+               for (int w = 0; w < COLWORDS; w++)
+                  __atomic_or_fetch (&t->present[w], missing[w], __ATOMIC_RELAXED);
+               if (debug)
+                  warnx ("Writer %d added %d column%s to %s", id, n, n == 1 ? "" : "s", t->name);
+               return 0;
+            }
+            if (sql_errno (&sql) != 1060 || colload (&sql, t))
+               return -1;       // 1060 is duplicate column, i.e. another writer added some, so reload and try again
+         }
+         return -1;
+      }
+      void rollups (table_t * t)
+      {                         // Recalculate the hours and days of the rows just inserted in to a table
+         int rows = 0;
+         for (batch_t * b = batches; b; b = b->next)
+            for (rec_t * r = b->rows; r && b->table == t; r = r->next)
+               rows++;
+         struct
+         {
+            const char *tag;
+            time_t p;
+         } *tp = malloc ((rows + 1) * sizeof (*tp));
+         int cmp (const void *a, const void *b)
+         {                      // By tag and period, so duplicates are together
+            const typeof (*tp) * x = a,
+               *y = b;
+            int c = strcmp (x->tag, y->tag);
+            if (c)
+               return c;
+            return x->p < y->p ? -1 : x->p > y->p;
+         }
+         for (int day = 0; day < 2; day++)
+         {
+            time_t period = day ? 86400 : 3600;
+            int count = 0;
+            for (batch_t * b = batches; b; b = b->next)
+               for (rec_t * r = b->rows; r && b->table == t; r = r->next)
+               {
+                  tp[count].tag = r->tag;
+                  tp[count++].p = r->utc - r->utc % period;
+               }
+            qsort (tp, count, sizeof (*tp), cmp);
+            char *where = NULL;
+            size_t len;
+            FILE *f = open_memstream (&where, &len);
+            int n = 0;
+            for (int i = 0; i < count; i++)
+            {
+               if (i && !cmp (&tp[i], &tp[i - 1]))
+                  continue;     // Already have this tag and period
+               char *w = sql_printf ("(`tag`=%#s AND `utc`>=%#U AND `utc`<%#U)", tp[i].tag, tp[i].p, tp[i].p + period);
+               fprintf (f, "%s%s", n++ ? " OR " : "", w);
+               free (w);
+            }
+            fclose (f);
+            int fail = (n ? rollup (&sql, t, day, where) : 0);
+            if (fail && (sql_errno (&sql) == 1213 || sql_errno (&sql) == 1205))
+               fail = rollup (&sql, t, day, where);     // Deadlock or lock wait with another writer, try again
+            free (where);
+            if (fail)
+            {
+               warnx ("Writer %d rollup of %s failed: %s (use --backfill to fix)", id, t->name, sql_error (&sql));
+               break;
+            }
+         }
+         free (tp);
+      }
+      void flush (void)
+      {                         // Insert all pending rows, one multi-row INSERT per table and column list, in one transaction
+         if (!pending)
+            return;
+         if (!up)
+         {
+            discard (1);
+            return;
+         }
+         long long start = now_ms ();
+         int rows = pending,
+            inserts = 0;
+         int fail = 0;
+         for (table_t * t = tables; t && !fail; t = t->next)
+            fail = schema (t);
+         if (fail)
+         {
+            down ();
+            discard (1);
+            return;
+         }
+         fail = sql_query (&sql, "START TRANSACTION");
+         for (batch_t * b = batches; b && !fail; b = b->next)
+         {
+            char *q = NULL;
+            size_t len;
+            FILE *f = open_memstream (&q, &len);
+            char *i = sql_printf ("INSERT IGNORE INTO `%#S` (", b->table->name);
+            fprintf (f, "%s%s) VALUES ", i, b->cols);
+            free (i);
+            for (rec_t * r = b->rows; r; r = r->next)
+               fprintf (f, "%s%s", r->vals, r->next ? "," : "");
+            fclose (f);
+            fail = sql_query_free (&sql, q);
+            inserts++;
+         }
+         if (!fail)
+            fail = sql_query (&sql, "COMMIT");
+         if (fail)
+         {
+            down ();
+            discard (1);
+            return;
+         }
+         if (!norollup)
+            for (table_t * t = tables; t; t = t->next)
+               rollups (t);
+         for (batch_t * b = batches; b; b = b->next)
+            for (rec_t * r = b->rows; r; r = r->next)
+               if (r->src)
+                  count (r->src->inserted, 1);
+         discard (0);
+         count (inserted, rows);
          if (debug)
-            warnx ("%.*s", msg->payloadlen, (char *) msg->payload);
-         if (!res)
+            warnx ("Writer %d inserted %d row%s in %d INSERT%s, %lldms", id, rows, rows == 1 ? "" : "s", inserts,
+                   inserts == 1 ? "" : "s", now_ms () - start);
+      }
+      void add (rec_t * r)
+      {                         // Add a row to the batch for its table and column list
+         batch_t *b;
+         for (b = batches; b && (b->table != r->table || strcmp (b->cols, r->cols)); b = b->next);
+         if (!b)
+         {
+            b = calloc (1, sizeof (*b));
+            b->table = r->table;
+            b->cols = r->cols;
+            colneed (b->cols, b->need);
+            b->next = batches;
+            batches = b;
+         }
+         if (b->rows)
+            b->last->next = r;
+         else
+            b->rows = r;
+         b->last = r;
+         if (!pending++)
+            due = now_ms () + batchms;
+         if (pending >= batchrows)
+            flush ();
+      }
+      void replay (void)
+      {                         // Insert the spool, anything that fails goes back in to the spool
+         if (!spool || pthread_mutex_trylock (&replaying))
+            return;
+         while (up)
          {
-            res = sql_query_store_free (&sql, sql_printf ("SELECT * FROM `%#S` LIMIT 0", sqltable));
-            if (!res)
-               sql_safe_query_free (&sql,
-                                    sql_printf
-                                    ("CREATE TABLE `%#S` (`tag` varchar(20) not null,`utc` datetime not null,primary key (`tag`,`utc`))",
-                                     sqltable));
-            // Leaving res as NULL is fine as sql_coln will return -1 for that...
-         }
-         sql_s_t s = { 0 };
-         sql_sprintf (&s, "INSERT IGNORE INTO `%#S` SET `tag`=%#s,`utc`=%#U", sqltable, tag, time (0));
-         int changed = 0;
-         j_t j;
-         j_t find (const char *name, const char *type)
-         {
-            j_t j = j_find (data, name);
-            if (!j)
-               return j;
-            void check (const char *prefix, const char *type)
-            {
-               char field[100];
-               sprintf (field, "%s%s", prefix, name);
-               if (sql_colnum (res, field) < 0)
+            struct stat st;
+            pthread_mutex_lock (&spoollock);
+            int have = !stat (replayname, &st);
+            if (!have && spoolsize)
+            {                   // Move spool aside so new rows spool to a new file as we replay
+               fclose (spoolf);
+               have = !rename (spool, replayname);
+               if (!(spoolf = fopen (spool, "a")))
+                  warn ("Cannot open %s", spool);
+               spoolsize = (spoolf ? ftell (spoolf) : 0);
+            }
+            pthread_mutex_unlock (&spoollock);
+            if (!have)
+               break;
+            FILE *f = fopen (replayname, "r");
+            if (!f)
+               break;
+            if (debug)
+               warnx ("Writer %d replaying spool", id);
+            char *line = NULL;
+            size_t len = 0;
+            ssize_t l;
+            while ((l = getline (&line, &len, f)) > 0)
+            {
+               if (line[l - 1] == '\n')
+                  line[--l] = 0;
+               char *tag = strchr (line, '\t'),
+                  *cols = tag ? strchr (tag + 1, '\t') : NULL,
+                  *vals = cols ? strchr (cols + 1, '\t') : NULL;
+               if (!vals)
+                  continue;
+               char *table = NULL;
+               time_t utc = strtoll (line, &table, 10);
+               table_t *t = tables;     // Default if no /table, as in old spool files
+               if (*table == '/')
+                  for (t = tables; t && (strncmp (t->name, table + 1, tag - table - 1) || t->name[tag - table - 1]); t = t->next);
+               if (!t)
                {
-                  sql_safe_query_free (&sql, sql_printf ("ALTER TABLE `%#S` ADD `%#S` %s", sqltable, field, type));
-                  changed++;
+                  warnx ("Spooled row for %.*s, which is no longer logged", (int) (tag - table - 1), table + 1);
+                  count (dropped, 1);
+                  continue;
                }
+               rec_t *r = calloc (1, sizeof (*r));
+               r->table = t;
+               r->utc = utc;
+               r->tag = strndup (tag + 1, cols - tag - 1);
+               r->cols = strndup (cols + 1, vals - cols - 1);
+               r->vals = strdup (vals + 1);
+               count (replayed, 1);
+               add (r);
             }
-            if (*type == '~' || *type == '=')
+            free (line);
+            fclose (f);
+            flush ();
+            unlink (replayname);
+         }
+         pthread_mutex_unlock (&replaying);
+      }
+      void dbconnect (void)
+      {
+         if (!sql_real_connect (&sql, sqlhostname, sqlusername, sqlpassword, sqldatabase, 0, NULL, 0, 0, sqlconffile))
+         {
+            warnx ("Writer %d cannot connect to SQL", id);
+            count (failures, 1);
+            retry = now_ms () + 5000;
+            return;
+         }
+         up = 1;
+         for (table_t * t = tables; t; t = t->next)
+            if (sql_query_free (&sql, createtable (t)) || colload (&sql, t) || (!norollup && rollupschema (&sql, t)))
             {
-               check ("min", type + 1);
-               check ("max", type + 1);
-               if (*type == '~')
-                  type++;
-               else
-                  type = NULL;
-            }
-            if (type)
-               check ("", type);
-            return j;
-         }
-#define	b(name)	if((j=find(#name,"decimal(4,2)"))){sql_sprintf(&s,",`%#S`=%s",#name,j_istrue(j)?"1":j_isbool(j)?"0":j_isnumber(j)?j_val(j):"NULL");}
-#define	i(name)	if((j=find(#name,"~int"))){if(j_isarray(j)&&j_len(j)==3&&j_isnumber(j_index(j,0))&&j_isnumber(j_index(j,1))&&j_isnumber(j_index(j,2)))	\
-		sql_sprintf(&s,",`min%#S`=%s,`%#S`=%s,`max%#S`=%s",#name,j_val(j_index(j,0)),#name,j_val(j_index(j,1)),#name,j_val(j_index(j,2))); \
-		else if(j_isnumber(j))sql_sprintf(&s,",`min%#S`=%s,`%#S`=%s,`max%#S`=%s",#name,j_val(j),#name,j_val(j),#name,j_val(j));}
-#define	t(name)	if((j=find(#name,"~decimal(6,2)"))){if(j_isarray(j)&&j_len(j)==3&&j_isnumber(j_index(j,0))&&j_isnumber(j_index(j,1))&&j_isnumber(j_index(j,2)))	\
-		sql_sprintf(&s,",`min%#S`=%s,`%#S`=%s,`max%#S`=%s",#name,j_val(j_index(j,0)),#name,j_val(j_index(j,1)),#name,j_val(j_index(j,2))); \
-		else if(j_isnumber(j))sql_sprintf(&s,",`min%#S`=%s,`%#S`=%s,`max%#S`=%s",#name,j_val(j),#name,j_val(j),#name,j_val(j));}
-#define	r(name)	if((j=find(#name,"=decimal(6,2)"))){if(j_isarray(j)&&j_len(j)==2&&j_isnumber(j_index(j,0))&&j_isnumber(j_index(j,1))) \
-		sql_sprintf(&s,",`min%#S`=%s,`max%#S`=%s",#name,j_val(j_index(j,0)),#name,j_val(j_index(j,1)));	\
-		else if(j_isnumber(j))sql_sprintf(&s,",`min%#S`=%s,`max%#S`=%s",#name,j_val(j),#name,j_val(j));}
-#define e(name,t) if((j=find(#name,"char(1)"))){if(j_isstring(j))sql_sprintf(&s,",`%#S`=%#s",#name,j_val(j));}
-#include "acextras.m"
-         sql_safe_query_s (&sql, &s);
-         if (changed)
+               down ();
+               return;
+            }
+         if (debug)
+            warnx ("Writer %d connected to SQL", id);
+         replay ();
+      }
+      while (fks)
+      {                         // File store, no batching needed as each row is one small append
+         if (!stop)
          {
-            if (res)
-               sql_free_result (res);
-            res = NULL;
+            struct timespec t;
+            clock_gettime (CLOCK_REALTIME, &t);
+            t.tv_sec++;
+            sem_timedwait (&queueready, &t);
+         }
+         rec_t *r;
+         while ((r = dequeue ()))
+            storerec (r);
+         if (stop && !queuedepth ())
+            return NULL;
+      }
+      while (1)
+      {
+         long long now = now_ms ();
+         if (!up && now >= retry && !stop)
+            dbconnect ();
+         long long wait = pending ? due - now : 1000;
+         if (wait > 0 && !stop)
+         {                      // Wait for rows
+            struct timespec t;
+            clock_gettime (CLOCK_REALTIME, &t);
+            t.tv_sec += wait / 1000;
+            t.tv_nsec += (wait % 1000) * 1000000L;
+            if (t.tv_nsec >= 1000000000L)
+            {
+               t.tv_sec++;
+               t.tv_nsec -= 1000000000L;
+            }
+            sem_timedwait (&queueready, &t);
          }
+         rec_t *r;
+         while ((r = dequeue ()))
+            add (r);
+         if (pending && (stop || now_ms () >= due))
+            flush ();
+         if (stop && !queuedepth ())
+            break;
       }
+      if (up)
+         sql_close (&sql);
+      return NULL;
+   }
+   void report (void)
+   {
+      pthread_mutex_lock (&spoollock);
+      long long size = spoolsize;
+      pthread_mutex_unlock (&spoollock);
+      warnx ("Received %llu inserted %llu queue %zu/%zu spool %lld bytes spooled %llu replayed %llu dropped %llu SQL failures %llu",
+             received, inserted, queuedepth (), queuemask + 1, size, spooled, replayed, dropped, failures);
+      if (sources->next)
+         for (source_t * s = sources; s; s = s->next)
+            warnx ("%s:%d/%s=%s received %llu inserted %llu spooled %llu dropped %llu", s->host, s->port, s->prefix,
+                   s->table->name, s->received, s->inserted, s->spooled, s->dropped);
    }
 
-   mosquitto_connect_callback_set (mqtt, connect);
-   mosquitto_disconnect_callback_set (mqtt, disconnect);
-   mosquitto_message_callback_set (mqtt, message);
-   mosquitto_reconnect_delay_set (mqtt, 5, 300, true);
-   e = mosquitto_connect (mqtt, mqtthostname, 1883, 60);
-   if (e)
-      errx (1, "MQTT connect failed (%s) %s", mqtthostname, mosquitto_strerror (e));
-   sql_real_connect (&sql, sqlhostname, sqlusername, sqlpassword, sqldatabase, 0, NULL, 0, 1, sqlconffile);
-   e = mosquitto_loop_forever (mqtt, -1, 1);
-   if (e)
-      errx (1, "MQTT loop failed %s", mosquitto_strerror (e));
-   mosquitto_destroy (mqtt);
+   int metricsfd = -1;
+   void *metrics (void *arg)
+   {                            // Serve /metrics, one connection at a time
+      arg = arg;
+      int s;
+      while ((s = accept (metricsfd, NULL, NULL)) >= 0)
+      {
+         struct timeval tv = {.tv_sec = 2 };
+         setsockopt (s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+         setsockopt (s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+         char req[1024];
+         size_t len = 0;
+         ssize_t l;
+         while (len < sizeof (req) - 1 && (l = recv (s, req + len, sizeof (req) - 1 - len, 0)) > 0)
+         {
+            len += l;
+            req[len] = 0;
+            if (strstr (req, "\r\n\r\n") || strstr (req, "\n\n"))
+               break;
+         }
+         req[len] = 0;
+         char *body = NULL;
+         size_t bodylen = 0;
+         FILE *f = open_memstream (&body, &bodylen);
+         const char *status = "200 OK";
+         if (strncmp (req, "GET /metrics ", 13) && strncmp (req, "GET /metrics?", 13))
+         {
+            status = "404 Not Found";
+            fprintf (f, "Not found\n");
+         } else
+         {                      // Prometheus text format, field names as the Faikin's own /metrics
+            void head (const char *prefix, const char *name, const char *type, const char *help)
+            {
+               fprintf (f, "# HELP %s%s %s\n# TYPE %s%s %s\n", prefix, name, help, prefix, name, type);
+            }
+            void label (latest_t * t)
+            {                   // tag="..." escaped
+               fprintf (f, "tag=\"");
+               for (const char *p = t->tag; *p; p++)
+                  if (*p == '\n')
+                     fprintf (f, "\\n");
+                  else
+                     fprintf (f, "%s%c", *p == '"' || *p == '\\' ? "\\" : "", *p);
+               fprintf (f, "\"");
+            }
+            for (int c = 0; c < COLS; c++)
+            {
+               int first = 1;
+               for (size_t i = 0; i <= latestmask; i++)
+               {
+                  latest_t *t = &latest[i];
+                  if (!__atomic_load_n (&t->tag, __ATOMIC_ACQUIRE))
+                     continue;
+                  double v = latest_get (t, c);
+                  if (isnan (v))
+                     continue;
+                  if (first)
+                  {
+                     char help[100];
+                     snprintf (help, sizeof (help), "%s%s", fks_cols[c].name, fks_cols[c].isenum ? " (label is value)" : "");
+                     head ("faikin_", fks_cols[c].name, "gauge", help);
+                  }
+                  first = 0;
+                  fprintf (f, "faikin_%s{", fks_cols[c].name);
+                  label (t);
+                  if (fks_cols[c].isenum)
+                     fprintf (f, ",%s=\"%c\"} 1\n", fks_cols[c].name, (int) v);
+                  else
+                  {             // Decimal places as stored, less trailing zeros
+                     char n[40];
+                     int l = snprintf (n, sizeof (n), "%.*f", fks_cols[c].decimals, v);
+                     if (fks_cols[c].decimals)
+                     {
+                        while (l && n[l - 1] == '0')
+                           l--;
+                        if (l && n[l - 1] == '.')
+                           l--;
+                     }
+                     fprintf (f, "} %.*s\n", l, n);
+                  }
+               }
+            }
+            head ("faikin_", "last_seen_timestamp_seconds", "gauge", "Time of last message");
+            for (size_t i = 0; i <= latestmask; i++)
+               if (__atomic_load_n (&latest[i].tag, __ATOMIC_ACQUIRE))
+               {
+                  fprintf (f, "faikin_last_seen_timestamp_seconds{");
+                  label (&latest[i]);
+                  fprintf (f, "} %ld\n", (long) __atomic_load_n (&latest[i].utc, __ATOMIC_ACQUIRE));
+               }
+            void counter (const char *name, const char *help, unsigned long long v)
+            {
+               head ("faikinlog_", name, "counter", help);
+               fprintf (f, "faikinlog_%s %llu\n", name, v);
+            }
+            counter ("received_total", "Messages received", received);
+            counter ("inserted_total", "Rows stored", inserted);
+            counter ("spooled_total", "Rows spooled", spooled);
+            counter ("replayed_total", "Rows replayed from spool", replayed);
+            counter ("dropped_total", "Rows dropped", dropped);
+            counter ("failures_total", "SQL failures", failures);
+            counter ("metrics_full_total", "Messages not in metrics as too many tags", latestfull);
+            head ("faikinlog_", "queue_rows", "gauge", "Rows queued for writers");
+            fprintf (f, "faikinlog_queue_rows %zu\n", queuedepth ());
+            pthread_mutex_lock (&spoollock);
+            long long size = spoolsize;
+            pthread_mutex_unlock (&spoollock);
+            head ("faikinlog_", "spool_bytes", "gauge", "Spool file size");
+            fprintf (f, "faikinlog_spool_bytes %lld\n", size);
+            struct rusage ru;
+            getrusage (RUSAGE_SELF, &ru);
+            head ("", "process_cpu_seconds_total", "counter", "User and system CPU time");
+            fprintf (f, "process_cpu_seconds_total %.6f\n",
+                     ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000000.0);
+            head ("faikinlog_", "source_received_total", "counter", "Messages received by source");
+            for (source_t * s = sources; s; s = s->next)
+               fprintf (f, "faikinlog_source_received_total{source=\"%s:%d/%s\"} %llu\n", s->host, s->port, s->prefix, s->received);
+            head ("faikinlog_", "source_inserted_total", "counter", "Rows stored by source, not counting replays");
+            for (source_t * s = sources; s; s = s->next)
+               fprintf (f, "faikinlog_source_inserted_total{source=\"%s:%d/%s\"} %llu\n", s->host, s->port, s->prefix, s->inserted);
+            head ("faikinlog_", "source_dropped_total", "counter", "Rows dropped by source");
+            for (source_t * s = sources; s; s = s->next)
+               fprintf (f, "faikinlog_source_dropped_total{source=\"%s:%d/%s\"} %llu\n", s->host, s->port, s->prefix, s->dropped);
+         }
+         fclose (f);
+         char *hdr = NULL;
+         int hl = asprintf (&hdr, "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                            status, bodylen);
+         if (hl > 0 && send (s, hdr, hl, MSG_NOSIGNAL) == hl)
+            for (size_t sent = 0; sent < bodylen && (l = send (s, body + sent, bodylen - sent, MSG_NOSIGNAL)) > 0; sent += l);
+         free (hdr);
+         free (body);
+         close (s);
+      }
+      return NULL;
+   }
+   pthread_t metricsthread;
+   if (metricsport)
+   {
+      metricsfd = socket (AF_INET6, SOCK_STREAM, 0);
+      if (metricsfd < 0)
+         err (1, "Cannot make metrics socket");
+      int on = 1,
+         off = 0;
+      setsockopt (metricsfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+      setsockopt (metricsfd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof (off));
+      struct sockaddr_in6 a = {.sin6_family = AF_INET6,.sin6_port = htons (metricsport),.sin6_addr = in6addr_any };
+      if (bind (metricsfd, (struct sockaddr *) &a, sizeof (a)) || listen (metricsfd, 10))
+         err (1, "Cannot listen on metrics port %d", metricsport);
+      if (pthread_create (&metricsthread, NULL, metrics, NULL))
+         err (1, "Cannot start metrics");
+   }
+   void *housekeeper (void *arg)
+   {                            // Partitions and --retention at start, then daily
+      arg = arg;
+      time_t next = time (0);
+      while (!stop)
+      {
+         if (time (0) >= next)
+         {
+            time_t now = time (0);
+            next = now - now % 86400 + retentionhour * 3600;
+            if (next <= now)
+               next += 86400;
+            SQL sql;
+            if (store)
+               expire ();
+            else if (!sql_real_connect (&sql, sqlhostname, sqlusername, sqlpassword, sqldatabase, 0, NULL, 0, 0, sqlconffile))
+            {
+               warnx ("Housekeeping cannot connect to SQL");
+               next = now + 300;
+            } else
+            {
+               if (housekeep (&sql))
+               {
+                  warnx ("Housekeeping failed: %s", sql_error (&sql));
+                  next = now + 300;
+               }
+               sql_close (&sql);
+            }
+         }
+         sleep (1);
+      }
+      return NULL;
+   }
+   pthread_t housekeeperthread;
+   if (ntiers || partition)
+      if (pthread_create (&housekeeperthread, NULL, housekeeper, NULL))
+         err (1, "Cannot start housekeeping");
+   pthread_t threads[writers];
+   for (long n = 0; n < writers; n++)
+      if (pthread_create (&threads[n], NULL, writer, (void *) n))
+         err (1, "Cannot start writer");
+   for (source_t * s = sources; s; s = s->next)
+      if (s->mqtt)
+      {                         // Each broker has its own loop thread
+         mosquitto_connect_callback_set (s->mqtt, connect);
+         mosquitto_disconnect_callback_set (s->mqtt, disconnect);
+         mosquitto_message_callback_set (s->mqtt, message);
+         mosquitto_reconnect_delay_set (s->mqtt, 5, 300, true);
+         e = mosquitto_connect (s->mqtt, s->host, s->port, 60);
+         if (e)
+            errx (1, "MQTT connect failed (%s) %s", s->host, mosquitto_strerror (e));
+         e = mosquitto_loop_start (s->mqtt);
+         if (e)
+            errx (1, "MQTT loop failed %s", mosquitto_strerror (e));
+      }
+   signal (SIGTERM, stopped);
+   signal (SIGINT, stopped);
+   time_t last = time (0);
+   while (!stop)
+   {
+      sleep (1);
+      if (stats > 0 && time (0) >= last + stats)
+      {
+         last = time (0);
+         report ();
+      }
+   }
+   for (source_t * s = sources; s; s = s->next)
+      if (s->mqtt)
+      {
+         mosquitto_disconnect (s->mqtt);
+         mosquitto_loop_stop (s->mqtt, false);
+      }
+   for (int n = 0; n < writers; n++)
+      sem_post (&queueready);
+   for (int n = 0; n < writers; n++)
+      pthread_join (threads[n], NULL);
+   if (ntiers || partition)
+      pthread_join (housekeeperthread, NULL);
+   if (stats > 0 || debug)
+      report ();
+   if (metricsport)
+   {                            // Wakes accept
+      shutdown (metricsfd, SHUT_RDWR);
+      pthread_join (metricsthread, NULL);
+      close (metricsfd);
+      for (size_t i = 0; i <= latestmask; i++)
+         free (latest[i].tag);
+      free (latest);
+   }
+   for (source_t * s = sources; s; s = s->next)
+      if (s->mqtt)
+         mosquitto_destroy (s->mqtt);
    mosquitto_lib_cleanup ();
-   sql_close (&sql);
-   poptFreeContext (optCon);
+   if (spoolf)
+      fclose (spoolf);
+   if (fks)
+      fks_close (fks);
+   free (replayname);
+   cleanup ();
    return 0;
 }
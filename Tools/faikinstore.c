@@ -0,0 +1,668 @@
+// Faikin columnar file store, see faikinstore.h
+// Copyright (c) 2022 Adrian Kennard, Andrews & Arnold Limited, see LICENSE file (GPL)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <time.h>
+#include "faikinstore.h"
+
+#define	BLOCKROWS	64      // Rows per block, a bit per row in a uint64_t
+#define	FILEMAGIC	0x31534B46      // "FKS1" (little endian), then uint32_t day
+#define	BLOCKMAGIC	0x31424B46      // "FKB1"
+#define	COLHASH		512     // Power of 2, well over COLS
+#define	MAXOPEN		256     // Tags kept open for writing, two files each, well under the usual ulimit -n of 1024
+
+_Static_assert (COLS < 255 && COLS * 2 <= COLHASH, "COLHASH too small");
+
+const fks_col_t fks_cols[COLS] = {
+#define	b(name)	{#name,2},
+#define	i(name)	{"min"#name},{#name},{"max"#name},
+#define	t(name)	{"min"#name,2},{#name,2},{"max"#name,2},
+#define	r(name)	{"min"#name,2},{"max"#name,2},
+#define	e(name,t)	{#name,0,1},
+#include "acextras.m"
+};
+
+typedef struct blockhead_s blockhead_t;
+struct blockhead_s
+{                               // Block header, followed by time column, then per column name, decimals, values
+   uint32_t magic;
+   uint32_t size;               // Including this header
+   uint32_t from,
+     to;                        // Times in block (inclusive)
+   uint16_t rows;
+   uint16_t cols;               // Columns in block
+};
+
+typedef struct block_s block_t;
+struct block_s
+{                               // A decoded block, our columns and decimals
+   int rows;
+   time_t utc[BLOCKROWS];
+   int64_t val[COLS][BLOCKROWS];
+   uint64_t has[COLS];          // Rows with a value
+};
+
+typedef struct tagfile_s tagfile_t;
+struct tagfile_s
+{                               // Writing a tag
+   tagfile_t *next;
+   char *tag;
+   int fd;                      // Day file
+   int jfd;                     // Journal
+   uint8_t closed;              // Closed to save files, the rest is still valid
+   time_t day;
+   off_t tail;                  // End of day file
+   off_t jtail;                 // End of journal
+   block_t block;               // Rows in journal
+};
+
+struct fks_s
+{
+   char *dir;
+   pthread_mutex_t mutex;
+   tagfile_t *files;            // Most recently used first
+   int open;                    // Tags open
+};
+
+static const int64_t pow10s[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+
+static unsigned char colhash[COLHASH];  // Name hash to fks_cols index + 1
+static pthread_once_t colhash_once = PTHREAD_ONCE_INIT;
+
+static unsigned int
+colhashof (const char *name, size_t len)
+{                               // FNV-1a
+   unsigned int h = 2166136261U;
+   while (len--)
+      h = (h ^ (unsigned char) *name++) * 16777619U;
+   return h;
+}
+
+static void
+colhash_init (void)
+{
+   for (int c = 0; c < COLS; c++)
+   {
+      unsigned int h = colhashof (fks_cols[c].name, strlen (fks_cols[c].name));
+      while (colhash[h & (COLHASH - 1)])
+         h++;
+      colhash[h & (COLHASH - 1)] = c + 1;
+   }
+}
+
+int
+fks_colindex (const char *name, size_t len)
+{
+   pthread_once (&colhash_once, colhash_init);
+   unsigned int h = colhashof (name, len);
+   int c;
+   while ((c = colhash[h & (COLHASH - 1)]))
+   {
+      if (!strncmp (fks_cols[c - 1].name, name, len) && !fks_cols[c - 1].name[len])
+         return c - 1;
+      h++;
+   }
+   return -1;
+}
+
+static uint8_t *
+put (uint8_t * p, uint64_t v)
+{                               // Varint
+   while (v >= 0x80)
+   {
+      *p++ = v | 0x80;
+      v >>= 7;
+   }
+   *p++ = v;
+   return p;
+}
+
+static int
+get (const uint8_t ** pp, const uint8_t * e, uint64_t * v)
+{                               // Varint, non zero if bad
+   uint64_t r = 0;
+   for (int s = 0; *pp < e && s < 64; s += 7)
+   {
+      uint8_t b = *(*pp)++;
+      r |= (uint64_t) (b & 0x7F) << s;
+      if (!(b & 0x80))
+      {
+         *v = r;
+         return 0;
+      }
+   }
+   return -1;
+}
+
+static uint64_t
+zig (int64_t v)
+{
+   return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static int64_t
+unzig (uint64_t v)
+{
+   return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+static uint8_t *
+encode (const block_t * b, int first, int rows, size_t *lenp)
+{                               // Encode rows of a block, malloc'd
+   uint8_t *buf = malloc (sizeof (blockhead_t) + BLOCKROWS * 10 + COLS * (40 + BLOCKROWS * 10));
+   blockhead_t *h = (void *) buf;
+   uint8_t *p = buf + sizeof (*h);
+   uint64_t mask = (rows == 64 ? ~0ULL : ((1ULL << rows) - 1) << first);
+   time_t from = b->utc[first],
+      to = b->utc[first];
+   for (int r = first + 1; r < first + rows; r++)
+   {
+      if (b->utc[r] < from)
+         from = b->utc[r];
+      if (b->utc[r] > to)
+         to = b->utc[r];
+   }
+   int64_t last = from;
+   for (int r = first; r < first + rows; r++)
+   {
+      p = put (p, zig (b->utc[r] - last));
+      last = b->utc[r];
+   }
+   int cols = 0;
+   for (int c = 0; c < COLS; c++)
+      if (b->has[c] & mask)
+      {
+         cols++;
+         size_t l = strlen (fks_cols[c].name) + 1;
+         memcpy (p, fks_cols[c].name, l);
+         p += l;
+         *p++ = fks_cols[c].decimals;
+         last = 0;
+         for (int r = first; r < first + rows; r++)
+            if (b->has[c] & (1ULL << r))
+            {                   // 0 is no value, else delta+1
+               p = put (p, zig (b->val[c][r] - last) + 1);
+               last = b->val[c][r];
+            } else
+               *p++ = 0;
+      }
+   h->magic = BLOCKMAGIC;
+   h->size = p - buf;
+   h->from = from;
+   h->to = to;
+   h->rows = rows;
+   h->cols = cols;
+   *lenp = p - buf;
+   return buf;
+}
+
+static int
+decode (const uint8_t * p, size_t len, block_t * b)
+{                               // Decode a block, returns -1 if bad, else count of columns we do not know
+   const blockhead_t *h = (const void *) p;
+   if (len < sizeof (*h) || h->magic != BLOCKMAGIC || h->size > len || h->size < sizeof (*h) || !h->rows
+       || h->rows > BLOCKROWS)
+      return -1;
+   const uint8_t *e = p + h->size;
+   p += sizeof (*h);
+   memset (b->has, 0, sizeof (b->has));
+   b->rows = h->rows;
+   int64_t last = h->from;
+   uint64_t v;
+   for (int r = 0; r < b->rows; r++)
+   {
+      if (get (&p, e, &v))
+         return -1;
+      b->utc[r] = last += unzig (v);
+   }
+   int unknown = 0;
+   for (int n = 0; n < h->cols; n++)
+   {
+      const uint8_t *name = p;
+      while (p < e && *p)
+         p++;
+      if (p + 2 > e)
+         return -1;
+      int c = fks_colindex ((const char *) name, p - name);
+      p++;
+      int decimals = *p++;
+      if (c < 0)
+         unknown++;
+      last = 0;
+      for (int r = 0; r < b->rows; r++)
+      {
+         if (get (&p, e, &v))
+            return -1;
+         if (!v)
+            continue;
+         last += unzig (v - 1);
+         if (c < 0 || decimals > 9)
+            continue;
+         int64_t val = last;
+         if (decimals < fks_cols[c].decimals)
+            val *= pow10s[fks_cols[c].decimals - decimals];
+         else if (decimals > fks_cols[c].decimals)
+            val /= pow10s[decimals - fks_cols[c].decimals];
+         b->val[c][r] = val;
+         b->has[c] |= (1ULL << r);
+      }
+   }
+   return unknown;
+}
+
+fks_t *
+fks_open (const char *dir)
+{
+   mkdir (dir, 0777);
+   fks_t *s = calloc (1, sizeof (*s));
+   s->dir = strdup (dir);
+   pthread_mutex_init (&s->mutex, NULL);
+   return s;
+}
+
+void
+fks_close (fks_t * s)
+{
+   if (!s)
+      return;
+   while (s->files)
+   {
+      tagfile_t *f = s->files;
+      s->files = f->next;
+      if (f->fd >= 0)
+      {
+         close (f->fd);
+         close (f->jfd);
+      }
+      free (f->tag);
+      free (f);
+   }
+   pthread_mutex_destroy (&s->mutex);
+   free (s->dir);
+   free (s);
+}
+
+static char *
+filename (const char *dir, const char *tag, time_t day, const char *ext)
+{
+   struct tm tm;
+   gmtime_r (&day, &tm);
+   char *path = NULL;
+   asprintf (&path, "%s/%s/%04d-%02d-%02d.%s", dir, tag, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, ext);
+   return path;
+}
+
+static const char *
+scan (int fd, time_t day, off_t * endp, block_t * b, int journal)
+{                               // Find the end of the good blocks, dropping anything after, and the last block, or all rows of a journal
+   b->rows = 0;
+   memset (b->has, 0, sizeof (b->has));
+   *endp = 8;
+   struct stat st;
+   if (fstat (fd, &st))
+      return "Cannot stat file";
+   if (st.st_size < 8)
+   {
+      uint32_t head[2] = { FILEMAGIC, day };
+      if (ftruncate (fd, 0) || pwrite (fd, head, sizeof (head), 0) != sizeof (head))
+         return "Cannot write file";
+      return NULL;
+   }
+   uint8_t *map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   if (map == MAP_FAILED)
+      return "Cannot map file";
+   if (*(uint32_t *) map != FILEMAGIC)
+   {
+      munmap (map, st.st_size);
+      return "Not a store file";
+   }
+   block_t *t = malloc (sizeof (*t));
+   off_t o = 8,
+      last = -1;
+   while (o < st.st_size)
+   {
+      const blockhead_t *h = (const void *) (map + o);
+      if (decode (map + o, st.st_size - o, t) < 0)
+         break;
+      last = o;
+      o += h->size;
+      if (journal)
+         for (int r = 0; r < t->rows && b->rows < BLOCKROWS; r++)
+         {
+            int n = b->rows++;
+            b->utc[n] = t->utc[r];
+            for (int c = 0; c < COLS; c++)
+               if (t->has[c] & (1ULL << r))
+               {
+                  b->val[c][n] = t->val[c][r];
+                  b->has[c] |= (1ULL << n);
+               }
+         }
+   }
+   if (!journal && last >= 0)
+      decode (map + last, st.st_size - last, b);
+   free (t);
+   munmap (map, st.st_size);
+   *endp = o;
+   if (o < st.st_size && ftruncate (fd, o))
+      return "Cannot truncate file";
+   return NULL;
+}
+
+static const char *
+flush (tagfile_t * f)
+{                               // Append the journal rows to the day file as one block, then empty the journal
+   if (!f->block.rows)
+      return NULL;
+   size_t len;
+   uint8_t *buf = encode (&f->block, 0, f->block.rows, &len);
+   int bad = (pwrite (f->fd, buf, len, f->tail) != (ssize_t) len || fdatasync (f->fd));
+   free (buf);
+   if (bad)
+      return "Cannot write file";
+   f->tail += len;
+   f->block.rows = 0;
+   memset (f->block.has, 0, sizeof (f->block.has));
+   if (ftruncate (f->jfd, 8))
+      return "Cannot truncate journal";
+   f->jtail = 8;
+   return NULL;
+}
+
+static int
+tagreopen (fks_t * s, tagfile_t * f, time_t day, int flags)
+{                               // Open the files for a day, non zero if failed
+   char *path = filename (s->dir, f->tag, day, "fks");
+   f->fd = open (path, O_RDWR | flags, 0666);
+   free (path);
+   if (f->fd < 0)
+      return -1;
+   path = filename (s->dir, f->tag, day, "fkj");
+   f->jfd = open (path, O_RDWR | flags, 0666);
+   free (path);
+   if (f->jfd < 0)
+   {
+      close (f->fd);
+      f->fd = -1;
+      return -1;
+   }
+   s->open++;
+   return 0;
+}
+
+static const char *
+tagopen (fks_t * s, tagfile_t * f, time_t day)
+{                               // Open the files for a day, carrying on its journal
+   if (f->fd >= 0)
+   {
+      if (f->day != day)
+         flush (f);             // Finish off the old day
+      close (f->fd);
+      close (f->jfd);
+      s->open--;
+   }
+   f->fd = -1;
+   char *path = NULL;
+   asprintf (&path, "%s/%s", s->dir, f->tag);
+   mkdir (path, 0777);
+   free (path);
+   if (tagreopen (s, f, day, O_CREAT))
+      return "Cannot open file";
+   f->day = day;
+   block_t *last = malloc (sizeof (*last));
+   const char *err = scan (f->fd, day, &f->tail, last, 0);
+   if (!err)
+      err = scan (f->jfd, day, &f->jtail, &f->block, 1);
+   if (!err && f->block.rows && last->rows > f->block.rows)
+   {                            // Journal may already be in the day file, if stopped before it was emptied
+      int r;
+      for (r = 0; r < f->block.rows && f->block.utc[r] == last->utc[r]; r++);
+      if (r == f->block.rows)
+      {
+         f->block.rows = 0;
+         memset (f->block.has, 0, sizeof (f->block.has));
+         if (ftruncate (f->jfd, 8))
+            err = "Cannot truncate journal";
+         f->jtail = 8;
+      }
+   }
+   free (last);
+   if (!err && f->block.rows == BLOCKROWS)
+      err = flush (f);
+   if (err)
+   {
+      close (f->fd);
+      close (f->jfd);
+      f->fd = -1;
+      s->open--;
+   }
+   return err;
+}
+
+const char *
+fks_append (fks_t * s, const char *tag, time_t utc, const double *val)
+{
+   if (!tag || !*tag || *tag == '.' || strchr (tag, '/') || utc < 0)
+      return "Bad tag or time";
+   const char *err = NULL;
+   pthread_mutex_lock (&s->mutex);
+   tagfile_t **fp,
+    *f;
+   for (fp = &s->files; (f = *fp) && strcmp (f->tag, tag); fp = &f->next);
+   if (f)
+      *fp = f->next;            // Unlink, to move to the front
+   else
+   {
+      f = calloc (1, sizeof (*f));
+      f->tag = strdup (tag);
+      f->fd = -1;
+   }
+   f->next = s->files;
+   s->files = f;
+   time_t day = utc - utc % 86400;
+   if (f->fd < 0 && s->open >= MAXOPEN)
+   {                            // Close the least recently used
+      tagfile_t *lru = NULL;
+      for (tagfile_t *o = f->next; o; o = o->next)
+         if (o->fd >= 0)
+            lru = o;
+      if (lru)
+      {
+         close (lru->fd);
+         close (lru->jfd);
+         lru->fd = -1;
+         lru->closed = 1;
+         s->open--;
+      }
+   }
+   if (f->fd < 0 && f->closed && f->day == day)
+      tagreopen (s, f, day, 0); // Carry on where it was
+   f->closed = 0;
+   if (f->fd < 0 || f->day != day)
+      err = tagopen (s, f, day);
+   if (!err && f->block.rows == BLOCKROWS)
+      err = flush (f);          // Failed last time
+   if (!err)
+   {
+      block_t *b = &f->block;
+      int r = b->rows++;
+      b->utc[r] = utc;
+      for (int c = 0; c < COLS; c++)
+         if (!isnan (val[c]))
+         {
+            b->val[c][r] = llround (val[c] * pow10s[fks_cols[c].decimals]);
+            b->has[c] |= (1ULL << r);
+         }
+      size_t len;
+      uint8_t *buf = encode (b, r, 1, &len);
+      if (pwrite (f->jfd, buf, len, f->jtail) != (ssize_t) len)
+      {
+         err = "Cannot write journal";
+         b->rows--;
+         for (int c = 0; c < COLS; c++)
+            b->has[c] &= ~(1ULL << r);
+      } else
+      {
+         f->jtail += len;
+         if (b->rows == BLOCKROWS)
+            err = flush (f);
+      }
+      free (buf);
+   }
+   pthread_mutex_unlock (&s->mutex);
+   return err;
+}
+
+fks_rows_t *
+fks_load (const char *dir, const char *tag, time_t from, time_t to)
+{
+   fks_rows_t *d = calloc (1, sizeof (*d));
+   if (!tag || !*tag || *tag == '.' || strchr (tag, '/') || from < 0)
+      return d;
+   int max = 0;
+   block_t *b = malloc (sizeof (*b));
+   for (time_t day = from - from % 86400; day < to; day += 86400)
+      for (int j = 0; j < 2; j++)
+      {                         // Day file, then its journal
+         char *path = filename (dir, tag, day, j ? "fkj" : "fks");
+         int fd = open (path, O_RDONLY);
+         free (path);
+         if (fd < 0)
+            continue;
+         struct stat st;
+         uint8_t *map = MAP_FAILED;
+         if (!fstat (fd, &st) && st.st_size > 8)
+            map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+         close (fd);
+         if (map == MAP_FAILED)
+            continue;
+         if (*(uint32_t *) map == FILEMAGIC)
+            for (off_t o = 8; o + (off_t) sizeof (blockhead_t) <= st.st_size;)
+            {
+               const blockhead_t *h = (const void *) (map + o);
+               if (h->magic != BLOCKMAGIC || h->size < sizeof (*h) || h->size > st.st_size - o)
+                  break;
+               o += h->size;
+               if (h->to < from || h->from >= to)
+                  continue;        // Not the times we want
+               if (decode ((const uint8_t *) h, h->size, b) < 0)
+                  break;
+               for (int r = 0; r < b->rows; r++)
+               {
+                  if (b->utc[r] < from || b->utc[r] >= to)
+                     continue;
+                  if (d->rows == max)
+                  {
+                     max += 1024;
+                     d->utc = realloc (d->utc, max * sizeof (*d->utc));
+                     for (int c = 0; c < COLS; c++)
+                        if (d->val[c])
+                           d->val[c] = realloc (d->val[c], max * sizeof (double));
+                  }
+                  d->utc[d->rows] = b->utc[r];
+                  for (int c = 0; c < COLS; c++)
+                  {
+                     if (!d->val[c])
+                     {
+                        if (!(b->has[c] & (1ULL << r)))
+                           continue;
+                        d->val[c] = malloc (max * sizeof (double));
+                        for (int n = 0; n < d->rows; n++)
+                           d->val[c][n] = NAN;
+                     }
+                     d->val[c][d->rows] =
+                        (b->has[c] & (1ULL << r)) ? (double) b->val[c][r] / pow10s[fks_cols[c].decimals] : NAN;
+                  }
+                  d->rows++;
+               }
+            }
+         munmap (map, st.st_size);
+      }
+   free (b);
+   // Rows are usually in order, but backfilled rows may not be, and there may be duplicates
+   int *order = malloc ((d->rows + 1) * sizeof (*order));
+   for (int n = 0; n < d->rows; n++)
+      order[n] = n;
+   int cmp (const void *a, const void *b)
+   {
+      int x = *(const int *) a,
+         y = *(const int *) b;
+      if (d->utc[x] != d->utc[y])
+         return d->utc[x] < d->utc[y] ? -1 : 1;
+      return x - y;             // Stable, first stored wins
+   }
+   qsort (order, d->rows, sizeof (*order), cmp);
+   int rows = 0;
+   for (int n = 0; n < d->rows; n++)
+      if (!rows || d->utc[order[n]] != d->utc[order[rows - 1]])
+         order[rows++] = order[n];
+   time_t *utc = malloc ((rows + 1) * sizeof (*utc));
+   for (int n = 0; n < rows; n++)
+      utc[n] = d->utc[order[n]];
+   free (d->utc);
+   d->utc = utc;
+   for (int c = 0; c < COLS; c++)
+      if (d->val[c])
+      {
+         double *v = malloc ((rows + 1) * sizeof (*v));
+         for (int n = 0; n < rows; n++)
+            v[n] = d->val[c][order[n]];
+         free (d->val[c]);
+         d->val[c] = v;
+      }
+   d->rows = rows;
+   free (order);
+   return d;
+}
+
+void
+fks_free (fks_rows_t * d)
+{
+   if (!d)
+      return;
+   free (d->utc);
+   for (int c = 0; c < COLS; c++)
+      free (d->val[c]);
+   free (d);
+}
+
+int
+fks_expire (const char *dir, time_t before)
+{
+   int n = 0;
+   DIR *d = opendir (dir);
+   if (!d)
+      return -1;
+   struct dirent *t;
+   while ((t = readdir (d)))
+   {
+      if (*t->d_name == '.')
+         continue;
+      char *tagdir = NULL;
+      asprintf (&tagdir, "%s/%s", dir, t->d_name);
+      DIR *td = opendir (tagdir);
+      free (tagdir);
+      if (!td)
+         continue;
+      struct dirent *f;
+      while ((f = readdir (td)))
+      {
+         struct tm tm = { 0 };
+         const char *end = strptime (f->d_name, "%Y-%m-%d", &tm);
+         if (end && (!strcmp (end, ".fks") || !strcmp (end, ".fkj")) && timegm (&tm) + 86400 <= before && !unlinkat (dirfd (td), f->d_name, 0))
+            n++;
+      }
+      closedir (td);
+   }
+   closedir (d);
+   return n;
+}
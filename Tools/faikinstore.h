@@ -0,0 +1,55 @@
+// Faikin columnar file store, an alternative to SQL for faikinlog and faikingraph
+// Copyright (c) 2022 Adrian Kennard, Andrews & Arnold Limited, see LICENSE file (GPL)
+// One append only file per tag per (UTC) day, dir/tag/YYYY-MM-DD.fks, made of blocks of up to 64 rows. Each block
+// has its time range in its header (so readers skip to the times they want), a zigzag varint delta encoded time
+// column, and for each column with any values in the block, its name, decimal places, and delta encoded values.
+// Rows are appended one at a time, as one row blocks, to a journal, dir/tag/YYYY-MM-DD.fkj, in the same format, until
+// there are 64, which are then appended as one block to the day file and the journal emptied. Neither file is ever
+// rewritten, so a crash loses at most the row being written. Readers read both.
+
+#ifndef FAIKINSTORE_H
+#define FAIKINSTORE_H
+
+#include <stdint.h>
+#include <time.h>
+
+enum
+{                               // Columns, as faikinlog stores them, from acextras.m
+#define	b(name)	col_##name,
+#define	i(name)	col_min##name,col_##name,col_max##name,
+#define	t(name)	col_min##name,col_##name,col_max##name,
+#define	r(name)	col_min##name,col_max##name,
+#define	e(name,t)	col_##name,
+#include "acextras.m"
+   COLS
+};
+
+typedef struct fks_col_s fks_col_t;
+struct fks_col_s
+{
+   const char *name;
+   uint8_t decimals;            // Stored as integer times 10^decimals
+   uint8_t isenum;              // Single character, stored as its code
+};
+extern const fks_col_t fks_cols[COLS];
+
+int fks_colindex (const char *name, size_t len);        // Column by name, or -1
+
+typedef struct fks_s fks_t;
+fks_t *fks_open (const char *dir);      // Store for writing
+void fks_close (fks_t *);
+const char *fks_append (fks_t *, const char *tag, time_t utc, const double *val);       // COLS values, NAN for none, returns error
+
+typedef struct fks_rows_s fks_rows_t;
+struct fks_rows_s
+{                               // Rows read, in time order
+   int rows;
+   time_t *utc;
+   double *val[COLS];           // NULL if no values, NAN for none
+};
+fks_rows_t *fks_load (const char *dir, const char *tag, time_t from, time_t to);        // Rows from <= utc < to
+void fks_free (fks_rows_t *);
+
+int fks_expire (const char *dir, time_t before); // Delete days wholly before, returns files deleted, -1 if no dir
+
+#endif